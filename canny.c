@@ -37,44 +37,607 @@ Mike Heath
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
 #include "mpi.h"
 
-#define VERBOSE 1
+/* Los motores vectoriales del blur solo se compilan con gcc/clang en x86 */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLUR_X86 1
+#include <immintrin.h>
+#endif
+
+/* Con -DPRODUCTION=1 no quedan barreras ni mensajes de las etapas (metrics.c) */
+#ifndef PRODUCTION
+#define PRODUCTION 0
+#endif
+#define VERBOSE (!PRODUCTION)
 #define BOOSTBLURFACTOR 90.0
 
+/* Descomposiciones del trabajo entre los ranks */
+#define DECOMP_REPLICATED 0   /* cada rank guarda las imagenes completas */
+#define DECOMP_HALO       1   /* cada rank guarda su franja de filas y un halo */
+
+/* Juegos de instrucciones del blur, de menor a mayor ancho de vector */
+#define ISA_AUTO   -1   /* el mejor que soporte el procesador */
+#define ISA_SCALAR  0
+#define ISA_SSE2    1   /* 4 floats u 8 enteros de 16 bits por instruccion */
+#define ISA_AVX2    2   /* 8 floats o 16 enteros de 16 bits */
+#define ISA_AVX512  3   /* 16 floats o 32 enteros de 16 bits */
+
+/* Etapas que run_stage reparte en bandas de filas entre los hilos */
+#define STAGE_BLUR_X    0
+#define STAGE_BLUR_Y    1
+#define STAGE_DERIV_X   2
+#define STAGE_DERIV_Y   3
+#define STAGE_MAGNITUDE 4
+#define STAGE_NMS       5
+
+/* Fases medidas por metrics.c; las de calculo primero */
+#define PHASE_SMOOTH      0
+#define PHASE_BLUR_X      1
+#define PHASE_BLUR_Y      2
+#define PHASE_DERIV       3
+#define PHASE_MAGNITUDE   4
+#define PHASE_NMS         5
+#define PHASE_FUSED       6
+#define PHASE_HISTOGRAM   7
+#define PHASE_HYSTERESIS  8
+#define PHASE_HALO        9
+#define PHASE_ALLGATHER  10
+#define PHASE_GATHER     11
+#define PHASE_ALLREDUCE  12
+#define PHASE_THRESHOLDS 13
+#define PHASE_MERGE      14
+#define PHASE_READ       15
+#define PHASE_WRITE      16
+#define PHASE_DIRECTION  17
+#define PHASE_BARRIER    18
+#define PHASE_BALANCE    19
+#define NPHASES          20
+#define PHASE_DEPTH       8   /* fases anidadas como mucho */
+
+/* Clases de fase */
+#define PHASE_COMPUTE 0
+#define PHASE_COMM    1
+#define PHASE_IO      2
+#define PHASE_WAIT    3
+
+/* Pesos en punto fijo del blur (-blur fixed) */
+#define BLUR_QMAX  32000   /* mayor peso, cabe en un short con margen */
+#define BLUR_QXBITS 22     /* bits de fraccion en x como mucho: 128 * 2^22 cabe en un int */
+#define BLUR_QYBITS 15     /* y en y: 32768 * 2^15 cabe en un int */
+#define BLUR_BOOST ((int)BOOSTBLURFACTOR)   /* debe ser entero */
+
+/* Blur recursivo de Young y van Vliet (-blur iir) */
+#define IIR_WARMUP   3.0   /* pixeles de arranque de cada pasada, en sigmas */
+#define IIR_BLOCK    2     /* largo de los bloques, en pixeles de arranque */
+#define IIR_MINSIGMA 0.5   /* la formula de q vale desde aqui */
+#define IIR_GROUP    64    /* filas que el blur en x filtra juntas */
+
+/* Modo batch (-batch) */
+#define BATCH_NAMELEN   4096   /* largo maximo de la ruta de una imagen */
+#define BATCH_TAG_READY 1      /* un lider pide trabajo y entrega su resultado */
+#define BATCH_TAG_WORK  2      /* el maestro asigna una imagen, -1 termina la fase */
+
+/* Modo streaming (-stream) */
+#define STREAM_ROWS 64         /* filas de cada banda */
+
+#define ARENA_ALIGN 64               /* alineacion de los buffers, una linea de cache */
+#define ARENA_HUGE  (2L << 20)       /* desde 2 MB van alineados a paginas grandes */
+
+/* Reparto de las filas entre los procesos (-balance) */
+#define BALANCE_NONE  0   /* franjas iguales */
+#define BALANCE_EDGES 1   /* la hysteresis se reparte segun los candidatos */
+#define BALANCE_TIME  2   /* la siguiente imagen segun lo que demoro cada rank */
+#define BALANCE_EDGE_COST 32.0   /* un candidato cuesta como 32 pixeles */
+
+#define PIPE_CHUNKS 4          /* trozos de cada franja entre las comunicaciones */
+
+/* Colectivas de las etapas (-coll, coll.c) */
+#define COLL_FLAT  0   /* una colectiva en canny_comm */
+#define COLL_NODE  1   /* en el nodo, entre los lideres y otra vez en el nodo */
+#define COLL_BOTH  2   /* -bench corre cada caso con las dos */
+#define COLL_INTRA 0   /* bytes enviados dentro del nodo */
+#define COLL_INTER 1   /* y a otros nodos */
+
+/* Clases de imagenes sinteticas del benchmark (bench.c) */
+#define SYNTH_NOISE    0   /* ruido uniforme, bordes en todas partes */
+#define SYNTH_GRADIENT 1   /* rampa suave con poco ruido, casi sin bordes */
+#define SYNTH_DENSE    2   /* tablero de cuadros de 8 pixeles, bordes densos */
+#define SYNTH_SPARSE   3   /* algunos discos sobre un fondo, bordes escasos */
+#define NSYNTH         4
+#define BENCH_LIST    32   /* valores de cada lista de -bench como mucho */
+
+/*******************************************************************************
+* Un plano es la porcion local de una imagen intermedia. Guarda las filas
+* [r0,r1) y las columnas [c0,c1) de la imagen completa, fila por fila. Las
+* coordenadas que reciben los nucleos son siempre las de la imagen completa.
+*******************************************************************************/
+typedef struct {
+   void *data;
+   int r0, r1;
+   int c0, c1;
+} plane;
+
+#define PLANE_PTR(p, type, r, c) ((type *)(p)->data + \
+   (long)((r) - (p)->r0) * ((p)->c1 - (p)->c0) + ((c) - (p)->c0))
+
+/*******************************************************************************
+* Los mapas de nms y de bordes guardan un bit por pixel (bitmap.c): cada fila
+* son BITS_WORDS(cols) palabras y el pixel c es el bit c%64 de la palabra
+* c/64. Sus planos tienen esas palabras como columnas.
+*******************************************************************************/
+typedef unsigned long long bitword;
+#define BITS_WORD 64
+#define BITS_WORDS(n) (((n) + BITS_WORD - 1) / BITS_WORD)
+#define MPI_BITWORD MPI_UNSIGNED_LONG_LONG
+
+/*******************************************************************************
+* El nucleo del blur con las tablas que preparan los motores de blur.c. Las
+* columnas y filas de cada borde tienen su propia ranura con la suma de los
+* pesos que caen dentro de la imagen (y sus pesos en punto fijo ya
+* normalizados); la ranura center es la del interior.
+*******************************************************************************/
+typedef struct {
+   float *kernel;             /* nucleo gaussiano de windowsize pesos */
+   int windowsize, center;
+   int rows, cols;            /* dimensiones de la imagen */
+   int fixed;                 /* tempim en punto fijo Q7 (short) o en float */
+   int isa;                   /* juego de instrucciones elegido */
+   float *normx, *normy;      /* suma de pesos de cada ranura, 2*center+1 */
+   short *qx, *qy;            /* pesos en punto fijo, windowsize por ranura */
+   int qxbits, qybits;        /* los pesos suman 2^qxbits y 2^qybits */
+   int iir;                   /* blur recursivo en vez del nucleo */
+   int block, warmup;         /* bloques del blur recursivo y su arranque */
+   float iirb[4];             /* B, b1/b0, b2/b0 y b3/b0 de Young y van Vliet */
+   int boosted;               /* la entrada es una imagen suavizada (short por
+                                 BOOSTBLURFACTOR) en vez de los pixeles */
+} blur_kernel;
+
+/* Un buffer de arena.c, libre o en uso */
+typedef struct {
+   void *data;
+   size_t cap;                /* bytes reservados */
+   int used;
+} arena_block;
+
+/* Una imagen completa en la memoria compartida del nodo (shared.c) */
+typedef struct {
+   void *data;
+   MPI_Win win;
+} shared_frame;
+
+/* Los allgather no bloqueantes de los trozos de las franjas, en curso */
+typedef struct {
+   int *counts, *displs;      /* size enteros por allgather, vivos hasta el final */
+   MPI_Request *reqs;
+   int nreq, max;
+} strip_pipe;
+
+/* Una etapa repartida entre los hilos de pool.c: sus planos y su region */
+typedef struct {
+   int op;                    /* STAGE_* */
+   plane *in, *in2, *in3, *out;
+   int r0, r1, c0, c1;
+   int rows, cols;            /* dimensiones de la imagen */
+   blur_kernel *bk;
+   int nbands;                /* bandas de filas (tareas) */
+} stage_job;
+
+/* Las teselas de fused_strip, repartidas entre los hilos */
+typedef struct {
+   plane *img, *mag, *nms, *dxout, *dyout;
+   int rows, cols, r0, r1;
+   int th, tw, ntilecols;     /* tamanio de tesela y teselas por fila */
+   blur_kernel *bk;
+   plane *buf;                /* 5 buffers de tesela por hilo */
+} fused_job;
+
+/*******************************************************************************
+* La malla de teselas de -grid (grid.c): dims[0] x dims[1] procesos en un
+* comunicador cartesiano, cada uno con las filas [r0,r1) y las columnas
+* [c0,c1) de la imagen. Los limites de las columnas son multiplos de 64, asi
+* los mapas de bits de cada tesela son palabras enteras. Los ranks que no
+* caben en la malla tienen una tesela vacia y comm MPI_COMM_NULL.
+*******************************************************************************/
+typedef struct {
+   MPI_Comm comm;             /* malla cartesiana, con los ranks de canny_comm */
+   int dims[2], coords[2];    /* filas y columnas de teselas, y las de este rank */
+   int *rowstart, *colstart;  /* limites de las filas y de las columnas */
+   int north, south, west, east;   /* vecinos, MPI_PROC_NULL en los bordes */
+   int r0, r1, c0, c1;        /* tesela propia */
+} tile_grid;
+
+/* Las pasadas de hysteresis_strip, repartidas entre los hilos */
+#define HYST_MAP   0   /* mapa de candidatos e histograma */
+#define HYST_LOW   1   /* quita los candidatos bajo el umbral bajo */
+#define HYST_LABEL 2   /* etiqueta cada banda */
+#define HYST_SEED  3   /* etiquetas consecutivas y semillas */
+#define HYST_ROOT  4   /* etiqueta de la raiz de cada componente */
+#define HYST_EDGE  5   /* bordes de las componentes con semilla */
+
+typedef struct {
+   int pass;                  /* HYST_* */
+   plane *mag, *nms, *mapp, *labelp, *edge;
+   plane *cand;               /* candidatos de HYST_MAP, mapp salvo con -sweep */
+   plane map, label, candmap; /* los planos de hysteresis_open */
+   int *rowstart;             /* franjas, o la malla tg con -grid */
+   tile_grid *tg;
+   int rows, cols, r0, r1, nbands;
+   int c0, c1;                /* columnas propias, las de la tesela con -grid */
+   int *hist, *localmax;      /* histograma y mayor magnitud de cada hilo */
+   int lowthreshold, highthreshold;
+   int *nlabels, *offset;     /* etiquetas de cada banda y su desplazamiento */
+   int labeloffset;           /* desplazamiento de las etiquetas del rank */
+   unsigned char *seed;
+   int *root;                 /* raiz de cada etiqueta */
+} hyst_job;
+
+/* Una imagen del modo batch */
+typedef struct {
+   char *name;
+   int rows, cols;
+   int ranks;                 /* procesos del grupo que la procesa, 0 si no se lee */
+   double time;               /* segundos que demoro, negativo si fallo */
+} batch_item;
+
+/* El union-find de las etiquetas del modo streaming */
+typedef struct {
+   int *parent;
+   unsigned char *seed;       /* la componente tiene un pixel fuerte */
+   int nlabels;
+   long cap;                  /* etiquetas que caben */
+} stream_labels;
+
+/* Una corrida del benchmark: la mejor de sus repeticiones */
+typedef struct {
+   int kind;                  /* SYNTH_* */
+   int weak;                  /* escalado debil: la imagen crece con los procesos */
+   int base;                  /* lado de la imagen con un proceso */
+   int rows, cols, ranks;
+   float sigma, tlow, thigh;
+   double time;               /* del proceso mas lento, negativo si fallo */
+   double phase[NPHASES];     /* tiempo propio de cada fase, el mayor */
+   long calls[NPHASES];
+   int coll;                  /* COLL_FLAT o COLL_NODE */
+   long bytes[2];             /* enviados en el nodo y entre nodos, la suma */
+} bench_result;
+
 int read_pgm_image(char *infilename, unsigned char **image, int *rows,
     int *cols);
 int write_pgm_image(char *outfilename, unsigned char *image, int rows,
     int cols, char *comment, int maxval);
+int read_pgm_header(FILE *fp, char *infilename, int *rows, int *cols);
+int read_pgm_info(char *infilename, int *rows, int *cols, MPI_Offset *offset);
+int read_pgm_shared(char *infilename, unsigned char **image, int *rows,
+    int *cols);
+int read_pgm_rows(char *infilename, MPI_Offset offset, int cols, int r0,
+    int r1, plane *img);
+int write_pgm_rows(char *outfilename, plane *img, int rows, int cols,
+    char *comment, int maxval);
+int open_pgm_rows(char *outfilename, int rows, int cols, char *comment,
+    int maxval, MPI_File *fh);
+int tile_view(MPI_File fh, MPI_Offset disp, plane *p, int rows, int cols,
+    MPI_Datatype type);
+int read_pgm_tile(char *infilename, MPI_Offset offset, int rows, int cols,
+    int r0, int r1, int c0, int c1, plane *img);
+int write_pgm_tile(char *outfilename, plane *img, int rows, int cols,
+    char *comment, int maxval);
 
 void canny(unsigned char *image, int rows, int cols, float sigma,
-         float tlow, float thigh, unsigned char **edge, char *fname);
+         float tlow, float thigh, bitword **edge, char *fname);
 void gaussian_smooth(unsigned char *image, int rows, int cols, float sigma,
         short int **smoothedim);
 void make_gaussian_kernel(float sigma, float **kernel, int *windowsize);
+int gaussian_window(float sigma);
 void derrivative_x_y(short int *smoothedim, int rows, int cols,
         short int **delta_x, short int **delta_y);
 void magnitude_x_y(short int *delta_x, short int *delta_y, int rows, int cols,
         short int **magnitude);
-void apply_hysteresis(short int *mag, unsigned char *nms, int rows, int cols,
-        float tlow, float thigh, unsigned char *edge);
+void apply_hysteresis(short int *mag, bitword *nms, int rows, int cols,
+        float tlow, float thigh, bitword *edge);
+void hysteresis_strip(plane *mag, plane *nms, int rows, int cols, float tlow,
+        float thigh, plane *edge, int *rowstart, tile_grid *tg);
+void merge_strip_labels(plane *labelp, unsigned char *seed, int nlabels,
+        int offset, int cols, int *rowstart);
+void merge_tile_labels(plane *labelp, unsigned char *seed, int nlabels,
+        int offset, tile_grid *tg);
+void join_boundary_labels(int *pairs, int npairs, int *info, int ninfo,
+        unsigned char *seed, int nlabels, int offset);
+void hysteresis_open(hyst_job *job, plane *mag, plane *nms, int rows,
+        int cols, int *rowstart, tile_grid *tg, int n, float *tlow,
+        float *thigh, int *low, int *high, int keep);
+void hysteresis_edges(hyst_job *job, int lowthreshold, int highthreshold,
+        plane *edge);
+void hysteresis_close(hyst_job *job);
+int hysteresis_sweep(plane *mag, plane *nms, int rows, int cols,
+        int *rowstart, tile_grid *tg, char *infilename, float sigma);
+void hysteresis_task(int t, int worker, void *arg);
+int label_edges(plane *mapp, plane *labelp, int r0, int r1, int c0, int c1);
+int compare_int(const void *a, const void *b);
+int find_root(int *parent, int i);
+int label_index(int *info, int n, int label);
+int sample_pixel(int r, int c, int cols, int n);
+void select_thresholds(int *hist, int localmax, float tlow, float thigh,
+        int *lowthreshold, int *highthreshold);
+void select_threshold_list(int *hist, int localmax, int n, float *tlow,
+        float *thigh, int *low, int *high);
 void radian_direction(short int *delta_x, short int *delta_y, int rows,
     int cols, float **dir_radians, int xdirtag, int ydirtag);
 double angle_radians(double x, double y);
+void non_max_supp(short *mag, short *gradx, short *grady, int nrows, int ncols,
+    bitword *result);
+
+int canny_file(char *infilename, float sigma, float tlow, float thigh,
+        int writedir, int *rows, int *cols);
+int canny_halo(plane *img, int rows, int cols, int *rowstart, float sigma,
+         float tlow, float thigh, plane *edge, char *fname, char *infilename);
+void smooth_strip(plane *in, int rows, int cols, int *rowstart,
+        blur_kernel *bk, plane *smoothedim);
+void gradient_strip(plane *smoothedim, int rows, int cols, int *rowstart,
+        char *fname, plane *magnitude, plane *nms);
+int write_edge_strip(plane *edgep, int rows, int cols, char *outfilename);
+void write_direction_strips(plane *dx, plane *dy, int *rowstart, int cols,
+        char *fname);
+void fused_strip(plane *img, int rows, int cols, int r0, int r1,
+        blur_kernel *bk, plane *mag, plane *nms, plane *dxout, plane *dyout);
+int canny_scales(plane *img, int rows, int cols, int *rowstart, float tlow,
+        float thigh, int writedir, char *infilename);
+void fused_tile(int t, int worker, void *arg);
+int canny_grid(char *infilename, MPI_Offset offset, int rows, int cols,
+        float sigma, float tlow, float thigh, char *dirname, char *outfilename);
+void tile_setup(tile_grid *tg, int rows, int cols, int halo);
+void tile_free(tile_grid *tg);
+void tile_plane(plane *p, tile_grid *tg, int hr, int hc, int rows, int cols,
+        size_t elsize, char *name);
+void tile_bits(plane *p, tile_grid *tg, char *name);
+void exchange_tile_cols(plane *p, MPI_Datatype type, int hc, tile_grid *tg);
+int exchange_tile_rows_start(plane *p, MPI_Datatype type, int hr,
+        tile_grid *tg, MPI_Request *reqs);
+void exchange_tile_halo(plane *p, MPI_Datatype type, int hr, int hc,
+        tile_grid *tg);
+void tile_stage(int op, plane *in, plane *in2, plane *in3, plane *out,
+        MPI_Datatype type, int hr, int hc, int rows, int cols, tile_grid *tg,
+        blur_kernel *bk);
+void write_direction_tile(plane *dx, plane *dy, int rows, int cols,
+        char *fname);
+void make_partition(int rows, int nparts, int *rowstart);
+void *arena_alloc(size_t bytes, int zero, char *name);
+void arena_free(void *data);
+void arena_geometry(int rows, int cols);
+void arena_release(void);
+void node_setup(void);
+void node_free(void);
+void *frame_alloc(size_t bytes, char *name);
+void frame_free(void *data);
+MPI_Win frame_window(void *data);
+void node_sync(MPI_Win win);
+void node_allgather(plane *p, MPI_Datatype type, int *rowstart, int cols);
+void coll_flat_bytes(long bytes);
+void coll_allgatherv(void *buf, int *counts, int *displs, MPI_Datatype type,
+        int mode, MPI_Win win);
+void coll_gatherv(void *send, int n, void *full, int *counts, int *displs,
+        MPI_Datatype type, int mode);
+void coll_reduce_scatter(void *send, void *recv, int *counts,
+        MPI_Datatype type, MPI_Op op, int mode);
+void plane_free(plane *p);
+void plane_clear(plane *p, size_t elsize);
+void weighted_partition(int rows, int nparts, double *weight, int *rowstart);
+void share_partition(int rows, int nparts, double *share, int *rowstart);
+void move_strips(plane *p, MPI_Datatype type, int *from, int *to, int rows,
+        int cols, char *name);
+void balance_edges(plane *mag, plane *nms, int rows, int cols, int *rowstart);
+void balance_time(int *rowstart, int cols, double t);
+void plane_alloc(plane *p, int r0, int r1, int c0, int c1, size_t elsize,
+        char *name);
+void plane_move(plane *p, int r0, int r1, int c0, int c1, int rows, int cols);
+void strip_plane(plane *p, int *rowstart, int halo, int rows, int cols,
+        size_t elsize, char *name);
+void exchange_halo(plane *p, MPI_Datatype type, int halo, int *rowstart);
+int exchange_halo_start(plane *p, MPI_Datatype type, int halo, int *rowstart,
+        MPI_Request *reqs);
+void overlap_stage(int op, plane *in, plane *in2, plane *in3, plane *out,
+        MPI_Datatype type, int halo, int rows, int cols, int *rowstart,
+        blur_kernel *bk);
+void pipe_open(strip_pipe *sp, int max);
+void pipe_rows(int *rowstart, int q, int k, int *a, int *b);
+void pipe_allgather(strip_pipe *sp, plane *p, MPI_Datatype type,
+        int *rowstart, int cols, int k);
+void pipe_close(strip_pipe *sp);
+void gather_strips(plane *p, MPI_Datatype type, int *rowstart, int cols,
+        void *full);
+void full_plane(plane *p, void *data, int rows, int cols);
+void derivative_x_plane(plane *sm, plane *dx, int r0, int r1, int c0, int c1,
+        int cols);
+void derivative_y_plane(plane *sm, plane *dy, int r0, int r1, int c0, int c1,
+        int rows);
+void magnitude_plane(plane *dx, plane *dy, plane *mag, int r0, int r1, int c0,
+        int c1);
+void non_max_supp_plane(plane *mag, plane *gradx, plane *grady, plane *result,
+        int r0, int r1, int c0, int c1, int rows, int cols);
+
+void blur_setup(blur_kernel *bk, float sigma, int rows, int cols);
+void blur_free(blur_kernel *bk);
+void blur_cascade_setup(blur_kernel *bk, float sigma, int rows, int cols);
+int blur_slot(int pos, int n, int center);
+int blur_slot_taps(int s, int n, int center, int *klo, int *khi);
+int blur_best_isa(void);
+int blur_window(float sigma);
+void blur_iir_setup(blur_kernel *bk, float sigma);
+void blur_iir_block(blur_kernel *bk, float *buf, int len, int from, int n);
+void blur_iir_row(blur_kernel *bk, float *row, float *p1, float *p2,
+        float *p3, int n);
+void blur_x_iir(plane *in, plane *out, int r0, int r1, int c0, int c1,
+        blur_kernel *bk);
+void blur_y_iir(plane *in, plane *out, int r0, int r1, int c0, int c1,
+        blur_kernel *bk);
+void blur_x_pixels(blur_kernel *bk, void *row, int rc0, void *dst, int dc0,
+        int from, int to);
+void blur_x_plane(plane *in, plane *out, int r0, int r1, int c0, int c1,
+        blur_kernel *bk);
+void blur_y_plane(plane *in, plane *out, int r0, int r1, int c0, int c1,
+        blur_kernel *bk);
+int blur_x_float_simd(int isa, float *src, float *dst, int n, float *kernel,
+        int ntaps, float norm);
+int blur_y_float_simd(int isa, float *src, int stride, float *kernel,
+        int ntaps, double norm, short *dst, int n);
+int blur_x_fixed_simd(int isa, short *src, short *dst, int n, short *w,
+        int ntaps, int shift);
+int blur_y_fixed_simd(int isa, short *src, int stride, short *w, int ntaps,
+        int shift, short *dst, int n);
+int blur_iir_simd(int isa, float *row, float *p1, float *p2, float *p3,
+        float *k, int n);
+#ifdef BLUR_X86
+int blur_x_float_sse2(float *src, float *dst, int n, float *kernel, int ntaps,
+        float norm);
+int blur_x_float_avx2(float *src, float *dst, int n, float *kernel, int ntaps,
+        float norm);
+int blur_x_float_avx512(float *src, float *dst, int n, float *kernel,
+        int ntaps, float norm);
+int blur_y_float_sse2(float *src, int stride, float *kernel, int ntaps,
+        double norm, short *dst, int n);
+int blur_y_float_avx2(float *src, int stride, float *kernel, int ntaps,
+        double norm, short *dst, int n);
+int blur_y_float_avx512(float *src, int stride, float *kernel, int ntaps,
+        double norm, short *dst, int n);
+int blur_x_fixed_sse2(short *src, short *dst, int n, short *w, int ntaps,
+        int shift);
+int blur_x_fixed_avx2(short *src, short *dst, int n, short *w, int ntaps,
+        int shift);
+int blur_x_fixed_avx512(short *src, short *dst, int n, short *w, int ntaps,
+        int shift);
+int blur_y_fixed_sse2(short *src, int stride, short *w, int ntaps, int shift,
+        short *dst, int n);
+__m128i blur_mullo_sse2(__m128i a, __m128i b);
+int blur_y_fixed_avx2(short *src, int stride, short *w, int ntaps, int shift,
+        short *dst, int n);
+int blur_y_fixed_avx512(short *src, int stride, short *w, int ntaps,
+        int shift, short *dst, int n);
+int blur_iir_sse2(float *row, float *p1, float *p2, float *p3, float *k,
+        int n);
+int blur_iir_avx2(float *row, float *p1, float *p2, float *p3, float *k,
+        int n);
+int blur_iir_avx512(float *row, float *p1, float *p2, float *p3, float *k,
+        int n);
+#endif
+bitword bits_word(unsigned char *src, int n, unsigned char value, int isa);
+#ifdef BLUR_X86
+bitword bits_word_sse2(unsigned char *src, unsigned char value);
+#endif
+bitword bits_range(int k, int c0, int c1);
+bitword bits_interior(int k, int cols);
+int bits_near(bitword *row, int c, int words);
+int bits_ctz(bitword w);
+int bits_count(bitword *row, int words);
+void bits_unpack(bitword *src, int n, unsigned char one, unsigned char zero,
+        unsigned char *dst);
+void bits_expand(plane *bits, plane *bytes, int cols);
+int nms_isa(void);
+unsigned char nms_pixel(short *magptr, short gx, short gy, int stride);
+void nms_row(short *mag, int stride, short *gx, short *gy,
+        unsigned char *result, int n, int isa);
+#ifdef BLUR_X86
+int nms_row_sse2(short *mag, int stride, short *gx, short *gy,
+        unsigned char *result, int n);
+int nms_row_avx2(short *mag, int stride, short *gx, short *gy,
+        unsigned char *result, int n);
+#endif
+void pool_start(void);
+void pool_stop(void);
+void *pool_main(void *arg);
+int pool_take(int w);
+void pool_work(int w);
+void pool_run(int ntasks, void (*task)(int t, int worker, void *arg),
+        void *arg);
+int pool_bands(int r0, int r1, int minrows);
+void batch_run(char *listname, float sigma, float tlow, float thigh);
+int batch_list(char *listname, batch_item **items);
+int batch_ranks(long pixels, int nworkers);
+int compare_batch(const void *a, const void *b);
+void batch_serve(batch_item *items, int lo, int hi, int ngroups);
+void batch_work(float sigma, float tlow, float thigh);
+void batch_report(batch_item *item);
+int canny_stream(char *infilename, MPI_Offset offset, int rows, int cols,
+        int *rowstart, float sigma, float tlow, float thigh, char *outfilename);
+int stream_band(MPI_File fin, MPI_Offset offset, int rows, int cols, int b0,
+        int b1, int halo, blur_kernel *bk, plane *img, plane *mag, plane *nms);
+void stream_label_row(stream_labels *sl, int *lab, int *lab_up, short *mag,
+        bitword *nms, int cols, int lowthreshold, int highthreshold);
+void stream_labels_init(stream_labels *sl, long cap);
+void stream_labels_reserve(stream_labels *sl, int *labels, int ringrows,
+        int cols, int e, int b0, long need);
+void stream_labels_free(stream_labels *sl);
+void bench_run(char *prefix, char *sigmas, char *tlows, char *thighs);
+int bench_list(char *list, float *values);
+int bench_kinds(char *list, int *kinds);
+void bench_measure(char *fname, bench_result *res);
+void bench_report(char *fname, bench_result *res, int n);
+int synth_image(char *fname, int kind, int rows, int cols);
+unsigned int synth_hash(unsigned int a, unsigned int b);
+unsigned char synth_pixel(int kind, int r, int c, int rows, int cols);
+void phase_begin(int id);
+void phase_end(int id);
+void phase_barrier(void);
+double phase_total(int kind);
+void metrics_report(char *fname);
+void stage_task(int t, int worker, void *arg);
+void run_stage(int op, plane *in, plane *in2, plane *in3, plane *out, int r0,
+        int r1, int c0, int c1, int rows, int cols, blur_kernel *bk);
 
 /* Variables globales */
 int rank, size;
-double tini2, tfin2;
+int decomp = DECOMP_REPLICATED;	/* descomposicion elegida en la linea de comandos */
+int fused_tiles = 0;			/* etapas fusionadas por teselas (-fused) */
+int grid = 0;				/* teselas de una malla cartesiana de ranks (-grid) */
+int sweep = 0;				/* hysteresis con cada par de umbrales (-sweep) */
+float sweep_tlow[BENCH_LIST], sweep_thigh[BENCH_LIST];	/* listas de -sweep */
+int sweep_nlow = 0, sweep_nhigh = 0;
+int scales = 0;				/* varias sigmas en cascada (-scales) */
+float scale_sigma[BENCH_LIST];		/* sigmas de -scales, crecientes */
+int scale_n = 0;
+int scale_combine = 0;			/* mapa con los bordes de todas las escalas (-combine) */
+int tilerows = 0, tilecols = 256;	/* tamanio de tesela, 0 filas = automatico */
+int blur_fixed = 0;			/* blur en punto fijo de 16 bits (-blur fixed) */
+int blur_iir = 0;			/* blur recursivo (-blur iir) */
+int blur_isa = ISA_AUTO;		/* juego de instrucciones del blur y de nms (-isa) */
+int thresh_sample = 1;			/* histograma con un candidato de cada N (-sample) */
+int balance = BALANCE_NONE;		/* reparto de las filas (-balance) */
+double *balance_speed = NULL;		/* pixeles por segundo de cada rank, BALANCE_TIME */
+int balance_nparts = 0;			/* procesos de balance_speed, 0 si no hay medida */
+int nthreads = 1;			/* hilos de cada rank (-threads) */
+MPI_Comm canny_comm;			/* procesos que detectan los bordes de la imagen en curso */
+int node_shared = 0;			/* imagenes completas compartidas en cada nodo (-shared) */
+MPI_Comm node_comm = MPI_COMM_NULL;	/* procesos del nodo (node_setup) */
+MPI_Comm leader_comm = MPI_COMM_NULL;	/* un lider por nodo, MPI_COMM_NULL en el resto */
+MPI_Comm node_parent = MPI_COMM_NULL;	/* canny_comm antes de node_setup */
+int node_rank = 0, node_size = 1;	/* rank y procesos en el nodo */
+int node_id = 0, nnodes = 1;		/* nodo de este proceso y nodos */
+int *node_first = NULL;			/* primer rank de cada nodo en canny_comm, nnodes+1 */
+int coll = COLL_FLAT;			/* colectivas de las etapas (-coll) */
+int batch = 0;				/* lista de imagenes en vez de una imagen (-batch) */
+long batch_pixels = 4194304;		/* pixeles por proceso en el modo batch (-rankpix) */
+int stream = 0;				/* la imagen se procesa por bandas (-stream) */
+int stream_lag = 256;			/* filas de retraso de la hysteresis por bandas (-lag) */
+char *metricsname = NULL;		/* archivo del informe de las fases (-metrics) */
+int bench = 0;				/* benchmark con imagenes sinteticas (-bench) */
+char *bench_sizes = "512,1024,2048";	/* lados de las imagenes (-sizes) */
+char *bench_kindlist = "noise,gradient,dense,sparse";	/* clases (-kinds) */
+int bench_reps = 1;			/* repeticiones de cada corrida (-reps) */
 
 int main(int argc, char *argv[])
 {
 	double tini, tfin;
+	int i, provided;		/* nivel de hilos que da MPI */
    char *infilename = NULL;  /* Name of the input image */
    char *dirfilename = NULL; /* Name of the output gradient direction image */
    char outfilename[128];    /* Name of the output "edge" image */
    char composedfname[128];  /* Name of the output "direction" image */
    unsigned char *image;     /* The input image */
-   unsigned char *edge;      /* The output edge image */
+   bitword *edge;            /* The output edge image, a bit per pixel */
+   plane edgep, edgeb;       /* el mapa de bordes y su imagen en bytes */
    int rows, cols;           /* The dimensions of the image. */
    float sigma,              /* Standard deviation of the gaussian kernel. */
 	 tlow,               /* Fraction of the high threshold in hysteresis. */
@@ -84,16 +647,27 @@ int main(int argc, char *argv[])
 			        gradient image that passes non-maximal
 			        suppression. */
 	
-	MPI_Init (&argc, &argv);
+	/* solo el hilo principal llama a MPI */
+	MPI_Init_thread (&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 	MPI_Comm_size (MPI_COMM_WORLD, &size);
 	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	canny_comm = MPI_COMM_WORLD;
 	
 	/* todos los hilos obtienen sus variables como asi tambien el espacio en memoria */
    /****************************************************************************
    * Get the command line arguments.
    ****************************************************************************/
    if(argc < 5){
-   fprintf(stderr,"\n<USAGE> %s image sigma tlow thigh [writedirim]\n",argv[0]);
+   fprintf(stderr,"\n<USAGE> %s image sigma tlow thigh [writedirim] [-halo]\n",
+      argv[0]);
+   fprintf(stderr,"        [-fused] [-tile RxC] [-blur float|fixed|iir]\n");
+   fprintf(stderr,"        [-isa auto|scalar|sse2|avx2|avx512] [-sample N]\n");
+   fprintf(stderr,"        [-threads N] [-batch] [-rankpix N] [-stream] [-lag N]\n");
+   fprintf(stderr,"        [-metrics file.json|file.csv|-] [-bench] [-sizes N,N..]\n");
+   fprintf(stderr,"        [-kinds noise,gradient,dense,sparse] [-reps N]\n");
+   fprintf(stderr,"        [-balance none|edges|time] [-shared]\n");
+   fprintf(stderr,"        [-coll flat|node|both] [-grid] [-sweep] [-scales]\n");
+   fprintf(stderr,"        [-combine]\n");
       fprintf(stderr,"\n      image:      An image to process. Must be in ");
       fprintf(stderr,"PGM format.\n");
       fprintf(stderr,"      sigma:      Standard deviation of the gaussian");
@@ -106,7 +680,96 @@ int main(int argc, char *argv[])
       fprintf(stderr,"                  the high edge strength threshold.\n");
       fprintf(stderr,"      writedirim: Optional argument to output ");
       fprintf(stderr,"a floating point");
-      fprintf(stderr," direction image.\n\n");
+      fprintf(stderr," direction image.\n");
+      fprintf(stderr,"      -halo:      Each process keeps only its strip of ");
+      fprintf(stderr,"rows plus a halo\n                  exchanged with its ");
+      fprintf(stderr,"neighbours.\n");
+      fprintf(stderr,"      -fused:     Run the stages up to the non-maximal ");
+      fprintf(stderr,"suppression tile by\n                  tile (implies ");
+      fprintf(stderr,"-halo).\n");
+      fprintf(stderr,"      -tile RxC:  Rows and columns of the fused tiles ");
+      fprintf(stderr,"(R=0 chooses the\n                  rows from sigma).\n");
+      fprintf(stderr,"      -blur:      Blur with floats (exact) or with 16 bit ");
+      fprintf(stderr,"fixed point\n                  (within 1 of the float ");
+      fprintf(stderr,"result), or with a recursive filter\n                  ");
+      fprintf(stderr,"whose cost does not grow with sigma (iir,\n");
+      fprintf(stderr,"                  sigma >= 0.5).\n");
+      fprintf(stderr,"      -isa:       Instruction set of the blur and the ");
+      fprintf(stderr,"suppression, by\n                  default the widest one ");
+      fprintf(stderr,"of the processor.\n");
+      fprintf(stderr,"      -sample N:  Take the thresholds from about one ");
+      fprintf(stderr,"possible edge in N\n                  (approximate, for ");
+      fprintf(stderr,"very large images).\n");
+      fprintf(stderr,"      -threads N: Threads of each process; run one process ");
+      fprintf(stderr,"per node or\n                  socket with as many ");
+      fprintf(stderr,"threads as cores.\n");
+      fprintf(stderr,"      -batch:     image is a file with one image per line ");
+      fprintf(stderr,"or a directory of\n                  PGM images, handed ");
+      fprintf(stderr,"out by process 0 to the others\n                  (implies ");
+      fprintf(stderr,"-halo).\n");
+      fprintf(stderr,"      -rankpix N: Pixels per process in batch mode: larger ");
+      fprintf(stderr,"images are split\n                  among a group of ");
+      fprintf(stderr,"processes.\n");
+      fprintf(stderr,"      -stream:    Process the image in bands of rows, ");
+      fprintf(stderr,"for images larger\n                  than the memory ");
+      fprintf(stderr,"(implies -halo).\n");
+      fprintf(stderr,"      -lag N:     Rows below a pixel that -stream looks ");
+      fprintf(stderr,"at to decide\n                  whether it is an edge ");
+      fprintf(stderr,"(default 256).\n");
+      fprintf(stderr,"      -metrics:   Write the min/max/mean time of every ");
+      fprintf(stderr,"phase over the\n                  processes as JSON, ");
+      fprintf(stderr,"or CSV for a .csv name (- is the\n");
+      fprintf(stderr,"                  standard output).\n");
+      fprintf(stderr,"      -bench:     Benchmark on synthetic images: image is ");
+      fprintf(stderr,"the prefix of\n                  their names, and sigma, ");
+      fprintf(stderr,"tlow and thigh may be lists\n                  such as ");
+      fprintf(stderr,"1.0,2.0. Every image is run with 1, 2, 4...\n");
+      fprintf(stderr,"                  processes, at a fixed size (strong ");
+      fprintf(stderr,"scaling) and with\n                  the pixels growing ");
+      fprintf(stderr,"with the processes (weak scaling);\n");
+      fprintf(stderr,"                  -metrics writes the results and the ");
+      fprintf(stderr,"time of every phase\n                  (implies -halo).\n");
+      fprintf(stderr,"      -sizes:     Sides of the square benchmark images ");
+      fprintf(stderr,"with one process\n                  (default ");
+      fprintf(stderr,"512,1024,2048).\n");
+      fprintf(stderr,"      -kinds:     Classes of benchmark images (default ");
+      fprintf(stderr,"all).\n");
+      fprintf(stderr,"      -reps N:    Runs of each benchmark case, the fastest ");
+      fprintf(stderr,"is reported.\n");
+      fprintf(stderr,"      -balance:   With -halo, move the strip boundaries ");
+      fprintf(stderr,"before the\n                  hysteresis so every process ");
+      fprintf(stderr,"gets as many possible\n                  edges (edges), or ");
+      fprintf(stderr,"split each image by the speed of the\n                  ");
+      fprintf(stderr,"processes on the previous one (time, for -batch and\n");
+      fprintf(stderr,"                  -bench).\n");
+      fprintf(stderr,"      -shared:    Without -halo, keep one copy of the ");
+      fprintf(stderr,"full images per node\n                  in shared memory ");
+      fprintf(stderr,"instead of one per process; only\n");
+      fprintf(stderr,"                  one process per node exchanges them ");
+      fprintf(stderr,"with the other nodes.\n");
+      fprintf(stderr,"      -coll:      Exchange the images among all the ");
+      fprintf(stderr,"processes at once\n                  (flat), or inside ");
+      fprintf(stderr,"each node and among one process\n                  per ");
+      fprintf(stderr,"node (node); both runs every -bench case with\n");
+      fprintf(stderr,"                  the two. -metrics and -bench report ");
+      fprintf(stderr,"the bytes sent\n                  inside and between ");
+      fprintf(stderr,"nodes.\n");
+      fprintf(stderr,"      -grid:      Split the image in a 2-D grid of tiles ");
+      fprintf(stderr,"instead of strips\n                  of rows, for many ");
+      fprintf(stderr,"processes or wide images (implies\n");
+      fprintf(stderr,"                  -halo).\n");
+      fprintf(stderr,"      -sweep:     tlow and thigh are lists such as ");
+      fprintf(stderr,"0.3,0.4,0.5: the\n                  stages up to the ");
+      fprintf(stderr,"suppression run once and the\n                  ");
+      fprintf(stderr,"hysteresis once per pair, writing an edge image\n");
+      fprintf(stderr,"                  per pair (implies -halo).\n");
+      fprintf(stderr,"      -scales:    sigma is a growing list such as ");
+      fprintf(stderr,"1.0,2.0,4.0: the image\n                  is read once ");
+      fprintf(stderr,"and each scale blurs the one before,\n");
+      fprintf(stderr,"                  writing an edge image per sigma ");
+      fprintf(stderr,"(implies -halo).\n");
+      fprintf(stderr,"      -combine:   With -scales, also write the edges of ");
+      fprintf(stderr,"all the scales in\n                  one image.\n\n");
       exit(1);
    }
 
@@ -115,49 +778,274 @@ int main(int argc, char *argv[])
    tlow = atof(argv[3]);
    thigh = atof(argv[4]);
 
-   if(argc == 6) dirfilename = infilename;
-   else dirfilename = NULL;
+   dirfilename = NULL;
+   for(i=5;i<argc;i++){
+      if(strcmp(argv[i], "-halo") == 0) decomp = DECOMP_HALO;
+      else if(strcmp(argv[i], "-fused") == 0){
+         decomp = DECOMP_HALO;
+         fused_tiles = 1;
+      }
+      else if(strcmp(argv[i], "-grid") == 0){
+         decomp = DECOMP_HALO;
+         grid = 1;
+      }
+      else if(strcmp(argv[i], "-sweep") == 0){
+         decomp = DECOMP_HALO;
+         sweep = 1;
+      }
+      else if(strcmp(argv[i], "-scales") == 0){
+         decomp = DECOMP_HALO;
+         scales = 1;
+      }
+      else if(strcmp(argv[i], "-combine") == 0) scale_combine = 1;
+      else if((strcmp(argv[i], "-tile") == 0) && (i+1 < argc) &&
+         (sscanf(argv[i+1], "%dx%d", &tilerows, &tilecols) == 2)) i++;
+      else if((strcmp(argv[i], "-blur") == 0) && (i+1 < argc) &&
+         ((strcmp(argv[i+1], "float") == 0) ||
+          (strcmp(argv[i+1], "fixed") == 0) ||
+          (strcmp(argv[i+1], "iir") == 0))){
+         blur_fixed = (strcmp(argv[i+1], "fixed") == 0);
+         blur_iir = (strcmp(argv[i+1], "iir") == 0);
+         i++;
+      }
+      else if((strcmp(argv[i], "-threads") == 0) && (i+1 < argc) &&
+         (sscanf(argv[i+1], "%d", &nthreads) == 1)) i++;
+      else if(strcmp(argv[i], "-shared") == 0) node_shared = 1;
+      else if((strcmp(argv[i], "-coll") == 0) && (i+1 < argc)){
+         i++;
+         if(strcmp(argv[i], "flat") == 0) coll = COLL_FLAT;
+         else if(strcmp(argv[i], "node") == 0) coll = COLL_NODE;
+         else if(strcmp(argv[i], "both") == 0) coll = COLL_BOTH;
+         else{
+            if(rank == 0) fprintf(stderr, "Unknown collectives %s.\n", argv[i]);
+            MPI_Finalize();
+            exit(1);
+         }
+      }
+      else if(strcmp(argv[i], "-batch") == 0){
+         decomp = DECOMP_HALO;
+         batch = 1;
+      }
+      else if((strcmp(argv[i], "-metrics") == 0) && (i+1 < argc))
+         metricsname = argv[++i];
+      else if(strcmp(argv[i], "-stream") == 0){
+         decomp = DECOMP_HALO;
+         stream = 1;
+      }
+      else if((strcmp(argv[i], "-lag") == 0) && (i+1 < argc) &&
+         (sscanf(argv[i+1], "%d", &stream_lag) == 1)){
+         if(stream_lag < 1) stream_lag = 1;
+         i++;
+      }
+      else if(strcmp(argv[i], "-bench") == 0){
+         decomp = DECOMP_HALO;
+         bench = 1;
+      }
+      else if((strcmp(argv[i], "-sizes") == 0) && (i+1 < argc))
+         bench_sizes = argv[++i];
+      else if((strcmp(argv[i], "-kinds") == 0) && (i+1 < argc))
+         bench_kindlist = argv[++i];
+      else if((strcmp(argv[i], "-reps") == 0) && (i+1 < argc) &&
+         (sscanf(argv[i+1], "%d", &bench_reps) == 1)){
+         if(bench_reps < 1) bench_reps = 1;
+         i++;
+      }
+      else if((strcmp(argv[i], "-rankpix") == 0) && (i+1 < argc) &&
+         (sscanf(argv[i+1], "%ld", &batch_pixels) == 1)) i++;
+      else if((strcmp(argv[i], "-balance") == 0) && (i+1 < argc)){
+         i++;
+         if(strcmp(argv[i], "none") == 0) balance = BALANCE_NONE;
+         else if(strcmp(argv[i], "edges") == 0) balance = BALANCE_EDGES;
+         else if(strcmp(argv[i], "time") == 0) balance = BALANCE_TIME;
+         else{
+            if(rank == 0) fprintf(stderr, "Unknown balance %s.\n", argv[i]);
+            MPI_Finalize();
+            exit(1);
+         }
+      }
+      else if((strcmp(argv[i], "-sample") == 0) && (i+1 < argc) &&
+         (sscanf(argv[i+1], "%d", &thresh_sample) == 1)) i++;
+      else if((strcmp(argv[i], "-isa") == 0) && (i+1 < argc)){
+         i++;
+         if(strcmp(argv[i], "auto") == 0) blur_isa = ISA_AUTO;
+         else if(strcmp(argv[i], "scalar") == 0) blur_isa = ISA_SCALAR;
+         else if(strcmp(argv[i], "sse2") == 0) blur_isa = ISA_SSE2;
+         else if(strcmp(argv[i], "avx2") == 0) blur_isa = ISA_AVX2;
+         else if(strcmp(argv[i], "avx512") == 0) blur_isa = ISA_AVX512;
+         else{
+            if(rank == 0) fprintf(stderr, "Unknown instruction set %s.\n",
+               argv[i]);
+            MPI_Finalize();
+            exit(1);
+         }
+      }
+      else if(argv[i][0] != '-') dirfilename = infilename;
+      else{
+         if(rank == 0) fprintf(stderr, "Unknown option %s.\n", argv[i]);
+         MPI_Finalize();
+         exit(1);
+      }
+   }
+   if((nthreads > 1) && (provided < MPI_THREAD_FUNNELED)){
+      if(rank == 0) fprintf(stderr, "The MPI library has no thread support, "
+         "using one thread.\n");
+      nthreads = 1;
+   }
+   pool_start();
+   if(node_shared && (decomp == DECOMP_HALO)){
+      if(rank == 0) fprintf(stderr, "-shared is for the replicated images, "
+         "ignored with -halo.\n");
+      node_shared = 0;
+   }
+   if(sweep && (stream || bench)){
+      if(rank == 0) fprintf(stderr, "-sweep is ignored with -stream and "
+         "-bench.\n");
+      sweep = 0;
+   }
+   if(sweep){
+      /* tlow y thigh son listas, se corre cada par */
+      sweep_nlow = bench_list(argv[3], sweep_tlow);
+      sweep_nhigh = bench_list(argv[4], sweep_thigh);
+      if((sweep_nlow == 0) || (sweep_nhigh == 0)){
+         if(rank == 0) fprintf(stderr, "Wrong list of thresholds.\n");
+         MPI_Finalize();
+         exit(1);
+      }
+   }
+   if(scales && (stream || bench)){
+      if(rank == 0) fprintf(stderr, "-scales is ignored with -stream and "
+         "-bench.\n");
+      scales = 0;
+   }
+   if(scales){
+      /* sigma es una lista creciente, cada escala parte de la anterior */
+      scale_n = bench_list(argv[2], scale_sigma);
+      for(i=0;i<scale_n;i++)
+         if((scale_sigma[i] <= 0.0) ||
+            ((i > 0) && (scale_sigma[i] <= scale_sigma[i-1]))) scale_n = 0;
+      if(scale_n == 0){
+         if(rank == 0) fprintf(stderr, "Wrong list of sigmas, they must grow.\n");
+         MPI_Finalize();
+         exit(1);
+      }
+      sigma = scale_sigma[0];
+      if(grid || fused_tiles || (balance == BALANCE_EDGES)){
+         if(rank == 0) fprintf(stderr, "-scales works on whole strips, -grid, "
+            "-fused and -balance edges ignored.\n");
+         grid = fused_tiles = 0;
+         if(balance == BALANCE_EDGES) balance = BALANCE_NONE;
+      }
+   }
+   if(scale_combine && (!scales || sweep)){
+      if(rank == 0) fprintf(stderr, "-combine is for -scales without -sweep, "
+         "ignored.\n");
+      scale_combine = 0;
+   }
+   if(grid && stream){
+      if(rank == 0) fprintf(stderr, "-stream works on strips, -grid ignored.\n");
+      grid = 0;
+   }
+   if(grid && (fused_tiles || (balance != BALANCE_NONE))){
+      if(rank == 0) fprintf(stderr, "-fused and -balance work on strips, "
+         "ignored with -grid.\n");
+      fused_tiles = 0;
+      balance = BALANCE_NONE;
+   }
+   if((coll == COLL_BOTH) && !bench){
+      if(rank == 0) fprintf(stderr, "-coll both is for -bench, using node.\n");
+      coll = COLL_NODE;
+   }
+   /* batch y bench arman los nodos de cada grupo */
+   if(!batch && !bench) node_setup();
 	
-	if (rank == 0) {
-		tini = MPI_Wtime ();
+	if(batch){
+	   /* infilename es la lista de imagenes o el directorio */
+	   batch_run(infilename, sigma, tlow, thigh);
+	   if(metricsname != NULL) metrics_report(metricsname);
+	   arena_release();
+	   pool_stop();
+	   MPI_Finalize ();
+	   return 0;
+	}
+
+	if(bench){
+	   /* infilename es el prefijo de las imagenes, los parametros son listas */
+	   bench_run(infilename, argv[2], argv[3], argv[4]);
+	   arena_release();
+	   pool_stop();
+	   MPI_Finalize ();
+	   return 0;
+	}
+
+	if (rank == 0) tini = MPI_Wtime ();
+	if(decomp == DECOMP_HALO){
+	   if(canny_file(infilename, sigma, tlow, thigh, dirfilename != NULL,
+	      &rows, &cols) == 0) exit(1);
+	}
+	else{
 	   /****************************************************************************
 	   * Read in the image. This read function allocates memory for the image.
 	   ****************************************************************************/
-	   if(VERBOSE) printf("Reading the image %s.\n", infilename);
-	}
-   if(read_pgm_image(infilename, &image, &rows, &cols) == 0){
-      fprintf(stderr, "Error reading the input image, %s.\n", infilename);
-      exit(1);
-   }
-	
-	if (rank == 0) {
+	   if(VERBOSE && rank==0) printf("Reading the image %s.\n", infilename);
+	   phase_begin(PHASE_READ);
+	   if(node_shared){
+	      /* cada rank lee su franja en la copia del nodo */
+	      if(read_pgm_shared(infilename, &image, &rows, &cols) == 0){
+	         if(rank == 0) fprintf(stderr, "Error reading the input image, "
+	            "%s.\n", infilename);
+	         exit(1);
+	      }
+	   }
+	   else if(read_pgm_image(infilename, &image, &rows, &cols) == 0){
+	      fprintf(stderr, "Error reading the input image, %s.\n", infilename);
+	      exit(1);
+	   }
+	   phase_end(PHASE_READ);
+	   arena_geometry(rows, cols);
+
 	   /****************************************************************************
 	   * Perform the edge detection. All of the work takes place here.
 	   ****************************************************************************/
-	   if(VERBOSE) printf("Starting Canny edge detection.\n");
+	   if(VERBOSE && rank==0) printf("Starting Canny edge detection.\n");
 	   if(dirfilename != NULL){
 	      sprintf(composedfname, "%s_s_%3.2f_l_%3.2f_h_%3.2f.fim", infilename,
 	      sigma, tlow, thigh);
 	      dirfilename = composedfname;
 	   }
-	}
-	canny(image, rows, cols, sigma, tlow, thigh, &edge, dirfilename);
-
-	if (rank == 0) {
-	   /****************************************************************************
-	   * Write out the edge image to a file.
-	   ****************************************************************************/
 	   sprintf(outfilename, "%s_s_%3.2f_l_%3.2f_h_%3.2f.pgm", infilename,
 	      sigma, tlow, thigh);
-	   if(VERBOSE) printf("Writing the edge iname in the file %s.\n", outfilename);
-	   if(write_pgm_image(outfilename, edge, rows, cols, "", 255) == 0){
-	      fprintf(stderr, "Error writing the edge image, %s.\n", outfilename);
-	      exit(1);
+	   canny(image, rows, cols, sigma, tlow, thigh, &edge, dirfilename);
+
+	   if (rank == 0) {
+	      /****************************************************************************
+	      * Write out the edge image to a file.
+	      ****************************************************************************/
+	      if(VERBOSE) printf("Writing the edge iname in the file %s.\n", outfilename);
+	      phase_begin(PHASE_WRITE);
+	      /* los bits de los bordes pasan a bytes solo para escribirlos */
+	      full_plane(&edgep, edge, rows, BITS_WORDS(cols));
+	      bits_expand(&edgep, &edgeb, cols);
+	      if(write_pgm_image(outfilename, (unsigned char *) edgeb.data, rows,
+	         cols, "", 255) == 0){
+	         fprintf(stderr, "Error writing the edge image, %s.\n", outfilename);
+	         exit(1);
+	      }
+	      plane_free(&edgeb);
+	      phase_end(PHASE_WRITE);
 	   }
-	   free(image);
+	   arena_free(edge);
+	   if(node_shared) frame_free(image);
+	   else free(image);
+	}
+
+	if (rank == 0) {
 	   tfin = MPI_Wtime ();
 	   printf ("-----------------------------\nDemoro: %f\n", tfin-tini);
 	}
+	if(metricsname != NULL) metrics_report(metricsname);
+	node_free();
+	arena_release();
+	pool_stop();
 	MPI_Finalize ();
    return 0;
 }
@@ -169,10 +1057,10 @@ int main(int argc, char *argv[])
 * DATE: 2/15/96
 *******************************************************************************/
 void canny(unsigned char *image, int rows, int cols, float sigma,
-         float tlow, float thigh, unsigned char **edge, char *fname)
+         float tlow, float thigh, bitword **edge, char *fname)
 {
    FILE *fpdir=NULL;          /* File to write the gradient image to.     */
-   unsigned char *nms;        /* Points that are local maximal magnitude. */
+   bitword *nms;              /* Points that are local maximal magnitude. */
    short int *smoothedim,     /* The image after gaussian smoothing.      */
              *delta_x,        /* The first devivative image, x-direction. */
              *delta_y,        /* The first derivative image, y-direction. */
@@ -185,14 +1073,14 @@ void canny(unsigned char *image, int rows, int cols, float sigma,
    * deviation.
    ****************************************************************************/
    if(VERBOSE && rank==0) printf("Smoothing the image using a gaussian kernel.\n");
-	MPI_Barrier (MPI_COMM_WORLD);
+	phase_barrier();
 	gaussian_smooth(image, rows, cols, sigma, &smoothedim);
 	
    /****************************************************************************
    * Compute the first derivative in the x and y directions.
    ****************************************************************************/
    if(VERBOSE && rank==0) printf("Computing the X and Y first derivatives.\n");
-   MPI_Barrier (MPI_COMM_WORLD);
+   phase_barrier();
    derrivative_x_y(smoothedim, rows, cols, &delta_x, &delta_y);
 	
 	if (rank == 0) {
@@ -206,6 +1094,7 @@ void canny(unsigned char *image, int rows, int cols, float sigma,
 	      * Compute the direction up the gradient, in radians that are
 	      * specified counteclockwise from the positive x-axis.
 	      *************************************************************************/
+	      phase_begin(PHASE_DIRECTION);
 	      radian_direction(delta_x, delta_y, rows, cols, &dir_radians, -1, -1);
 	
 	      /*************************************************************************
@@ -218,6 +1107,7 @@ void canny(unsigned char *image, int rows, int cols, float sigma,
 	      fwrite(dir_radians, sizeof(float), rows*cols, fpdir);
 	      fclose(fpdir);
 	      free(dir_radians);
+	      phase_end(PHASE_DIRECTION);
 	   }
    }
 	
@@ -231,10 +1121,9 @@ void canny(unsigned char *image, int rows, int cols, float sigma,
    * Perform non-maximal suppression.
    ****************************************************************************/
    if(VERBOSE && rank==0) printf("Doing the non-maximal suppression.\n");
-   if((nms = (unsigned char *) calloc(rows*cols,sizeof(unsigned char)))==NULL){
-      fprintf(stderr, "Error allocating the nms image.\n");
-      exit(1);
-   }
+   /* un bit por pixel; non_max_supp escribe todas las palabras */
+   nms = (bitword *) frame_alloc((size_t)rows*BITS_WORDS(cols)*sizeof(bitword),
+      "nms image");
 
    non_max_supp(magnitude, delta_x, delta_y, rows, cols, nms);
 	
@@ -242,10 +1131,8 @@ void canny(unsigned char *image, int rows, int cols, float sigma,
    * Use hysteresis to mark the edge pixels.
    ****************************************************************************/
    if(VERBOSE && rank==0) printf("Doing hysteresis thresholding.\n");
-   if((*edge=(unsigned char *)calloc(rows*cols,sizeof(unsigned char))) ==NULL){
-      fprintf(stderr, "Error allocating the edge image.\n");
-      exit(1);
-   }
+   *edge = (bitword *) arena_alloc((size_t)rows*BITS_WORDS(cols)*
+      sizeof(bitword), 0, "edge image");
 
    apply_hysteresis(magnitude, nms, rows, cols, tlow, thigh, *edge);
 
@@ -253,11 +1140,343 @@ void canny(unsigned char *image, int rows, int cols, float sigma,
    * Free all of the memory that we allocated except for the edge image that
    * is still being used to store out result.
    ****************************************************************************/
-   free(smoothedim);
-   free(delta_x);
-   free(delta_y);
-   free(magnitude);
-   free(nms);
+   frame_free(smoothedim);
+   frame_free(delta_x);
+   frame_free(delta_y);
+   frame_free(magnitude);
+   frame_free(nms);
+}
+
+/*******************************************************************************
+* PROCEDURE: canny_file
+* PURPOSE: Collective in canny_comm. Detect the edges of the PGM image
+* infilename with the row-strip decomposition: every process reads only its
+* rows plus the halo rows the tiles recompute, and writes its strip of the
+* edge image to the file named after the image and the parameters. With
+* writedir the direction image is written too. The dimensions of the image
+* are returned in rows and cols. Returns 0 in every process when the image
+* can not be read or the edges can not be written.
+* With -stream the strip is read, processed and written in bands instead
+* (see canny_stream), with -grid the image is split in tiles instead of
+* strips (see canny_grid), and with -scales the edges are detected for every
+* sigma of the list (see canny_scales). With BALANCE_TIME the strips follow the speed the
+* processes had on the previous image.
+*******************************************************************************/
+int canny_file(char *infilename, float sigma, float tlow, float thigh,
+        int writedir, int *rows, int *cols)
+{
+   int *rowstart, r0, r1, halo, ok, allok;
+   double t;                  /* tiempo de calculo de este rank, BALANCE_TIME */
+   MPI_Offset offset;         /* comienzo de los pixeles en el archivo */
+   plane img, edgep;          /* filas de la imagen y de los bordes de este rank */
+   char outfilename[BATCH_NAMELEN+64];    /* Name of the output "edge" image */
+   char composedfname[BATCH_NAMELEN+64];  /* Name of the output "direction" image */
+
+   if(VERBOSE && rank==0) printf("Reading the image %s.\n", infilename);
+   phase_begin(PHASE_READ);
+   if(read_pgm_info(infilename, rows, cols, &offset) == 0){
+      if(rank == 0)
+         fprintf(stderr, "Error reading the input image, %s.\n", infilename);
+      phase_end(PHASE_READ);
+      return(0);
+   }
+   arena_geometry(*rows, *cols);
+   if((rowstart = (int *) calloc(size+1, sizeof(int))) == NULL){
+      fprintf(stderr, "Error allocating the partition.\n");
+      exit(1);
+   }
+   /* con BALANCE_TIME cada rank recibe filas segun su velocidad en la imagen
+      anterior */
+   if((balance == BALANCE_TIME) && (balance_nparts == size))
+      share_partition(*rows, size, balance_speed, rowstart);
+   else make_partition(*rows, size, rowstart);
+
+   /* todos los procesos escriben los archivos de salida */
+   snprintf(composedfname, sizeof(composedfname),
+      "%s_s_%3.2f_l_%3.2f_h_%3.2f.fim", infilename, sigma, tlow, thigh);
+   snprintf(outfilename, sizeof(outfilename),
+      "%s_s_%3.2f_l_%3.2f_h_%3.2f.pgm", infilename, sigma, tlow, thigh);
+   if(stream){
+      /* la franja se lee y se escribe por bandas */
+      phase_end(PHASE_READ);
+      if(writedir && (rank == 0))
+         fprintf(stderr, "The direction image is not written with -stream.\n");
+      ok = canny_stream(infilename, offset, *rows, *cols, rowstart, sigma,
+         tlow, thigh, outfilename);
+      free(rowstart);
+      return(ok);
+   }
+   if(grid){
+      /* cada rank lee y escribe su tesela */
+      phase_end(PHASE_READ);
+      free(rowstart);
+      return(canny_grid(infilename, offset, *rows, *cols, sigma, tlow, thigh,
+         writedir ? composedfname : NULL, outfilename));
+   }
+   halo = fused_tiles ? blur_window(sigma)/2 + 2 : 0;
+   r0 = rowstart[rank];
+   r1 = rowstart[rank+1];
+   if(r0 < r1){
+      r0 = (r0-halo > 0) ? r0-halo : 0;
+      r1 = (r1+halo < *rows) ? r1+halo : *rows;
+   }
+   /* si un rank no pudo leer sus filas ninguno sigue */
+   ok = read_pgm_rows(infilename, offset, *cols, r0, r1, &img);
+   MPI_Allreduce(&ok, &allok, 1, MPI_INT, MPI_MIN, canny_comm);
+   phase_end(PHASE_READ);
+   if(allok == 0){
+      if(rank == 0)
+         fprintf(stderr, "Error reading the input image, %s.\n", infilename);
+      if(ok) plane_free(&img);
+      free(rowstart);
+      return(0);
+   }
+
+   /****************************************************************************
+   * Perform the edge detection.
+   ****************************************************************************/
+   if(VERBOSE && rank==0) printf("Starting Canny edge detection.\n");
+   t = phase_total(PHASE_COMPUTE);
+   if(scales) ok = canny_scales(&img, *rows, *cols, rowstart, tlow, thigh,
+      writedir, infilename);
+   else ok = canny_halo(&img, *rows, *cols, rowstart, sigma, tlow, thigh,
+      sweep ? NULL : &edgep, writedir ? composedfname : NULL, infilename);
+   if(balance == BALANCE_TIME)
+      balance_time(rowstart, *cols, phase_total(PHASE_COMPUTE) - t);
+   if(sweep || scales){
+      /* las imagenes de cada escala o par de umbrales ya estan escritas */
+      plane_free(&img);
+      free(rowstart);
+      return(ok);
+   }
+
+   /****************************************************************************
+   * Every process writes its strip of the edge image.
+   ****************************************************************************/
+   ok = write_edge_strip(&edgep, *rows, *cols, outfilename);
+   plane_free(&edgep);
+   plane_free(&img);
+   free(rowstart);
+   return(ok);
+}
+
+/*******************************************************************************
+* PROCEDURE: canny_halo
+* PURPOSE: To perform canny edge detection with the row-strip decomposition.
+* img holds the rows of the strip (plus windowsize/2+2 rows with fused_tiles)
+* and edge receives the edge rows of the strip as a bit map (see bitmap.c).
+* The blur in the y-direction needs windowsize/2 rows of the x-blurred image
+* above and below the strip, the derivatives and the non-maximal suppression
+* need one row of their inputs. With fused_tiles the stages up to the
+* non-maximal suppression run tile by tile instead (see fused_strip).
+* With BALANCE_EDGES the strips of the hysteresis are moved so that each one
+* holds the same cost, and rowstart and edge follow the new strips.
+* With -sweep edge is not used: the edge image of every pair of thresholds is
+* written instead, named after infilename (see hysteresis_sweep). Returns 0
+* when one of them can not be written.
+*******************************************************************************/
+int canny_halo(plane *img, int rows, int cols, int *rowstart, float sigma,
+         float tlow, float thigh, plane *edge, char *fname, char *infilename)
+{
+   int r0, r1,                /* filas propias de este rank */
+       ok;
+   blur_kernel bk;            /* nucleo gaussiano y tablas del blur */
+   plane smoothedim, dx, dy, magnitude, nms;
+
+   r0 = rowstart[rank];
+   r1 = rowstart[rank+1];
+
+   if(VERBOSE && rank==0) printf("Smoothing the image using a gaussian kernel.\n");
+   blur_setup(&bk, sigma, rows, cols);
+
+   if(fused_tiles){
+      /*************************************************************************
+      * Run blur, derivatives, magnitude and non-maximal suppression tile by
+      * tile. Only the magnitude and the nms map of the strip are stored.
+      *************************************************************************/
+      if(VERBOSE && rank==0) printf("Running the fused tile pipeline.\n");
+      phase_begin(PHASE_FUSED);
+      strip_plane(&magnitude, rowstart, 0, rows, cols, sizeof(short int),
+         "magnitude");
+      strip_plane(&nms, rowstart, 0, rows, BITS_WORDS(cols), sizeof(bitword),
+         "nms");
+      if(fname != NULL){
+         strip_plane(&dx, rowstart, 0, rows, cols, sizeof(short int), "delta_x");
+         strip_plane(&dy, rowstart, 0, rows, cols, sizeof(short int), "delta_y");
+      }
+      fused_strip(img, rows, cols, r0, r1, &bk, &magnitude, &nms,
+         (fname != NULL) ? &dx : NULL, (fname != NULL) ? &dy : NULL);
+      blur_free(&bk);
+      phase_end(PHASE_FUSED);
+      if(fname != NULL){
+         write_direction_strips(&dx, &dy, rowstart, cols, fname);
+         plane_free(&dx);
+         plane_free(&dy);
+      }
+   }
+   else{
+      /* suavizado, derivadas, magnitud y supresion, etapa por etapa */
+      smooth_strip(img, rows, cols, rowstart, &bk, &smoothedim);
+      blur_free(&bk);
+      gradient_strip(&smoothedim, rows, cols, rowstart, fname, &magnitude,
+         &nms);
+      plane_free(&smoothedim);
+   }
+
+   /****************************************************************************
+   * Use hysteresis to mark the edge pixels of the strip.
+   ****************************************************************************/
+   if(balance == BALANCE_EDGES)
+      balance_edges(&magnitude, &nms, rows, cols, rowstart);
+   if(VERBOSE && rank==0) printf("Doing hysteresis thresholding.\n");
+   ok = 1;
+   if(sweep) ok = hysteresis_sweep(&magnitude, &nms, rows, cols, rowstart,
+      NULL, infilename, sigma);
+   else{
+      strip_plane(edge, rowstart, 0, rows, BITS_WORDS(cols), sizeof(bitword),
+         "edge");
+      hysteresis_strip(&magnitude, &nms, rows, cols, tlow, thigh, edge,
+         rowstart, NULL);
+   }
+   plane_free(&magnitude);
+   plane_free(&nms);
+   return(ok);
+}
+
+/*******************************************************************************
+* PROCEDURE: smooth_strip
+* PURPOSE: Blur the rows of the strip of in with the kernel bk into
+* smoothedim, which gets one halo row. The blur in the y-direction needs
+* windowsize/2 rows of the x-blurred image above and below the strip, which
+* come from the neighbours while the interior is computed. in is the image,
+* or the smoothed image of a smaller sigma with a kernel of
+* blur_cascade_setup.
+*******************************************************************************/
+void smooth_strip(plane *in, int rows, int cols, int *rowstart,
+        blur_kernel *bk, plane *smoothedim)
+{
+   plane tempim;
+
+   phase_begin(PHASE_SMOOTH);
+   strip_plane(&tempim, rowstart, bk->center, rows, cols,
+      bk->fixed ? sizeof(short int) : sizeof(float), "tempim");
+   /* los halos viajan mientras se calcula el interior de la franja */
+   phase_begin(PHASE_BLUR_X);
+   overlap_stage(STAGE_BLUR_X, in, NULL, NULL, &tempim,
+      bk->fixed ? MPI_SHORT : MPI_FLOAT, bk->center, rows, cols, rowstart, bk);
+   phase_end(PHASE_BLUR_X);
+
+   strip_plane(smoothedim, rowstart, 1, rows, cols, sizeof(short int),
+      "smoothedim");
+   phase_begin(PHASE_BLUR_Y);
+   overlap_stage(STAGE_BLUR_Y, &tempim, NULL, NULL, smoothedim, MPI_SHORT,
+      1, rows, cols, rowstart, bk);
+   phase_end(PHASE_BLUR_Y);
+   plane_free(&tempim);
+   phase_end(PHASE_SMOOTH);
+}
+
+/*******************************************************************************
+* PROCEDURE: gradient_strip
+* PURPOSE: Compute the derivatives, the magnitude of the gradient and the
+* non-maximal suppression of the strip from smoothedim, which is left as it
+* is. magnitude gets one halo row, nms is a bit map. With fname the
+* direction image is written too.
+*******************************************************************************/
+void gradient_strip(plane *smoothedim, int rows, int cols, int *rowstart,
+        char *fname, plane *magnitude, plane *nms)
+{
+   int r0 = rowstart[rank], r1 = rowstart[rank+1];
+   plane dx, dy;
+
+   /****************************************************************************
+   * Compute the first derivative in the x and y directions.
+   ****************************************************************************/
+   if(VERBOSE && rank==0) printf("Computing the X and Y first derivatives.\n");
+   phase_begin(PHASE_DERIV);
+   strip_plane(&dx, rowstart, 0, rows, cols, sizeof(short int), "delta_x");
+   strip_plane(&dy, rowstart, 0, rows, cols, sizeof(short int), "delta_y");
+   run_stage(STAGE_DERIV_X, smoothedim, NULL, NULL, &dx, r0, r1, 0, cols,
+      rows, cols, NULL);
+   run_stage(STAGE_DERIV_Y, smoothedim, NULL, NULL, &dy, r0, r1, 0, cols,
+      rows, cols, NULL);
+   phase_end(PHASE_DERIV);
+
+   if(fname != NULL) write_direction_strips(&dx, &dy, rowstart, cols, fname);
+
+   /****************************************************************************
+   * Compute the magnitude of the gradient.
+   ****************************************************************************/
+   if(VERBOSE && rank==0) printf("Computing the magnitude of the gradient.\n");
+   phase_begin(PHASE_MAGNITUDE);
+   strip_plane(magnitude, rowstart, 1, rows, cols, sizeof(short int),
+      "magnitude");
+   overlap_stage(STAGE_MAGNITUDE, &dx, &dy, NULL, magnitude, MPI_SHORT, 1,
+      rows, cols, rowstart, NULL);
+   phase_end(PHASE_MAGNITUDE);
+
+   /****************************************************************************
+   * Perform non-maximal suppression.
+   ****************************************************************************/
+   if(VERBOSE && rank==0) printf("Doing the non-maximal suppression.\n");
+   phase_begin(PHASE_NMS);
+   strip_plane(nms, rowstart, 0, rows, BITS_WORDS(cols), sizeof(bitword),
+      "nms");
+   run_stage(STAGE_NMS, magnitude, &dx, &dy, nms, r0, r1, 0, cols, rows,
+      cols, NULL);
+   plane_free(&dx);
+   plane_free(&dy);
+   phase_end(PHASE_NMS);
+}
+
+/*******************************************************************************
+* FUNCTION: write_edge_strip
+* PURPOSE: Collective. Every process writes its strip of the edge bit map
+* edgep to outfilename. Returns 0 when the image can not be written.
+*******************************************************************************/
+int write_edge_strip(plane *edgep, int rows, int cols, char *outfilename)
+{
+   plane edgeb;
+   int ok;
+
+   if(VERBOSE && rank==0)
+      printf("Writing the edge iname in the file %s.\n", outfilename);
+   phase_begin(PHASE_WRITE);
+   bits_expand(edgep, &edgeb, cols);     /* los bordes pasan a bytes aqui */
+   ok = write_pgm_rows(outfilename, &edgeb, rows, cols, "", 255);
+   phase_end(PHASE_WRITE);
+   if(ok == 0)
+      fprintf(stderr, "Error writing the edge image, %s.\n", outfilename);
+   plane_free(&edgeb);
+   return(ok);
+}
+
+/*******************************************************************************
+* PROCEDURE: write_direction_strips
+* PURPOSE: Every process computes the direction of the gradient of its strip
+* and writes it at its place in the direction image.
+*******************************************************************************/
+void write_direction_strips(plane *dx, plane *dy, int *rowstart, int cols,
+        char *fname)
+{
+   MPI_File fh;
+   int r0 = rowstart[rank], r1 = rowstart[rank+1];
+   float *dir_radians=NULL;   /* Gradient direction image.                */
+
+   phase_begin(PHASE_DIRECTION);
+   radian_direction(PLANE_PTR(dx, short, r0, 0), PLANE_PTR(dy, short, r0, 0),
+      r1-r0, cols, &dir_radians, -1, -1);
+   if(MPI_File_open(canny_comm, fname, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+      MPI_INFO_NULL, &fh) != MPI_SUCCESS){
+      fprintf(stderr, "Error opening the file %s for writing.\n", fname);
+      exit(1);
+   }
+   MPI_File_set_size(fh, 0);
+   MPI_File_write_at_all(fh, (MPI_Offset)r0 * cols * sizeof(float),
+      dir_radians, (r1-r0)*cols, MPI_FLOAT, MPI_STATUS_IGNORE);
+   MPI_File_close(&fh);
+   free(dir_radians);
+   phase_end(PHASE_DIRECTION);
 }
 
 /*******************************************************************************
@@ -341,50 +1560,36 @@ double angle_radians(double x, double y)
 void magnitude_x_y(short int *delta_x, short int *delta_y, int rows, int cols,
         short int **magnitude)
 {
-	int index;					/* indice para acceder a tempbuffer */
-	double tini3, tfin3;		/* para medir tiempos de funciones */
-	short int * tempbuffer;		/* buffer temporal */
-   int r, c, pos, sq1, sq2;
+	int *rowstart, k, a, b;		/* franjas de filas de cada rank y sus trozos */
+	plane dx, dy, mag;		/* las imagenes completas como planos */
+	strip_pipe sp;			/* allgather de los trozos en curso */
 
-	if (rank == 0) tini2 = MPI_Wtime ();
+	phase_begin(PHASE_MAGNITUDE);
    /****************************************************************************
    * Allocate an image to store the magnitude of the gradient.
    ****************************************************************************/
-   if((*magnitude = (short *) calloc(rows*cols, sizeof(short))) == NULL){
-      fprintf(stderr, "Error allocating the magnitude image.\n");
-      exit(1);
-   }
-   /* se reserva memoria para el buffer temporal */
-   if((tempbuffer = (short *) calloc(rows*cols/size, sizeof(short))) == NULL){
-      fprintf(stderr, "Error allocating the magnitude image.\n");
+   *magnitude = (short *) frame_alloc((size_t)rows*cols*sizeof(short),
+      "magnitude image");
+   /* cada rank calcula una franja de filas, que se reparte por trozos */
+   if((rowstart = (int *) calloc(size+1, sizeof(int))) == NULL){
+      fprintf(stderr, "Error allocating the partition.\n");
       exit(1);
    }
+   make_partition(rows, size, rowstart);
+   full_plane(&dx, delta_x, rows, cols);
+   full_plane(&dy, delta_y, rows, cols);
+   full_plane(&mag, *magnitude, rows, cols);
 
-	pos = rank*rows*cols/size;
-	index = 0;
-   for(r=rank*rows/size;r<(rank+1)*rows/size;r++){
-      for(c=0;c<cols;c++){
-         sq1 = (int)delta_x[pos] * (int)delta_x[pos];
-         sq2 = (int)delta_y[pos] * (int)delta_y[pos];
-         tempbuffer [index] = (short)(0.5 + sqrt((float)sq1 + (float)sq2));
-         pos ++;
-         index ++;
-      }
+   pipe_open(&sp, PIPE_CHUNKS);
+   for(k=0;k<PIPE_CHUNKS;k++){
+      pipe_rows(rowstart, rank, k, &a, &b);
+      run_stage(STAGE_MAGNITUDE, &dx, &dy, NULL, &mag, a, b, 0, cols, rows,
+         cols, NULL);
+      pipe_allgather(&sp, &mag, MPI_SHORT, rowstart, cols, k);
    }
-   printf (">rank:%d termino magnitude\n", rank);
-   MPI_Barrier (MPI_COMM_WORLD);
-   if (rank == 0) tini3 = MPI_Wtime ();
-   MPI_Allgather (tempbuffer, rows*cols/size, MPI_SHORT, *magnitude, rows*cols/size, MPI_SHORT, MPI_COMM_WORLD);
-   
-   if (rank == 0) {
-		tfin3 = MPI_Wtime ();
-		printf (">>>Allgather demoro: %f\n", tfin3 - tini3);
-	}
-	free (tempbuffer);
-   if (rank == 0) {
-		tfin2 = MPI_Wtime ();
-	    printf ("----------------------> magnitude_x_y demoro: %f\n", tfin2 - tini2);
-	}
+   pipe_close(&sp);
+	free (rowstart);
+	phase_end(PHASE_MAGNITUDE);
 }
 
 /*******************************************************************************
@@ -402,103 +1607,56 @@ void magnitude_x_y(short int *delta_x, short int *delta_y, int rows, int cols,
 void derrivative_x_y(short int *smoothedim, int rows, int cols,
         short int **delta_x, short int **delta_y)
 {
-	double tini3, tfin3, tini4, tfin4;	/* para medir tiempos de funciones */
-	short int * tempbuffer;				/* buffer temporal para x-derivative */
-	int index;							/* indice para recorrer tempbuffer */
-	short int * tempbuffer2;			/* buffer temporal para y-derivative */
-   int r, c, pos;
+	int *rowstart, k, a, b;		/* franjas de filas de cada rank y sus trozos */
+	plane sm, dx, dy;		/* las imagenes completas como planos */
+	strip_pipe sp;			/* allgather de los trozos en curso */
 
-	if (rank == 0) {
-		tini2 = MPI_Wtime ();
-	}
+	phase_begin(PHASE_DERIV);
    /****************************************************************************
    * Allocate images to store the derivatives.
    ****************************************************************************/
-   if(((*delta_x) = (short *) calloc(rows*cols, sizeof(short))) == NULL){
-      fprintf(stderr, "Error allocating the delta_x image.\n");
-      exit(1);
-   }
-   if(((*delta_y) = (short *) calloc(rows*cols, sizeof(short))) == NULL){
-      fprintf(stderr, "Error allocating the delta_x image.\n");
-      exit(1);
-   }
-   /* memoria para buffer temporal */
-   if((tempbuffer = (short *) calloc(rows*cols/size, sizeof(short))) == NULL){
-      fprintf(stderr, "Error allocating the tempbuffer.\n");
-      exit(1);
-   }
-   if((tempbuffer2 = (short *) calloc(rows*cols, sizeof(short))) == NULL){
-      fprintf(stderr, "Error allocating the tempbuffer2.\n");
+   *delta_x = (short *) frame_alloc((size_t)rows*cols*sizeof(short),
+      "delta_x image");
+   *delta_y = (short *) frame_alloc((size_t)rows*cols*sizeof(short),
+      "delta_y image");
+   /* cada rank calcula una franja de filas de las dos derivadas */
+   if((rowstart = (int *) calloc(size+1, sizeof(int))) == NULL){
+      fprintf(stderr, "Error allocating the partition.\n");
       exit(1);
    }
+   make_partition(rows, size, rowstart);
+   full_plane(&sm, smoothedim, rows, cols);
+   full_plane(&dx, *delta_x, rows, cols);
+   full_plane(&dy, *delta_y, rows, cols);
 
 	if (rank == 0) {
-		tini3 = MPI_Wtime ();
 	   /****************************************************************************
 	   * Compute the x-derivative. Adjust the derivative at the borders to avoid
 	   * losing pixels.
 	   ****************************************************************************/
 	   if(VERBOSE) printf("   Computing the X-direction derivative.\n");
-   }
-   /* se inicializa el indice para el buffer temporal */
-   index = 0;
-   
-   for (r=rank*rows/size;r<(rank+1)*rows/size;r++) {
-      pos = r * cols;
-      tempbuffer [index] = smoothedim[pos+1] - smoothedim[pos];
-      pos++;
-      index ++;
-      for(c=1;c<(cols-1);c++,pos++){
-         tempbuffer [index] = smoothedim[pos+1] - smoothedim[pos-1];
-         index ++;
-      }
-      tempbuffer [index] = smoothedim[pos] - smoothedim[pos-1];
-      index ++;
-   }
-   printf (">rank:%d termino derivative x\n", rank);
-   MPI_Barrier (MPI_COMM_WORLD);
-   if (rank == 0) tini4 = MPI_Wtime ();
-   MPI_Allgather (tempbuffer, rows*cols/size, MPI_SHORT, *delta_x, rows*cols/size, MPI_SHORT, MPI_COMM_WORLD);
-   
-   if (rank == 0) {
-	   tfin3 = MPI_Wtime ();
-	   printf (">>>Allgather demoro: %f\n", tfin3 - tini4);
-	   printf (">>>Derivative x demoro: %f\n", tfin3 - tini3);
-   }
 
-	if (rank == 0) {
-		tini3 = MPI_Wtime ();
 	   /****************************************************************************
 	   * Compute the y-derivative. Adjust the derivative at the borders to avoid
-	   * losing pixels.
+	   * losing pixels. The rows are walked one after the other, the pixels
+	   * above and below are contiguous too.
 	   ****************************************************************************/
 	   if(VERBOSE) printf("   Computing the Y-direction derivative.\n");
    }
-   for (c=rank*cols/size;c<(rank+1)*cols/size;c++) {
-      pos = c;
-      tempbuffer2 [pos] = smoothedim[pos+cols] - smoothedim[pos];
-      pos += cols;
-      for(r=1;r<(rows-1);r++,pos+=cols){
-         tempbuffer2 [pos] = smoothedim[pos+cols] - smoothedim[pos-cols];
-      }
-      tempbuffer2 [pos] = smoothedim[pos] - smoothedim[pos-cols];
-   }
-   printf (">rank:%d termino derivative y\n", rank);
-   MPI_Barrier (MPI_COMM_WORLD);
-   if (rank == 0) tini4 = MPI_Wtime ();
-   MPI_Allreduce (tempbuffer2, *delta_y, rows*cols, MPI_SHORT, MPI_SUM, MPI_COMM_WORLD);
-   
-   if (rank == 0) {
-	   tfin3 = MPI_Wtime ();
-	   printf (">>>Allreduce demoro: %f\n", tfin3 - tini4);
-	   printf (">>>Derivative y demoro: %f\n", tfin3 - tini3);
-   }
-   if (rank == 0) {
-	   tfin2 = MPI_Wtime ();
-	   printf ("----------------------> derrivative_x_y demoro: %f\n", tfin2 - tini2);
+   /* los trozos de las dos derivadas viajan mientras se calculan los siguientes */
+   pipe_open(&sp, 2*PIPE_CHUNKS);
+   for(k=0;k<PIPE_CHUNKS;k++){
+      pipe_rows(rowstart, rank, k, &a, &b);
+      run_stage(STAGE_DERIV_X, &sm, NULL, NULL, &dx, a, b, 0, cols, rows, cols,
+         NULL);
+      pipe_allgather(&sp, &dx, MPI_SHORT, rowstart, cols, k);
+      run_stage(STAGE_DERIV_Y, &sm, NULL, NULL, &dy, a, b, 0, cols, rows, cols,
+         NULL);
+      pipe_allgather(&sp, &dy, MPI_SHORT, rowstart, cols, k);
    }
-   free (tempbuffer);
-   free (tempbuffer2);
+   pipe_close(&sp);
+   free (rowstart);
+   phase_end(PHASE_DERIV);
 }
 
 /*******************************************************************************
@@ -510,119 +1668,79 @@ void derrivative_x_y(short int *smoothedim, int rows, int cols,
 void gaussian_smooth(unsigned char *image, int rows, int cols, float sigma,
         short int **smoothedim)
 {
-	double tini3,tfin3,tini4,tfin4;	/* para medir tiempos de funciones */
-	float *tempbuffer;				/* buffer temporal para blur en x */
-	short int *tempbuffer2;			/* buffer temporal para blur en y */
-	int index;						/* indice usado para acceder a tempbuffer */
-   int r, c, rr, cc,     /* Counter variables. */
-      windowsize,        /* Dimension of the gaussian kernel. */
-      center;            /* Half of the windowsize. */
-   float *tempim,        /* Buffer for separable filter gaussian smoothing. */
-         *kernel,        /* A one dimensional gaussian kernel. */
-         dot,            /* Dot product summing variable. */
-         sum;            /* Sum of the kernel weights variable. */
-	
-	/* se reserva memoria para el buffer temporal para cada hilo */
-	if ((tempbuffer = (float *) calloc (rows*cols/size, sizeof (float))) == NULL) {
-		fprintf (stderr, "Error allocating the tempbuffer.\n");
-		exit (1);
-	}
-	if ((tempbuffer2 = (short int *) calloc (rows*cols, sizeof (short int))) == NULL) {
-		fprintf (stderr, "Error allocating the tempbuffer2.\n");
-		exit (1);
-	}
+	int *rowstart, k, a, b;		/* franjas de filas de cada rank y sus trozos */
+	plane img, tempim, sm;		/* imagen, blur en x de la franja y resultado */
+	strip_pipe sp;			/* allgather de los trozos en curso */
+   blur_kernel bk;       /* The gaussian kernel and the blur tables. */
+
+	phase_begin(PHASE_SMOOTH);
 	if (rank == 0) {
-		tini2 = MPI_Wtime ();
 	   /****************************************************************************
 	   * Create a 1-dimensional gaussian smoothing kernel.
 	   ****************************************************************************/
 	   if(VERBOSE) printf("   Computing the gaussian smoothing kernel.\n");
 	}
-   make_gaussian_kernel(sigma, &kernel, &windowsize);
-   center = windowsize / 2;
+   blur_setup(&bk, sigma, rows, cols);
    /****************************************************************************
-   * Allocate a temporary buffer image and the smoothed image.
+   * Allocate a temporary buffer image and the smoothed image. Every process
+   * smooths a strip of rows; since the image is replicated, the x-blur of
+   * the rows above and below the strip that the y-blur needs is computed
+   * here too instead of being gathered.
    ****************************************************************************/
-   if((tempim = (float *) calloc(rows*cols, sizeof(float))) == NULL){
-      fprintf(stderr, "Error allocating the buffer image.\n");
+   if((rowstart = (int *) calloc(size+1, sizeof(int))) == NULL){
+      fprintf(stderr, "Error allocating the partition.\n");
       exit(1);
    }
-   if(((*smoothedim) = (short int *) calloc(rows*cols,
-         sizeof(short int))) == NULL){
-      fprintf(stderr, "Error allocating the smoothed image.\n");
-      exit(1);
-	}
+   make_partition(rows, size, rowstart);
+   strip_plane(&tempim, rowstart, bk.center, rows, cols,
+      bk.fixed ? sizeof(short int) : sizeof(float), "tempim");
+   *smoothedim = (short int *) frame_alloc((size_t)rows*cols*sizeof(short int),
+      "smoothed image");
+   full_plane(&img, image, rows, cols);
+   full_plane(&sm, *smoothedim, rows, cols);
+
 	if (rank == 0) {
 	   /****************************************************************************
 	   * Blur in the x - direction.
 	   ****************************************************************************/
 	   if(VERBOSE) printf("   Bluring the image in the X-direction.\n");
 	}
-	MPI_Barrier (MPI_COMM_WORLD);
-	if (rank == 0) tini3 = MPI_Wtime ();
-	index = 0;
-   for(r=rank*rows/size;r<(rank+1)*rows/size;r++){
-      for(c=0;c<cols;c++){
-         dot = 0.0;
-         sum = 0.0;
-         for(cc=(-center);cc<=center;cc++){
-            if(((c+cc) >= 0) && ((c+cc) < cols)){
-               dot += (float)image[r*cols+(c+cc)] * kernel[center+cc];
-               sum += kernel[center+cc];
-            }
-         }
-         tempbuffer[index*cols+c] = dot/sum;
-      }
-      index ++;
-   }
-   printf (">rank:%d termino blur x\n", rank);
-   MPI_Barrier (MPI_COMM_WORLD);
-   if (rank == 0) tini4 = MPI_Wtime ();
-   MPI_Allgather (tempbuffer, rows*cols/size, MPI_FLOAT, tempim, rows*cols/size, MPI_FLOAT, MPI_COMM_WORLD);
-	if (rank == 0) {
-		tfin3 = MPI_Wtime ();
-		printf (">>>Allgather demoro: %f\n", tfin3 - tini4);
-		printf (">>>Blur x demoro: %f\n", tfin3 - tini3);
-	}
+	phase_barrier();
+	phase_begin(PHASE_BLUR_X);
+   run_stage(STAGE_BLUR_X, &img, NULL, NULL, &tempim, tempim.r0, tempim.r1, 0,
+      cols, rows, cols, &bk);
+	phase_end(PHASE_BLUR_X);
    
 	if (rank == 0) {
 	   /****************************************************************************
-	   * Blur in the y - direction.
+	   * Blur in the y - direction, sliding the kernel down the rows.
 	   ****************************************************************************/
 	   if(VERBOSE) printf("   Bluring the image in the Y-direction.\n");
 	}
-	if (rank == 0) tini3 = MPI_Wtime ();
-   for(c=rank*cols/size;c<(rank+1)*cols/size;c++){
-      for(r=0;r<rows;r++){
-         sum = 0.0;
-         dot = 0.0;
-         for(rr=(-center);rr<=center;rr++){
-            if(((r+rr) >= 0) && ((r+rr) < rows)){
-               dot += tempim[(r+rr)*cols+c] * kernel[center+rr];
-               sum += kernel[center+rr];
-            }
-         }
-         tempbuffer2[r*cols+c] = (short int)(dot*BOOSTBLURFACTOR/sum + 0.5);
-      }
+	phase_begin(PHASE_BLUR_Y);
+   pipe_open(&sp, PIPE_CHUNKS);
+   for(k=0;k<PIPE_CHUNKS;k++){
+      pipe_rows(rowstart, rank, k, &a, &b);
+      run_stage(STAGE_BLUR_Y, &tempim, NULL, NULL, &sm, a, b, 0, cols, rows,
+         cols, &bk);
+      pipe_allgather(&sp, &sm, MPI_SHORT, rowstart, cols, k);
    }
-   printf (">rank:%d termino blur y\n", rank);
-   MPI_Barrier (MPI_COMM_WORLD);
-   if (rank == 0) tini4 = MPI_Wtime ();
-   MPI_Allreduce (tempbuffer2, *smoothedim, rows*cols, MPI_SHORT, MPI_SUM, MPI_COMM_WORLD);
-	if (rank == 0) {
-		tfin3 = MPI_Wtime ();
-		printf (">>>Allreduce demoro: %f\n", tfin3 - tini4);
-		printf (">>>Blur y demoro: %f\n", tfin3 - tini3);
-	}
+   pipe_close(&sp);
+	phase_end(PHASE_BLUR_Y);
 
-   free(tempim);
-   free(kernel);
-   free(tempbuffer);
-   free(tempbuffer2);
-   if (rank == 0) {
-	   tfin2 = MPI_Wtime ();
-	   printf ("----------------------> gaussian_smooth demoro: %f\n", tfin2 - tini2);
-   }
+   plane_free(&tempim);
+   free(rowstart);
+   blur_free(&bk);
+   phase_end(PHASE_SMOOTH);
+}
+
+/*******************************************************************************
+* FUNCTION: gaussian_window
+* PURPOSE: Number of elements of the gaussian kernel of a given sigma.
+*******************************************************************************/
+int gaussian_window(float sigma)
+{
+   return(1 + 2 * ceil(2.5 * sigma));
 }
 
 /*******************************************************************************
@@ -636,7 +1754,7 @@ void make_gaussian_kernel(float sigma, float **kernel, int *windowsize)
    int i, center;
    float x, fx, sum=0.0;
 
-   *windowsize = 1 + 2 * ceil(2.5 * sigma);
+   *windowsize = gaussian_window(sigma);
    center = (*windowsize) / 2;
 
    if(VERBOSE && rank==0) printf("      The kernel has %d elements.\n", *windowsize);
@@ -679,433 +1797,5918 @@ void make_gaussian_kernel(float sigma, float **kernel, int *windowsize)
 #define EDGE 0
 
 /*******************************************************************************
-* PROCEDURE: follow_edges
-* PURPOSE: This procedure edges is a recursive routine that traces edgs along
-* all paths whose magnitude values remain above some specifyable lower
-* threshhold.
-* NAME: Mike Heath
-* DATE: 2/15/96
+* PROCEDURE: label_edges
+* PURPOSE: Label the 8-connected components of the candidate pixels (the set
+* bits of the bit map mapp) of rows [r0,r1) and columns [c0,c1); c0 is a
+* multiple of 64 and the planes start at column c0. This replaces the recursive
+* follow_edges of the original code, whose depth grew with the length of the
+* edges. The first pass walks the rows in raster order and gives every pixel
+* the smallest label of its neighbours already visited (left, and the three
+* above), recording in a union-find that the labels it touches are the same
+* component. The second pass numbers the roots 1..n in raster order and
+* rewrites the labels. Memory is the label plane plus one entry per
+* provisional label. Only the set bits of each word are visited, and the
+* three neighbours above are probed at once in the bits of the row above.
+* Returns the number of components.
 *******************************************************************************/
-void follow_edges(unsigned char *edgemapptr, short *edgemagptr, short lowval,
-   int cols)
+int label_edges(plane *mapp, plane *labelp, int r0, int r1, int c0, int c1)
 {
-   short *tempmagptr;
-   unsigned char *tempmapptr;
-   int i;
-   float thethresh;
-   int x[8] = {1,1,0,-1,-1,-1,0,1},
-       y[8] = {0,1,1,1,0,-1,-1,-1};
+   int *parent, *lab, *above, nprov, maxprov, r, c, d, l, a, b, k, near,
+       k0 = c0 / BITS_WORD, words = BITS_WORDS(c1) - c0 / BITS_WORD;
+   bitword *map, *up, w;
 
-   for(i=0;i<8;i++){
-      tempmapptr = edgemapptr - y[i]*cols + x[i];
-      tempmagptr = edgemagptr - y[i]*cols + x[i];
+   maxprov = 1024;
+   if((parent = (int *) malloc(maxprov * sizeof(int))) == NULL){
+      fprintf(stderr, "Error allocating the label equivalences.\n");
+      exit(1);
+   }
+   parent[0] = 0;
+   nprov = 0;
 
-      if((*tempmapptr == POSSIBLE_EDGE) && (*tempmagptr > lowval)){
-         *tempmapptr = (unsigned char) EDGE;
-         follow_edges(tempmapptr,tempmagptr, lowval, cols);
+   /* c es la columna desde c0, las palabras de las filas empiezan en k0 */
+   for(r=r0;r<r1;r++){
+      map = PLANE_PTR(mapp, bitword, r, k0);
+      up = (r > r0) ? PLANE_PTR(mapp, bitword, r-1, k0) : NULL;
+      lab = PLANE_PTR(labelp, int, r, c0);
+      above = (r > r0) ? PLANE_PTR(labelp, int, r-1, c0) : NULL;
+      memset(lab, 0, (c1-c0)*sizeof(int));
+      for(k=0;k<words;k++) for(w=map[k];w!=0;w&=w-1){
+         c = k*BITS_WORD + bits_ctz(w);
+         /* la menor etiqueta de los vecinos ya visitados */
+         l = (c > 0) ? lab[c-1] : 0;
+         near = (up != NULL) ? bits_near(up, c, words) : 0;
+         if(near != 0){
+            for(d=-1;d<=1;d++){
+               if(((near >> (d+1)) & 1) == 0) continue;
+               if(l == 0) l = above[c+d];
+               else if(above[c+d] != l){
+                  a = find_root(parent, l);
+                  b = find_root(parent, above[c+d]);
+                  if(a < b) parent[b] = a;
+                  else if(b < a) parent[a] = b;
+               }
+            }
+         }
+         if(l == 0){
+            if(++nprov == maxprov){
+               maxprov *= 2;
+               if((parent = (int *) realloc(parent, maxprov * sizeof(int)))
+                  == NULL){
+                  fprintf(stderr, "Error allocating the label equivalences.\n");
+                  exit(1);
+               }
+            }
+            parent[nprov] = nprov;
+            l = nprov;
+         }
+         lab[c] = l;
+      }
+   }
+
+   /****************************************************************************
+   * Every label points to a smaller one, so walking them in order the parent
+   * of a label already holds its final number (stored negated).
+   ****************************************************************************/
+   for(l=1,d=0;l<=nprov;l++){
+      if(parent[l] == l) parent[l] = -(++d);
+      else parent[l] = parent[parent[l]];
+   }
+   for(r=r0;r<r1;r++){
+      lab = PLANE_PTR(labelp, int, r, c0);
+      for(c=0;c<c1-c0;c++) if(lab[c]) lab[c] = -parent[lab[c]];
+   }
+
+   free(parent);
+   return(d);
+}
+
+/*******************************************************************************
+* PROCEDURE: apply_hysteresis
+* PURPOSE: This routine finds edges that are above some high threshhold or
+* are connected to a high pixel by a path of pixels greater than a low
+* threshold. mag and nms are full images; every process works on its strip
+* of rows and the edge bit map is gathered in rank 0.
+* NAME: Mike Heath
+* DATE: 2/15/96
+*******************************************************************************/
+void apply_hysteresis(short int *mag, bitword *nms, int rows, int cols,
+	float tlow, float thigh, bitword *edge)
+{
+	int *rowstart;				/* primera fila de cada franja */
+	int words = BITS_WORDS(cols);
+	plane magp, nmsp, edgep;
+
+	if((rowstart = (int *) calloc(size+1, sizeof(int))) == NULL){
+		fprintf(stderr, "Error allocating the partition.\n");
+		exit(1);
+	}
+	make_partition(rows, size, rowstart);
+
+	/* planos sobre las imagenes completas */
+	full_plane(&magp, mag, rows, cols);
+	full_plane(&nmsp, nms, rows, words);
+	strip_plane(&edgep, rowstart, 0, rows, words, sizeof(bitword), "edge");
+
+	hysteresis_strip(&magp, &nmsp, rows, cols, tlow, thigh, &edgep, rowstart,
+		NULL);
+	phase_begin(PHASE_GATHER);
+	gather_strips(&edgep, MPI_BITWORD, rowstart, words, edge);
+	phase_end(PHASE_GATHER);
+
+	plane_free(&edgep);
+	free(rowstart);
+}
+
+/*******************************************************************************
+* PROCEDURE: hysteresis_strip
+* PURPOSE: Hysteresis thresholding of the strip of rows of this process. The
+* pixels that passed the non-maximal suppression and are above the low
+* threshold (or above the high one) are split in 8-connected components and
+* a component is an edge when any of its pixels is above the high threshold,
+* which is what the recursive follow_edges did from every high pixel in the
+* serial code.
+* The components are labelled inside each strip; the labels of the rows next
+* to the strip boundaries are then merged across strips, so the result does
+* not depend on the number of processes. mag must hold the rows of the strip,
+* edge receives them. nms, edge and the map of candidates are bit maps (see
+* bitmap.c). Inside the strip the threads label bands of rows that are
+* joined in the same way.
+* With a tile grid tg (rowstart is then NULL) the same is done on the tile
+* of this process; mag must also hold one pixel around the tile and the
+* labels are merged across the four sides and the corners of the tiles.
+*******************************************************************************/
+void hysteresis_strip(plane *mag, plane *nms, int rows, int cols, float tlow,
+	float thigh, plane *edge, int *rowstart, tile_grid *tg)
+{
+	int lowthreshold, highthreshold;
+	hyst_job job;
+
+	phase_begin(PHASE_HYSTERESIS);
+	hysteresis_open(&job, mag, nms, rows, cols, rowstart, tg, 1, &tlow, &thigh,
+		&lowthreshold, &highthreshold, 0);
+
+   if(VERBOSE && rank==0){
+      printf("The input low and high fractions of %f and %f computed to\n",
+	 tlow, thigh);
+      printf("magnitude of the gradient threshold values of: %d %d\n",
+	 lowthreshold, highthreshold);
+   }
+	hysteresis_edges(&job, lowthreshold, highthreshold, edge);
+	hysteresis_close(&job);
+	phase_end(PHASE_HYSTERESIS);
+}
+
+/*******************************************************************************
+* PROCEDURE: hysteresis_open
+* PURPOSE: First part of hysteresis_strip, the one that does not depend on
+* the thresholds. Allocate the planes and the tables of job, build the map
+* of candidates and the histogram of their magnitude, and compute from it
+* the thresholds low[i] and high[i] of the n pairs of fractions tlow[i] and
+* thigh[i]. With keep the map of candidates is kept apart from the one that
+* hysteresis_edges thins out, so hysteresis_edges can run once per pair.
+*******************************************************************************/
+void hysteresis_open(hyst_job *job, plane *mag, plane *nms, int rows,
+	int cols, int *rowstart, tile_grid *tg, int n, float *tlow, float *thigh,
+	int *low, int *high, int keep)
+{
+	int *temphist;				/* histograma local de la magnitud */
+	int localmax;				/* mayor magnitud local de los candidatos */
+	int *workmax, nbands, w, b;
+	int r0, r1, c0, c1;			/* franja o tesela propia */
+
+	if(tg != NULL){
+		/* las etiquetas de la tesela con un pixel de halo a cada lado */
+		r0 = tg->r0; r1 = tg->r1; c0 = tg->c0; c1 = tg->c1;
+		tile_bits(&job->map, tg, "edgemap");
+		tile_plane(&job->label, tg, 1, 1, rows, cols, sizeof(int), "label");
+		if(keep) tile_bits(&job->candmap, tg, "candidates");
+	}
+	else{
+		/* mapa de candidatos y etiquetas con una fila de halo a cada lado */
+		r0 = rowstart[rank]; r1 = rowstart[rank+1]; c0 = 0; c1 = cols;
+		strip_plane(&job->map, rowstart, 1, rows, BITS_WORDS(cols),
+			sizeof(bitword), "edgemap");
+		strip_plane(&job->label, rowstart, 1, rows, cols, sizeof(int), "label");
+		if(keep) strip_plane(&job->candmap, rowstart, 0, rows, BITS_WORDS(cols),
+			sizeof(bitword), "candidates");
+	}
+
+	/****************************************************************************
+	* The passes over the strip are split in bands of rows among the threads
+	* of the pool. Every thread keeps its own histogram.
+	****************************************************************************/
+	nbands = pool_bands(r0, r1, 16);
+	temphist = (int *) arena_alloc((size_t)nthreads*32768*sizeof(int), 1,
+		"histogram");
+	if(((workmax = (int *) calloc(nthreads, sizeof(int))) == NULL) ||
+	   ((job->nlabels = (int *) calloc(nbands+1, sizeof(int))) == NULL) ||
+	   ((job->offset = (int *) calloc(nbands+1, sizeof(int))) == NULL)){
+		fprintf(stderr, "Error allocating the histogram.\n");
+		exit(1);
+	}
+	job->mag = mag; job->nms = nms; job->mapp = &job->map;
+	job->labelp = &job->label;
+	job->cand = keep ? &job->candmap : &job->map;
+	job->edge = NULL;
+	job->rows = rows; job->cols = cols;
+	job->r0 = r0; job->r1 = r1;
+	job->c0 = c0; job->c1 = c1;
+	job->rowstart = rowstart; job->tg = tg;
+	job->nbands = nbands;
+	job->hist = temphist; job->localmax = workmax;
+	job->seed = NULL; job->root = NULL;
+
+   /****************************************************************************
+   * Initialize the edge map to possible edges everywhere the non-maximal
+   * suppression suggested there could be an edge except for the border. At
+   * the border we say there can not be an edge because it makes the
+   * labelling more efficient to not worry about tracking an edge off the
+   * side of the image.
+   * The histogram of the magnitude of the possible edges is computed in the
+   * same pass. Then use the histogram to compute hysteresis thresholds.
+   ****************************************************************************/
+	job->pass = HYST_MAP;
+	pool_run(nbands, hysteresis_task, job);
+	localmax = 0;
+	for(w=0;w<nthreads;w++) if(workmax[w] > localmax) localmax = workmax[w];
+	for(w=1;w<nthreads;w++)
+		for(b=0;b<=localmax;b++) temphist[b] += temphist[(long)w*32768+b];
+
+   /****************************************************************************
+   * Compute the high threshold value as the (100 * thigh) percentage point
+   * in the magnitude of the gradient histogram of all the pixels that passes
+   * non-maximal suppression. Then calculate the low threshold as a fraction
+   * of the computed high threshold value. John Canny said in his paper
+   * "A Computational Approach to Edge Detection" that "The ratio of the
+   * high to low threshold in the implementation is in the range two or three
+   * to one." That means that in terms of this implementation, we should
+   * choose tlow ~= 0.5 or 0.33333.
+   ****************************************************************************/
+   phase_begin(PHASE_THRESHOLDS);
+   select_threshold_list(temphist, localmax, n, tlow, thigh, low, high);
+   phase_end(PHASE_THRESHOLDS);
+   arena_free (temphist);
+   free (workmax);
+   job->hist = NULL; job->localmax = NULL;
+}
+
+/*******************************************************************************
+* PROCEDURE: hysteresis_edges
+* PURPOSE: Second part of hysteresis_strip: mark in edge the edges of the
+* strip (or tile) of job with the thresholds lowthreshold and highthreshold.
+*******************************************************************************/
+void hysteresis_edges(hyst_job *job, int lowthreshold, int highthreshold,
+	plane *edge)
+{
+	int *lab, *above;			/* etiquetas de una fila y de la anterior */
+	int *parent;
+	unsigned char *seed;			/* la etiqueta tiene un pixel fuerte */
+	int nlabels, offset, nbands = job->nbands, t, d, a, b, l;
+	int r, c, c0 = job->c0, c1 = job->c1;
+
+	job->lowthreshold = lowthreshold;
+	job->highthreshold = highthreshold;
+	job->edge = edge;
+
+   /****************************************************************************
+   * Only the possible edges above the low threshold can carry an edge, plus
+   * the ones above the high threshold that start an edge by themselves.
+   * Then label the components of every band.
+   ****************************************************************************/
+	job->pass = HYST_LOW;
+	pool_run(nbands, hysteresis_task, job);
+	job->pass = HYST_LABEL;
+	pool_run(nbands, hysteresis_task, job);
+	for(t=0,nlabels=0;t<nbands;t++){
+		job->offset[t] = nlabels;
+		nlabels += job->nlabels[t];
+	}
+	if((seed = (unsigned char *) calloc(nlabels+1, sizeof(unsigned char)))
+	   == NULL){
+		fprintf(stderr, "Error allocating the seed flags.\n");
+		exit(1);
+	}
+
+	/****************************************************************************
+	* The labels of the bands are made consecutive, remembering the components
+	* that hold a pixel above the high threshold.
+	****************************************************************************/
+	job->seed = seed;
+	job->pass = HYST_SEED;
+	pool_run(nbands, hysteresis_task, job);
+
+	/****************************************************************************
+	* The components that cross the boundaries between bands are joined with
+	* a union-find, as merge_strip_labels does between processes, and every
+	* pixel takes the label of the root of its component.
+	****************************************************************************/
+	if(nbands > 1){
+		if((parent = (int *) calloc(nlabels+1, sizeof(int))) == NULL){
+			fprintf(stderr, "Error allocating the label equivalences.\n");
+			exit(1);
+		}
+		for(l=0;l<=nlabels;l++) parent[l] = l;
+		for(t=1;t<nbands;t++){
+			r = job->r0 + (int)((long)t * (job->r1 - job->r0) / nbands);
+			lab = PLANE_PTR(job->labelp, int, r, c0);
+			above = PLANE_PTR(job->labelp, int, r-1, c0);
+			for(c=0;c<c1-c0;c++){
+				if(lab[c] == 0) continue;
+				for(d=-1;d<=1;d++){
+					if((c+d < 0) || (c+d >= c1-c0) || (above[c+d] == 0))
+						continue;
+					a = find_root(parent, lab[c]);
+					b = find_root(parent, above[c+d]);
+					if(a < b) parent[b] = a;
+					else if(b < a) parent[a] = b;
+				}
+			}
+		}
+		for(l=1;l<=nlabels;l++){
+			parent[l] = find_root(parent, l);
+			if(seed[l]) seed[parent[l]] = 1;
+		}
+		job->root = parent;
+		job->pass = HYST_ROOT;
+		pool_run(nbands, hysteresis_task, job);
+		free(parent);
+		job->root = NULL;
+	}
+
+   /****************************************************************************
+   * Merge the components that cross the strip (or tile) boundaries.
+   ****************************************************************************/
+   phase_begin(PHASE_MERGE);
+   offset = 0;
+   MPI_Exscan (&nlabels, &offset, 1, MPI_INT, MPI_SUM, canny_comm);
+   if (rank == 0) offset = 0;
+   if(job->tg != NULL)
+      merge_tile_labels(job->labelp, seed, nlabels, offset, job->tg);
+   else merge_strip_labels(job->labelp, seed, nlabels, offset, job->cols,
+      job->rowstart);
+   phase_end(PHASE_MERGE);
+
+   /****************************************************************************
+   * Set the pixels of the components with a high pixel to edges and all the
+   * remaining possible edges to non-edges.
+   ****************************************************************************/
+	job->labeloffset = offset;
+	job->pass = HYST_EDGE;
+	pool_run(nbands, hysteresis_task, job);
+
+   free (seed);
+   job->seed = NULL;
+}
+
+/*******************************************************************************
+* PROCEDURE: hysteresis_close
+* PURPOSE: Free what hysteresis_open allocated.
+*******************************************************************************/
+void hysteresis_close(hyst_job *job)
+{
+   if(job->cand != job->mapp) plane_free(job->cand);
+   plane_free(job->mapp);
+   plane_free(job->labelp);
+   free (job->nlabels);
+   free (job->offset);
+}
+
+/*******************************************************************************
+* FUNCTION: hysteresis_sweep
+* PURPOSE: Collective. The hysteresis of -sweep: every pair of a fraction of
+* sweep_tlow and one of sweep_thigh is run on the same magnitude and nms map
+* of the strip (or tile), and its edge image is written to the file named
+* after infilename, sigma and the pair, as in canny_file. The map of
+* candidates, the histogram and the thresholds of all the pairs are computed
+* once, so each pair only costs the labelling and the writing of its edges.
+* Returns 0 when an edge image can not be written.
+*******************************************************************************/
+int hysteresis_sweep(plane *mag, plane *nms, int rows, int cols,
+	int *rowstart, tile_grid *tg, char *infilename, float sigma)
+{
+	int n = sweep_nlow * sweep_nhigh, i, ok = 1, *low, *high;
+	float *tlow, *thigh;
+	char outfilename[BATCH_NAMELEN+64];	/* Name of the output "edge" image */
+	hyst_job job;
+	plane edgep, edgeb;
+
+	if(((low = (int *) calloc(n, sizeof(int))) == NULL) ||
+	   ((high = (int *) calloc(n, sizeof(int))) == NULL) ||
+	   ((tlow = (float *) calloc(n, sizeof(float))) == NULL) ||
+	   ((thigh = (float *) calloc(n, sizeof(float))) == NULL)){
+		fprintf(stderr, "Error allocating the sweep thresholds.\n");
+		exit(1);
+	}
+	for(i=0;i<n;i++){
+		tlow[i] = sweep_tlow[i / sweep_nhigh];
+		thigh[i] = sweep_thigh[i % sweep_nhigh];
+	}
+
+	phase_begin(PHASE_HYSTERESIS);
+	hysteresis_open(&job, mag, nms, rows, cols, rowstart, tg, n, tlow, thigh,
+		low, high, 1);
+	if(tg != NULL) tile_bits(&edgep, tg, "edge");
+	else strip_plane(&edgep, rowstart, 0, rows, BITS_WORDS(cols),
+		sizeof(bitword), "edge");
+	phase_end(PHASE_HYSTERESIS);
+
+	for(i=0;i<n;i++){
+		phase_begin(PHASE_HYSTERESIS);
+		hysteresis_edges(&job, low[i], high[i], &edgep);
+		phase_end(PHASE_HYSTERESIS);
+
+		snprintf(outfilename, sizeof(outfilename),
+			"%s_s_%3.2f_l_%3.2f_h_%3.2f.pgm", infilename, sigma, tlow[i],
+			thigh[i]);
+		phase_begin(PHASE_WRITE);
+		bits_expand(&edgep, &edgeb, cols);
+		if(((tg != NULL) ? write_pgm_tile(outfilename, &edgeb, rows, cols, "",
+		   255) : write_pgm_rows(outfilename, &edgeb, rows, cols, "", 255))
+		   == 0){
+			fprintf(stderr, "Error writing the edge image, %s.\n", outfilename);
+			ok = 0;
+		}
+		plane_free(&edgeb);
+		phase_end(PHASE_WRITE);
+	}
+
+	plane_free(&edgep);
+	hysteresis_close(&job);
+	free(low);
+	free(high);
+	free(tlow);
+	free(thigh);
+	return(ok);
+}
+
+/*******************************************************************************
+* PROCEDURE: hysteresis_task
+* PURPOSE: One pass of hysteresis_strip over band t of the strip (or tile).
+*******************************************************************************/
+void hysteresis_task(int t, int worker, void *arg)
+{
+	hyst_job *job = (hyst_job *) arg;
+	int r, c, k, r0, r1, rows = job->rows, cols = job->cols, *lab, *hist,
+	    c0 = job->c0, k0 = job->c0 / BITS_WORD, k1 = BITS_WORDS(job->c1);
+	bitword *map, *cand, *edgemap, w, e;
+	short *magptr;
+
+	r0 = job->r0 + (int)((long)t * (job->r1 - job->r0) / job->nbands);
+	r1 = job->r0 + (int)((long)(t+1) * (job->r1 - job->r0) / job->nbands);
+	hist = job->hist + (long)worker*32768;
+
+	/* en cada pasada solo se visitan los bits puestos de cada palabra; las
+	   filas de los planos empiezan en la palabra k0 y en la columna c0 */
+	switch(job->pass){
+	case HYST_MAP:
+		for(r=r0;r<r1;r++){
+			map = PLANE_PTR(job->cand, bitword, r, k0);
+			edgemap = PLANE_PTR(job->nms, bitword, r, k0);
+			magptr = PLANE_PTR(job->mag, short, r, c0);
+			for(k=k0;k<k1;k++){
+				map[k-k0] = ((r > 0) && (r < rows-1)) ?
+					edgemap[k-k0] & bits_interior(k, cols) : 0;
+				for(w=map[k-k0];w!=0;w&=w-1){
+					c = k*BITS_WORD + bits_ctz(w);
+					if(sample_pixel(r, c, cols, thresh_sample)){
+						hist[magptr[c-c0]]++;
+						if(magptr[c-c0] > job->localmax[worker])
+							job->localmax[worker] = magptr[c-c0];
+					}
+				}
+			}
+		}
+		break;
+	case HYST_LOW:
+		/* los candidatos quedan intactos si no son el mismo mapa */
+		for(r=r0;r<r1;r++){
+			cand = PLANE_PTR(job->cand, bitword, r, k0);
+			map = PLANE_PTR(job->mapp, bitword, r, k0);
+			magptr = PLANE_PTR(job->mag, short, r, c0);
+			for(k=k0;k<k1;k++){
+				map[k-k0] = cand[k-k0];
+				for(w=cand[k-k0];w!=0;w&=w-1){
+					c = k*BITS_WORD + bits_ctz(w);
+					if((magptr[c-c0] <= job->lowthreshold) &&
+					   (magptr[c-c0] < job->highthreshold))
+						map[k-k0] &= ~(w & -w);
+				}
+			}
+		}
+		break;
+	case HYST_LABEL:
+		job->nlabels[t] = label_edges(job->mapp, job->labelp, r0, r1,
+			job->c0, job->c1);
+		break;
+	case HYST_SEED:
+		/* las etiquetas de cada banda no se pisan, ni sus semillas */
+		for(r=r0;r<r1;r++){
+			map = PLANE_PTR(job->mapp, bitword, r, k0);
+			lab = PLANE_PTR(job->labelp, int, r, c0);
+			magptr = PLANE_PTR(job->mag, short, r, c0);
+			for(k=k0;k<k1;k++) for(w=map[k-k0];w!=0;w&=w-1){
+				c = k*BITS_WORD + bits_ctz(w) - c0;
+				lab[c] += job->offset[t];
+				if(magptr[c] >= job->highthreshold) job->seed[lab[c]] = 1;
+			}
+		}
+		break;
+	case HYST_ROOT:
+		for(r=r0;r<r1;r++){
+			map = PLANE_PTR(job->mapp, bitword, r, k0);
+			lab = PLANE_PTR(job->labelp, int, r, c0);
+			for(k=k0;k<k1;k++) for(w=map[k-k0];w!=0;w&=w-1){
+				c = k*BITS_WORD + bits_ctz(w) - c0;
+				lab[c] = job->root[lab[c]];
+			}
+		}
+		break;
+	case HYST_EDGE:
+		for(r=r0;r<r1;r++){
+			map = PLANE_PTR(job->mapp, bitword, r, k0);
+			lab = PLANE_PTR(job->labelp, int, r, c0);
+			edgemap = PLANE_PTR(job->edge, bitword, r, k0);
+			for(k=k0;k<k1;k++){
+				for(w=map[k-k0],e=0;w!=0;w&=w-1){
+					c = k*BITS_WORD + bits_ctz(w) - c0;
+					if(job->seed[lab[c]-job->labeloffset]) e |= w & -w;
+				}
+				edgemap[k-k0] = e;
+			}
+		}
+		break;
+	}
+}
+
+/*******************************************************************************
+* PROCEDURE: merge_strip_labels
+* PURPOSE: Join the components of neighbouring strips. The local labels
+* 1..nlabels become offset+1..offset+nlabels. Every process exchanges its
+* first and last row of labels with its neighbours, and the pairs of touching
+* labels across each boundary, together with the seed flag of every component
+* that reaches a boundary row, are shared by all processes and joined by
+* join_boundary_labels. The traffic is proportional to the number of
+* boundaries times the number of columns.
+*******************************************************************************/
+void merge_strip_labels(plane *labelp, unsigned char *seed, int nlabels,
+	int offset, int cols, int *rowstart)
+{
+	int r0 = rowstart[rank], r1 = rowstart[rank+1];
+	int *lab, *above, *pairs, *info;
+	int npairs, ninfo, c, d, i;
+	unsigned char *onboundary;
+
+	/* etiquetas globales en las filas propias, y las del halo desde los vecinos */
+	for(i=r0;i<r1;i++){
+		lab = PLANE_PTR(labelp, int, i, 0);
+		for(c=0;c<cols;c++) if(lab[c]) lab[c] += offset;
+	}
+	exchange_halo(labelp, MPI_INT, 1, rowstart);
+
+	if(((pairs = (int *) calloc(6*cols+2, sizeof(int))) == NULL) ||
+	   ((info = (int *) calloc(4*cols+2, sizeof(int))) == NULL) ||
+	   ((onboundary = (unsigned char *) calloc(nlabels+1, 1)) == NULL)){
+		fprintf(stderr, "Error allocating the boundary labels.\n");
+		exit(1);
+	}
+
+	/* pares de etiquetas que se tocan a traves del borde superior */
+	npairs = 0;
+	if((r0 < r1) && (r0 > 0)){
+		lab = PLANE_PTR(labelp, int, r0, 0);
+		above = PLANE_PTR(labelp, int, r0-1, 0);
+		for(c=0;c<cols;c++){
+			if(lab[c] == 0) continue;
+			for(d=-1;d<=1;d++){
+				if((c+d < 0) || (c+d >= cols) || (above[c+d] == 0)) continue;
+				if((npairs > 0) && (pairs[2*npairs-2] == lab[c]) &&
+				   (pairs[2*npairs-1] == above[c+d])) continue;
+				pairs[2*npairs] = lab[c];
+				pairs[2*npairs+1] = above[c+d];
+				npairs++;
+			}
+		}
+	}
+
+	/* componentes que llegan a la primera o a la ultima fila propia */
+	ninfo = 0;
+	for(d=0;(d<2)&&(r0<r1);d++){
+		lab = PLANE_PTR(labelp, int, (d == 0) ? r0 : r1-1, 0);
+		for(c=0;c<cols;c++){
+			if((lab[c] == 0) || onboundary[lab[c]-offset]) continue;
+			onboundary[lab[c]-offset] = 1;
+			info[2*ninfo] = lab[c];
+			info[2*ninfo+1] = seed[lab[c]-offset];
+			ninfo++;
+		}
+	}
+
+	join_boundary_labels(pairs, npairs, info, ninfo, seed, nlabels, offset);
+	free(pairs);
+	free(info);
+	free(onboundary);
+}
+
+/*******************************************************************************
+* PROCEDURE: merge_tile_labels
+* PURPOSE: Join the components of neighbouring tiles, as merge_strip_labels
+* does for strips. The label plane holds one pixel around the tile, filled
+* from the eight neighbouring tiles. Each process records the pairs of
+* touching labels across its top side, including the pixels of the corners
+* above, and across its left side; the tiles below and to the right record
+* the other two sides. Every component that reaches a side of the tile is a
+* boundary component. The boundary data is proportional to the perimeter of
+* the tiles.
+*******************************************************************************/
+void merge_tile_labels(plane *labelp, unsigned char *seed, int nlabels,
+	int offset, tile_grid *tg)
+{
+	int r0 = tg->r0, r1 = tg->r1, c0 = tg->c0, c1 = tg->c1;
+	int *lab, *above, *pairs, *info, npairs, ninfo, r, c, d, l, n, step;
+	unsigned char *onboundary;
+
+	/* etiquetas globales en la tesela, y las del halo desde los vecinos */
+	for(r=r0;r<r1;r++){
+		lab = PLANE_PTR(labelp, int, r, c0);
+		for(c=0;c<c1-c0;c++) if(lab[c]) lab[c] += offset;
+	}
+	exchange_tile_halo(labelp, MPI_INT, 1, 1, tg);
+
+	n = (c1 - c0) + (r1 - r0);
+	if(((pairs = (int *) calloc(6*n+2, sizeof(int))) == NULL) ||
+	   ((info = (int *) calloc(4*n+2, sizeof(int))) == NULL) ||
+	   ((onboundary = (unsigned char *) calloc(nlabels+1, 1)) == NULL)){
+		fprintf(stderr, "Error allocating the boundary labels.\n");
+		exit(1);
+	}
+
+	/* pares a traves del lado superior, con las esquinas de arriba */
+	npairs = 0;
+	if((r0 < r1) && (r0 > 0)){
+		above = PLANE_PTR(labelp, int, r0-1, labelp->c0);
+		for(c=c0;c<c1;c++){
+			if((l = *PLANE_PTR(labelp, int, r0, c)) == 0) continue;
+			for(d=-1;d<=1;d++){
+				if((c+d < labelp->c0) || (c+d >= labelp->c1) ||
+				   (above[c+d-labelp->c0] == 0)) continue;
+				if((npairs > 0) && (pairs[2*npairs-2] == l) &&
+				   (pairs[2*npairs-1] == above[c+d-labelp->c0])) continue;
+				pairs[2*npairs] = l;
+				pairs[2*npairs+1] = above[c+d-labelp->c0];
+				npairs++;
+			}
+		}
+	}
+
+	/* y a traves del lado izquierdo, sin las esquinas */
+	if((c0 < c1) && (c0 > 0)){
+		for(r=r0;r<r1;r++){
+			if((l = *PLANE_PTR(labelp, int, r, c0)) == 0) continue;
+			for(d=-1;d<=1;d++){
+				if((r+d < r0) || (r+d >= r1) ||
+				   (*PLANE_PTR(labelp, int, r+d, c0-1) == 0)) continue;
+				if((npairs > 0) && (pairs[2*npairs-2] == l) &&
+				   (pairs[2*npairs-1] == *PLANE_PTR(labelp, int, r+d, c0-1)))
+					continue;
+				pairs[2*npairs] = l;
+				pairs[2*npairs+1] = *PLANE_PTR(labelp, int, r+d, c0-1);
+				npairs++;
+			}
+		}
+	}
+
+	/* componentes que llegan a los lados de la tesela */
+	ninfo = 0;
+	for(r=r0;r<r1;r++){
+		/* la primera y la ultima fila enteras, de las otras sus extremos */
+		step = ((r == r0) || (r == r1-1) || (c1-c0 < 2)) ? 1 : c1-c0-1;
+		for(c=c0;c<c1;c+=step){
+			l = *PLANE_PTR(labelp, int, r, c);
+			if((l == 0) || onboundary[l-offset]) continue;
+			onboundary[l-offset] = 1;
+			info[2*ninfo] = l;
+			info[2*ninfo+1] = seed[l-offset];
+			ninfo++;
+		}
+	}
+
+	join_boundary_labels(pairs, npairs, info, ninfo, seed, nlabels, offset);
+	free(pairs);
+	free(info);
+	free(onboundary);
+}
+
+/*******************************************************************************
+* PROCEDURE: join_boundary_labels
+* PURPOSE: Share among all processes the npairs pairs of touching labels and
+* the ninfo boundary components (label and seed flag) that this process
+* found, join them with a union-find and give the components of this process
+* (labels offset+1..offset+nlabels) the seed flag of their root.
+*******************************************************************************/
+void join_boundary_labels(int *pairs, int npairs, int *info, int ninfo,
+	unsigned char *seed, int nlabels, int offset)
+{
+	int *allpairs, *allinfo, *parent, *counts, *displs;
+	int ntotpairs, ntotinfo, i, p, a, b, n;
+	unsigned char *rootseed;
+
+	/* todos los procesos reciben los pares y las componentes de borde */
+	if(((counts = (int *) calloc(size, sizeof(int))) == NULL) ||
+	   ((displs = (int *) calloc(size, sizeof(int))) == NULL)){
+		fprintf(stderr, "Error allocating the gather counts.\n");
+		exit(1);
+	}
+	n = 2*npairs;
+	MPI_Allgather (&n, 1, MPI_INT, counts, 1, MPI_INT, canny_comm);
+	for(p=0,ntotpairs=0;p<size;p++){ displs[p] = ntotpairs; ntotpairs += counts[p]; }
+	if((allpairs = (int *) calloc(ntotpairs+1, sizeof(int))) == NULL){
+		fprintf(stderr, "Error allocating the boundary pairs.\n");
+		exit(1);
+	}
+	memcpy(allpairs + displs[rank], pairs, n*sizeof(int));
+	coll_allgatherv(allpairs, counts, displs, MPI_INT, coll, MPI_WIN_NULL);
+	n = 2*ninfo;
+	MPI_Allgather (&n, 1, MPI_INT, counts, 1, MPI_INT, canny_comm);
+	for(p=0,ntotinfo=0;p<size;p++){ displs[p] = ntotinfo; ntotinfo += counts[p]; }
+	if((allinfo = (int *) calloc(ntotinfo+1, sizeof(int))) == NULL){
+		fprintf(stderr, "Error allocating the boundary labels.\n");
+		exit(1);
+	}
+	memcpy(allinfo + displs[rank], info, n*sizeof(int));
+	coll_allgatherv(allinfo, counts, displs, MPI_INT, coll, MPI_WIN_NULL);
+	ntotpairs /= 2;
+	ntotinfo /= 2;
+
+	/****************************************************************************
+	* The boundary components are sorted by label so the union-find can work
+	* on their positions in allinfo.
+	****************************************************************************/
+	if(((parent = (int *) calloc(ntotinfo+1, sizeof(int))) == NULL) ||
+	   ((rootseed = (unsigned char *) calloc(ntotinfo+1, 1)) == NULL)){
+		fprintf(stderr, "Error allocating the union-find.\n");
+		exit(1);
+	}
+	qsort(allinfo, ntotinfo, 2*sizeof(int), compare_int);
+	for(i=0;i<ntotinfo;i++) parent[i] = i;
+	for(i=0;i<ntotpairs;i++){
+		a = find_root(parent, label_index(allinfo, ntotinfo, allpairs[2*i]));
+		b = find_root(parent, label_index(allinfo, ntotinfo, allpairs[2*i+1]));
+		if(a < b) parent[b] = a;
+		else if(b < a) parent[a] = b;
+	}
+	for(i=0;i<ntotinfo;i++)
+		if(allinfo[2*i+1]) rootseed[find_root(parent, i)] = 1;
+
+	/* las componentes propias de borde heredan la semilla de su raiz */
+	for(i=0;i<ntotinfo;i++){
+		a = allinfo[2*i] - offset;
+		if((a >= 1) && (a <= nlabels))
+			seed[a] = rootseed[find_root(parent, i)];
+	}
+
+	free(counts);
+	free(displs);
+	free(allpairs);
+	free(allinfo);
+	free(parent);
+	free(rootseed);
+}
+
+/*******************************************************************************
+* Helpers of the union-find of merge_strip_labels.
+*******************************************************************************/
+int compare_int(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+
+	return((x > y) - (x < y));
+}
+
+int find_root(int *parent, int i)
+{
+	while(parent[i] != i){
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return(i);
+}
+
+int label_index(int *info, int n, int label)
+{
+	int lo = 0, hi = n-1, mid;
+
+	while(lo < hi){
+		mid = (lo + hi) / 2;
+		if(info[2*mid] < label) lo = mid + 1;
+		else hi = mid;
+	}
+	return(lo);
+}
+
+/*******************************************************************************
+* PROCEDURE: non_max_supp
+* PURPOSE: This routine applies non-maximal suppression to the magnitude of
+* the gradient image.
+* NAME: Mike Heath
+* DATE: 2/15/96
+*******************************************************************************/
+void non_max_supp(short *mag, short *gradx, short *grady, int nrows, int ncols,
+    bitword *result) 
+{
+	int *rowstart, k, a, b;			/* franjas de filas de cada rank y sus trozos */
+	plane magp, gxp, gyp, resp;		/* las imagenes completas como planos */
+	strip_pipe sp;				/* allgather de los trozos en curso */
+    //unsigned char *resultrowptr, *resultptr;	/* no se utilizan */
+    
+	phase_begin(PHASE_NMS);
+   /****************************************************************************
+   * Zero the edges of the result image.
+   ****************************************************************************/
+   /* no es necesario ya que no se usan estos arreglos */
+   /*
+    for(count=0,resultrowptr=result,resultptr=result+ncols*(nrows-1); 
+        count<ncols; resultptr++,resultrowptr++,count++){
+        *resultrowptr = *resultptr = (unsigned char) 0;
+    }
+
+    for(count=0,resultptr=result,resultrowptr=result+ncols-1;
+        count<nrows; count++,resultptr+=ncols,resultrowptr+=ncols){
+        *resultptr = *resultrowptr = (unsigned char) 0;
+    }
+    */
+    
+    if ((rowstart = (int *) calloc (size+1, sizeof (int))) == NULL) {
+		fprintf (stderr, "Error allocating the partition.\n");
+		exit (1);
+	}
+	make_partition (nrows, size, rowstart);
+
+   /****************************************************************************
+   * Suppress non-maximum points.
+   ****************************************************************************/
+   /* cada rank hace su franja de filas directamente en result, un bit por
+      pixel; non_max_supp_plane deja en cero los bordes. Los trozos se
+      reparten con allgather mientras se calculan los siguientes, en vez de
+      sumar con Allreduce las imagenes completas de todos los ranks */
+   full_plane(&magp, mag, nrows, ncols);
+   full_plane(&gxp, gradx, nrows, ncols);
+   full_plane(&gyp, grady, nrows, ncols);
+   full_plane(&resp, result, nrows, BITS_WORDS(ncols));
+   pipe_open(&sp, PIPE_CHUNKS);
+   for(k=0;k<PIPE_CHUNKS;k++){
+      pipe_rows(rowstart, rank, k, &a, &b);
+      run_stage(STAGE_NMS, &magp, &gxp, &gyp, &resp, a, b, 0, ncols, nrows,
+         ncols, NULL);
+      pipe_allgather(&sp, &resp, MPI_BITWORD, rowstart, BITS_WORDS(ncols), k);
+   }
+   pipe_close(&sp);
+	free (rowstart);
+	phase_end(PHASE_NMS);
+}
+//<------------------------- end hysteresis.c ------------------------->
+
+//<------------------------- begin threshold.c ------------------------->
+/*******************************************************************************
+* FILE: threshold.c
+* Selection of the hysteresis thresholds from the histogram of the magnitude
+* of the possible edges, spread over the processes. The global maximum of the
+* magnitude is reduced first so the histogram only has the bins that can be
+* used, the bins are reduce-scattered so every process adds up only its
+* range of them, and the running count at the start of each range comes from
+* the sums of the ranges. Only the process whose range holds the (100 *
+* thigh) percentage point looks for it. With -sample N the histogram takes
+* about one possible edge in N, chosen by position so the thresholds do not
+* depend on the number of processes; the thresholds are then approximate.
+*******************************************************************************/
+
+/*******************************************************************************
+* FUNCTION: sample_pixel
+* PURPOSE: Whether pixel (r,c) enters the histogram when one pixel in n is
+* sampled.
+*******************************************************************************/
+int sample_pixel(int r, int c, int cols, int n)
+{
+   unsigned int h;
+
+   if(n <= 1) return(1);
+   h = (unsigned int)((long)r * cols + c) * 2654435761u;
+   return(((h >> 16) % n) == 0);
+}
+
+/*******************************************************************************
+* PROCEDURE: select_thresholds
+* PURPOSE: Compute the low and high hysteresis thresholds. hist holds the
+* counts of the magnitudes 0 to localmax of the possible edges of this
+* process and localmax is their largest magnitude (0 when there are none).
+* hist must have room for 32768 bins and is used as work space. Without
+* sampling the result is the one of the serial code.
+*******************************************************************************/
+void select_thresholds(int *hist, int localmax, float tlow, float thigh,
+        int *lowthreshold, int *highthreshold)
+{
+   select_threshold_list(hist, localmax, 1, &tlow, &thigh, lowthreshold,
+      highthreshold);
+}
+
+/*******************************************************************************
+* PROCEDURE: select_threshold_list
+* PURPOSE: select_thresholds for the n pairs of fractions tlow[i] and
+* thigh[i] at once, into low[i] and high[i]. The histogram is reduced once
+* for all of them.
+*******************************************************************************/
+void select_threshold_list(int *hist, int localmax, int n, float *tlow,
+        float *thigh, int *low, int *high)
+{
+   int p, b, b0, b1, nbins, maximum_mag, numedges, highcount, count, first,
+       cap, i, start, *binstart, *bincount, *binsum, *mybins, *firsts;
+
+   /****************************************************************************
+   * The histogram runs up to the largest magnitude of all the processes.
+   * Magnitude 0 is not counted, as in the serial code.
+   ****************************************************************************/
+   MPI_Allreduce(&localmax, &maximum_mag, 1, MPI_INT, MPI_MAX, canny_comm);
+   nbins = maximum_mag + 1;
+   hist[0] = 0;
+   for(b=localmax+1;b<nbins;b++) hist[b] = 0;
+
+   if(((binstart = (int *) calloc(size+1, sizeof(int))) == NULL) ||
+      ((bincount = (int *) calloc(size, sizeof(int))) == NULL) ||
+      ((binsum = (int *) calloc(size, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the bin ranges.\n");
+      exit(1);
+   }
+   make_partition(nbins, size, binstart);
+   for(p=0;p<size;p++) bincount[p] = binstart[p+1] - binstart[p];
+   b0 = binstart[rank];
+   b1 = binstart[rank+1];
+   if((mybins = (int *) calloc((b1 > b0) ? b1-b0 : 1, sizeof(int))) == NULL){
+      fprintf(stderr, "Error allocating the histogram bins.\n");
+      exit(1);
+   }
+
+   /* cada proceso recibe la suma global de su rango de bins */
+   coll_reduce_scatter(hist, mybins, bincount, MPI_INT, MPI_SUM, coll);
+   for(b=b0,count=0;b<b1;b++) count += mybins[b-b0];
+   MPI_Allgather(&count, 1, MPI_INT, binsum, 1, MPI_INT, canny_comm);
+   for(p=0,numedges=0,count=0;p<size;p++){
+      if(p == rank) count = numedges;
+      numedges += binsum[p];
+   }
+
+   /****************************************************************************
+   * The serial code walks the histogram from 1 until the count reaches
+   * highcount, but never past maximum_mag-1. The process whose range holds
+   * the first bin that reaches highcount proposes it.
+   ****************************************************************************/
+   if((firsts = (int *) calloc(2*n, sizeof(int))) == NULL){
+      fprintf(stderr, "Error allocating the thresholds.\n");
+      exit(1);
+   }
+   start = count;
+   for(i=0;i<n;i++){
+      highcount = (int)(numedges * thigh[i] + 0.5);
+      first = nbins;
+      for(b=(b0 > 1) ? b0 : 1,count=start;b<b1;b++){
+         count += mybins[b-b0];
+         if(count >= highcount){
+            first = b;
+            break;
+         }
+      }
+      firsts[i] = first;
+   }
+   MPI_Allreduce(firsts, firsts+n, n, MPI_INT, MPI_MIN, canny_comm);
+
+   cap = (maximum_mag-1 > 1) ? maximum_mag-1 : 1;
+   for(i=0;i<n;i++){
+      high[i] = (firsts[n+i] < cap) ? firsts[n+i] : cap;
+      low[i] = (int)(high[i] * tlow[i] + 0.5);
+   }
+
+   free(binstart);
+   free(bincount);
+   free(binsum);
+   free(mybins);
+   free(firsts);
+}
+//<------------------------- end threshold.c ------------------------->
+
+//<------------------------- begin arena.c ------------------------->
+/*******************************************************************************
+* FILE: arena.c
+* Reuse of the large working buffers of each process. Every stage takes its
+* buffers from the arena and gives them back when it is done, and the arena
+* keeps them instead of returning them to the system: the next stage, or the
+* next image with the same dimensions, gets a buffer already mapped, so after
+* the first image a run allocates nothing and suffers no page faults. The
+* buffers are aligned to a cache line, and the large ones to 2 MB and marked
+* for transparent huge pages. Nothing is zeroed unless the caller asks for it.
+* Only the main thread allocates from the arena.
+*******************************************************************************/
+
+arena_block *arena_blocks = NULL;
+int arena_nblocks = 0, arena_max = 0;
+int arena_rows = -1, arena_cols = -1, arena_nparts = -1;   /* geometria */
+long arena_misses = 0;             /* buffers pedidos al sistema */
+
+/*******************************************************************************
+* FUNCTION: arena_alloc
+* PURPOSE: Return a buffer of at least bytes bytes, zeroed if zero is set:
+* the smallest free buffer of the arena that is large enough and not more
+* than twice as large, or a new one. The free buffers of the same range that
+* are too small are released, so that the arena does not grow when the sizes
+* creep up.
+*******************************************************************************/
+void *arena_alloc(size_t bytes, int zero, char *name)
+{
+   int i, best = -1;
+   size_t cap, align;
+   void *data;
+
+   if(bytes == 0) bytes = 1;
+   for(i=0;i<arena_nblocks;i++){
+      if(arena_blocks[i].used || (arena_blocks[i].cap < bytes) ||
+         (arena_blocks[i].cap / 2 > bytes)) continue;
+      if((best < 0) || (arena_blocks[i].cap < arena_blocks[best].cap)) best = i;
+   }
+   if(best < 0){
+      for(i=0;i<arena_nblocks;i++){
+         if(arena_blocks[i].used || (arena_blocks[i].cap >= bytes) ||
+            (arena_blocks[i].cap <= bytes / 2)) continue;
+         free(arena_blocks[i].data);
+         arena_blocks[i--] = arena_blocks[--arena_nblocks];
+      }
+      if(arena_nblocks == arena_max){
+         arena_max = (arena_max > 0) ? 2*arena_max : 32;
+         if((arena_blocks = (arena_block *) realloc(arena_blocks,
+            arena_max * sizeof(arena_block))) == NULL){
+            fprintf(stderr, "Error allocating the arena.\n");
+            exit(1);
+         }
+      }
+      align = (bytes >= ARENA_HUGE) ? ARENA_HUGE : ARENA_ALIGN;
+      cap = (bytes + align-1) / align * align;
+      if(posix_memalign(&data, align, cap) != 0){
+         fprintf(stderr, "Error allocating the %s buffer.\n", name);
+         exit(1);
+      }
+#ifdef MADV_HUGEPAGE
+      if(cap >= ARENA_HUGE) madvise(data, cap, MADV_HUGEPAGE);
+#endif
+      best = arena_nblocks++;
+      arena_blocks[best].data = data;
+      arena_blocks[best].cap = cap;
+      arena_misses++;
+   }
+   arena_blocks[best].used = 1;
+   if(zero) memset(arena_blocks[best].data, 0, bytes);
+   return(arena_blocks[best].data);
+}
+
+/*******************************************************************************
+* PROCEDURE: arena_free
+* PURPOSE: Give a buffer of arena_alloc back to the arena.
+*******************************************************************************/
+void arena_free(void *data)
+{
+   int i;
+
+   if(data == NULL) return;
+   for(i=0;i<arena_nblocks;i++){
+      if(arena_blocks[i].data == data){
+         arena_blocks[i].used = 0;
+         return;
+      }
+   }
+   fprintf(stderr, "Error freeing a buffer that is not in the arena.\n");
+   exit(1);
+}
+
+/*******************************************************************************
+* PROCEDURE: arena_geometry
+* PURPOSE: Announce the dimensions of the image about to be processed. When
+* they, or the number of processes, change, the free buffers no longer fit
+* and are released.
+*******************************************************************************/
+void arena_geometry(int rows, int cols)
+{
+   if((rows == arena_rows) && (cols == arena_cols) && (size == arena_nparts))
+      return;
+   arena_release();
+   arena_rows = rows;
+   arena_cols = cols;
+   arena_nparts = size;
+}
+
+/*******************************************************************************
+* PROCEDURE: arena_release
+* PURPOSE: Return the free buffers of the arena to the system.
+*******************************************************************************/
+void arena_release(void)
+{
+   int i;
+
+   for(i=0;i<arena_nblocks;i++){
+      if(arena_blocks[i].used) continue;
+      free(arena_blocks[i].data);
+      arena_blocks[i--] = arena_blocks[--arena_nblocks];
+   }
+}
+//<------------------------- end arena.c ------------------------->
+
+//<------------------------- begin shared.c ------------------------->
+/*******************************************************************************
+* FILE: shared.c
+* One copy per node of the full images of the replicated decomposition
+* (-shared). Without it every process keeps its own copy of the image, the
+* smoothed image, the derivatives, the magnitude and the nms map, so a node
+* with 64 processes holds 64 copies of each. With node_shared those images
+* are windows of MPI_Win_allocate_shared owned by the node leader (its first
+* process) and mapped by the others: each process writes its strip straight
+* into the copy of the node and only the leaders exchange the strips of their
+* nodes with the other nodes. node_setup renumbers canny_comm node by node, so
+* the strips of a node are contiguous rows. The buffers that only hold a
+* strip, such as tempim, stay in the arena of each process.
+*******************************************************************************/
+
+shared_frame *shared_frames = NULL;
+int shared_nframes = 0, shared_max = 0;
+
+/*******************************************************************************
+* PROCEDURE: node_setup
+* PURPOSE: Collective in canny_comm. Build the communicator of the node, the
+* one of the node leaders, and replace canny_comm by one where the processes
+* of each node are consecutive and rank 0 is the same process. node_free
+* undoes it. The nodes are also those of the collectives of coll.c.
+*******************************************************************************/
+void node_setup(void)
+{
+   int crank = rank, q, *nodeof;
+
+   MPI_Comm_split_type(canny_comm, MPI_COMM_TYPE_SHARED, crank, MPI_INFO_NULL,
+      &node_comm);
+   MPI_Comm_rank(node_comm, &node_rank);
+   MPI_Comm_size(node_comm, &node_size);
+   /* los nodos se numeran en el orden de sus lideres */
+   MPI_Comm_split(canny_comm, (node_rank == 0) ? 0 : MPI_UNDEFINED, crank,
+      &leader_comm);
+   node_id = 0;
+   if(node_rank == 0){
+      MPI_Comm_rank(leader_comm, &node_id);
+      MPI_Comm_size(leader_comm, &nnodes);
+   }
+   MPI_Bcast(&node_id, 1, MPI_INT, 0, node_comm);
+   MPI_Bcast(&nnodes, 1, MPI_INT, 0, node_comm);
+   /* dentro de un nodo queda el orden de canny_comm, que es el de node_comm,
+      asi el rank 0 sigue siendo el mismo */
+   node_parent = canny_comm;
+   MPI_Comm_split(node_parent, 0, node_id, &canny_comm);
+   MPI_Comm_rank(canny_comm, &rank);
+
+   if(((nodeof = (int *) calloc(size, sizeof(int))) == NULL) ||
+      ((node_first = (int *) calloc(nnodes+1, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the nodes.\n");
+      exit(1);
+   }
+   MPI_Allgather(&node_id, 1, MPI_INT, nodeof, 1, MPI_INT, canny_comm);
+   for(q=size-1;q>=0;q--) node_first[nodeof[q]] = q;
+   node_first[nnodes] = size;
+   free(nodeof);
+}
+
+/*******************************************************************************
+* PROCEDURE: node_free
+* PURPOSE: Collective in canny_comm. Free the communicators of node_setup and
+* give canny_comm back.
+*******************************************************************************/
+void node_free(void)
+{
+   MPI_Comm_free(&node_comm);
+   if(leader_comm != MPI_COMM_NULL) MPI_Comm_free(&leader_comm);
+   MPI_Comm_free(&canny_comm);
+   canny_comm = node_parent;
+   node_parent = MPI_COMM_NULL;
+   MPI_Comm_rank(canny_comm, &rank);
+   free(node_first);
+   node_first = NULL;
+   node_rank = node_id = 0;
+   node_size = nnodes = 1;
+}
+
+/*******************************************************************************
+* FUNCTION: frame_alloc
+* PURPOSE: Return a buffer of bytes bytes for a full image of the replicated
+* decomposition. With node_shared it is collective in node_comm and the
+* buffer is the copy of the node; otherwise it comes from the arena. The
+* buffer is not zeroed.
+*******************************************************************************/
+void *frame_alloc(size_t bytes, char *name)
+{
+   MPI_Aint segsize;
+   int disp;
+   void *data;
+   MPI_Win win;
+
+   if(!node_shared) return(arena_alloc(bytes, 0, name));
+   if(shared_nframes == shared_max){
+      shared_max = (shared_max > 0) ? 2*shared_max : 8;
+      if((shared_frames = (shared_frame *) realloc(shared_frames,
+         shared_max * sizeof(shared_frame))) == NULL){
+         fprintf(stderr, "Error allocating the shared images.\n");
+         exit(1);
+      }
+   }
+   /* solo el lider reserva la memoria, los demas la mapean */
+   if(MPI_Win_allocate_shared((node_rank == 0) ? (MPI_Aint)bytes : 0, 1,
+      MPI_INFO_NULL, node_comm, &data, &win) != MPI_SUCCESS){
+      fprintf(stderr, "Error allocating the shared %s buffer.\n", name);
+      exit(1);
+   }
+   MPI_Win_shared_query(win, 0, &segsize, &disp, &data);
+   /* una sola epoca pasiva por ventana, los accesos se ordenan con
+      MPI_Win_sync (node_sync) */
+   MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+   shared_frames[shared_nframes].data = data;
+   shared_frames[shared_nframes].win = win;
+   shared_nframes++;
+   return(data);
+}
+
+/*******************************************************************************
+* PROCEDURE: frame_free
+* PURPOSE: Give back a buffer of frame_alloc. With node_shared it is
+* collective in node_comm.
+*******************************************************************************/
+void frame_free(void *data)
+{
+   int i;
+
+   if(!node_shared){
+      arena_free(data);
+      return;
+   }
+   if(data == NULL) return;
+   for(i=0;i<shared_nframes;i++){
+      if(shared_frames[i].data == data){
+         MPI_Win_unlock_all(shared_frames[i].win);
+         MPI_Win_free(&shared_frames[i].win);
+         shared_frames[i] = shared_frames[--shared_nframes];
+         return;
+      }
+   }
+   fprintf(stderr, "Error freeing an image that is not shared.\n");
+   exit(1);
+}
+
+/*******************************************************************************
+* FUNCTION: frame_window
+* PURPOSE: The window of a shared image given by frame_alloc.
+*******************************************************************************/
+MPI_Win frame_window(void *data)
+{
+   int i;
+
+   for(i=0;i<shared_nframes;i++)
+      if(shared_frames[i].data == data) return(shared_frames[i].win);
+   fprintf(stderr, "Error looking for an image that is not shared.\n");
+   exit(1);
+}
+
+/*******************************************************************************
+* PROCEDURE: node_sync
+* PURPOSE: Collective in node_comm. Make the writes of every process of the
+* node to the window visible to all of them.
+*******************************************************************************/
+void node_sync(MPI_Win win)
+{
+   MPI_Win_sync(win);
+   MPI_Barrier(node_comm);
+   MPI_Win_sync(win);
+}
+
+/*******************************************************************************
+* PROCEDURE: node_allgather
+* PURPOSE: Collective in canny_comm. Every process computed its strip of rows
+* of the full image p (rows of cols elements of type); when this returns all
+* the processes have the whole image. The exchange goes through the node
+* leaders (see coll_allgatherv); with node_shared p is the copy of the node
+* and only the leaders move data.
+*******************************************************************************/
+void node_allgather(plane *p, MPI_Datatype type, int *rowstart, int cols)
+{
+   int *counts, *displs, q;
+
+   if(((counts = (int *) calloc(size, sizeof(int))) == NULL) ||
+      ((displs = (int *) calloc(size, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the gather counts.\n");
+      exit(1);
+   }
+   for(q=0;q<size;q++){
+      counts[q] = (rowstart[q+1] - rowstart[q]) * cols;
+      displs[q] = rowstart[q] * cols;
+   }
+   phase_begin(PHASE_ALLGATHER);
+   coll_allgatherv(p->data, counts, displs, type, COLL_NODE,
+      node_shared ? frame_window(p->data) : MPI_WIN_NULL);
+   phase_end(PHASE_ALLGATHER);
+   free(counts);
+   free(displs);
+}
+//<------------------------- end shared.c ------------------------->
+
+//<------------------------- begin coll.c ------------------------->
+/*******************************************************************************
+* FILE: coll.c
+* The collectives that move image data between the stages, flat or in two
+* levels (-coll). Flat, they run in canny_comm as a single MPI collective.
+* With COLL_NODE they go through the node leaders of node_setup: the
+* processes of each node first gather (or reduce) their data in the leader,
+* the leaders alone exchange the blocks of whole nodes, and each leader then
+* hands the result to the processes of its node. A full image then crosses
+* the links between nodes once per node instead of once per process.
+* The blocks of the processes must lie in rank order, one after the other,
+* so the block of a node is contiguous too; node_setup numbers canny_comm
+* node by node for that.
+* coll_bytes counts the bytes this process sends to processes of its own
+* node and of other nodes, taking every piece of data as sent straight from
+* the process that has it to each one that needs it (what the MPI library
+* really sends depends on its algorithms). The sums over the processes are
+* in the -metrics report and in every case of -bench, where -coll both runs
+* each case with the two kinds of collectives.
+*******************************************************************************/
+
+char *coll_name[2] = {"flat", "node"};
+long coll_bytes[2] = {0, 0};       /* COLL_INTRA y COLL_INTER */
+
+/*******************************************************************************
+* PROCEDURE: coll_flat_bytes
+* PURPOSE: Count bytes that this process sends to every other process of
+* canny_comm, as a flat allgather does.
+*******************************************************************************/
+void coll_flat_bytes(long bytes)
+{
+   coll_bytes[COLL_INTRA] += bytes * (node_size-1);
+   coll_bytes[COLL_INTER] += bytes * (size-node_size);
+}
+
+/*******************************************************************************
+* PROCEDURE: coll_allgatherv
+* PURPOSE: Collective in canny_comm. In place allgatherv: the counts[rank]
+* elements of type of this process are at displs[rank] in buf, and when this
+* returns buf holds those of every process. With mode COLL_NODE it runs in
+* two levels; win, when it is not MPI_WIN_NULL, is the shared window of buf
+* (see shared.c) and the node needs no gather nor broadcast.
+*******************************************************************************/
+void coll_allgatherv(void *buf, int *counts, int *displs, MPI_Datatype type,
+        int mode, MPI_Win win)
+{
+   int f, n, i, lo, hi, elsize, *lcounts, *ldispls;
+   char *base = (char *) buf;
+
+   MPI_Type_size(type, &elsize);
+   if(mode == COLL_FLAT){
+      coll_flat_bytes((long)counts[rank] * elsize);
+      MPI_Allgatherv(MPI_IN_PLACE, 0, type, buf, counts, displs, type,
+         canny_comm);
+      return;
+   }
+   f = node_first[node_id];
+   n = node_first[node_id+1] - f;
+   if(((lcounts = (int *) calloc(size, sizeof(int))) == NULL) ||
+      ((ldispls = (int *) calloc(size, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the gather counts.\n");
+      exit(1);
+   }
+
+   /* los bloques del nodo se juntan en el lider */
+   if(win != MPI_WIN_NULL) node_sync(win);
+   else if(n > 1){
+      for(i=0;i<n;i++){
+         lcounts[i] = counts[f+i];
+         ldispls[i] = displs[f+i];
+      }
+      if(node_rank == 0)
+         MPI_Gatherv(MPI_IN_PLACE, 0, type, buf, lcounts, ldispls, type, 0,
+            node_comm);
+      else{
+         coll_bytes[COLL_INTRA] += (long)counts[rank] * elsize;
+         MPI_Gatherv(base + (long)displs[rank] * elsize, counts[rank], type,
+            NULL, NULL, NULL, type, 0, node_comm);
+      }
+   }
+
+   /* los lideres intercambian los bloques de sus nodos */
+   if((leader_comm != MPI_COMM_NULL) && (nnodes > 1)){
+      for(i=0;i<nnodes;i++){
+         lo = displs[node_first[i]];
+         hi = displs[node_first[i+1]-1] + counts[node_first[i+1]-1];
+         lcounts[i] = hi - lo;
+         ldispls[i] = lo;
+      }
+      coll_bytes[COLL_INTER] += (long)lcounts[node_id] * elsize * (nnodes-1);
+      MPI_Allgatherv(MPI_IN_PLACE, 0, type, buf, lcounts, ldispls, type,
+         leader_comm);
+   }
+
+   /* cada lider reparte el resultado en su nodo */
+   if(win != MPI_WIN_NULL) node_sync(win);
+   else if(n > 1){
+      lo = displs[0];
+      hi = displs[size-1] + counts[size-1];
+      if(node_rank == 0)
+         coll_bytes[COLL_INTRA] += (long)(hi - lo) * elsize * (n-1);
+      MPI_Bcast(base + (long)lo * elsize, hi - lo, type, 0, node_comm);
+   }
+   free(lcounts);
+   free(ldispls);
+}
+
+/*******************************************************************************
+* PROCEDURE: coll_gatherv
+* PURPOSE: Collective in canny_comm. Gather the n elements of type of send of
+* every process in full at rank 0, at displs[q] for process q (counts[q] = n
+* of process q). With mode COLL_NODE each leader first gathers the block of
+* its node and the leaders send the blocks to rank 0, the leader of node 0.
+*******************************************************************************/
+void coll_gatherv(void *send, int n, void *full, int *counts, int *displs,
+        MPI_Datatype type, int mode)
+{
+   int f, m, i, lo, total, elsize, *lcounts, *ldispls;
+   char *block = NULL;
+
+   MPI_Type_size(type, &elsize);
+   if(mode == COLL_FLAT){
+      if(rank != 0)
+         coll_bytes[(node_id == 0) ? COLL_INTRA : COLL_INTER] +=
+            (long)n * elsize;
+      MPI_Gatherv(send, n, type, full, counts, displs, type, 0, canny_comm);
+      return;
+   }
+   f = node_first[node_id];
+   m = node_first[node_id+1] - f;
+   lo = displs[f];
+   total = displs[f+m-1] + counts[f+m-1] - lo;
+   if(((lcounts = (int *) calloc(size, sizeof(int))) == NULL) ||
+      ((ldispls = (int *) calloc(size, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the gather counts.\n");
+      exit(1);
+   }
+
+   /* el lider junta el bloque de su nodo, el del nodo 0 directamente en full */
+   if(node_rank == 0){
+      if(rank == 0) block = (char *) full + (long)lo * elsize;
+      else if((block = (char *) malloc((size_t)(total > 0 ? total : 1) *
+         elsize)) == NULL){
+         fprintf(stderr, "Error allocating the node block.\n");
+         exit(1);
+      }
+      for(i=0;i<m;i++){
+         lcounts[i] = counts[f+i];
+         ldispls[i] = displs[f+i] - lo;
+      }
+      MPI_Gatherv(send, n, type, block, lcounts, ldispls, type, 0, node_comm);
+   }
+   else{
+      coll_bytes[COLL_INTRA] += (long)n * elsize;
+      MPI_Gatherv(send, n, type, NULL, NULL, NULL, type, 0, node_comm);
+   }
+
+   /* los lideres mandan los bloques de sus nodos al rank 0 */
+   if((leader_comm != MPI_COMM_NULL) && (nnodes > 1)){
+      for(i=0;i<nnodes;i++){
+         lcounts[i] = displs[node_first[i+1]-1] + counts[node_first[i+1]-1] -
+            displs[node_first[i]];
+         ldispls[i] = displs[node_first[i]];
+      }
+      if(rank == 0)
+         MPI_Gatherv(MPI_IN_PLACE, 0, type, full, lcounts, ldispls, type, 0,
+            leader_comm);
+      else{
+         coll_bytes[COLL_INTER] += (long)total * elsize;
+         MPI_Gatherv(block, total, type, NULL, NULL, NULL, type, 0,
+            leader_comm);
+      }
+   }
+   if((node_rank == 0) && (rank != 0)) free(block);
+   free(lcounts);
+   free(ldispls);
+}
+
+/*******************************************************************************
+* PROCEDURE: coll_reduce_scatter
+* PURPOSE: Collective in canny_comm. Reduce with op the arrays send of all
+* the processes, of as many elements of type as the sum of counts, and leave
+* in recv the counts[rank] elements of the result that follow those of the
+* processes before this one, as MPI_Reduce_scatter. With mode COLL_NODE each
+* node first reduces its arrays in the leader, the leaders reduce and scatter
+* the blocks of their nodes and each leader scatters its block in the node.
+*******************************************************************************/
+void coll_reduce_scatter(void *send, void *recv, int *counts,
+        MPI_Datatype type, MPI_Op op, int mode)
+{
+   int f, m, i, q, total, mine, elsize, *lcounts, *ldispls;
+   char *nodesum = NULL, *nodebins = NULL;
+
+   MPI_Type_size(type, &elsize);
+   for(q=0,total=0;q<size;q++) total += counts[q];
+   f = node_first[node_id];
+   m = node_first[node_id+1] - f;
+   for(i=0,mine=0;i<m;i++) mine += counts[f+i];
+   if(mode == COLL_FLAT){
+      coll_bytes[COLL_INTRA] += (long)(mine - counts[rank]) * elsize;
+      coll_bytes[COLL_INTER] += (long)(total - mine) * elsize;
+      MPI_Reduce_scatter(send, recv, counts, type, op, canny_comm);
+      return;
+   }
+   if(((lcounts = (int *) calloc(size+1, sizeof(int))) == NULL) ||
+      ((ldispls = (int *) calloc(size+1, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the scatter counts.\n");
+      exit(1);
+   }
+
+   /* la suma del nodo queda en el lider */
+   if(node_rank == 0){
+      if(((nodesum = (char *) malloc((size_t)(total > 0 ? total : 1) *
+         elsize)) == NULL) ||
+         ((nodebins = (char *) malloc((size_t)(mine > 0 ? mine : 1) *
+         elsize)) == NULL)){
+         fprintf(stderr, "Error allocating the node reduction.\n");
+         exit(1);
+      }
+      MPI_Reduce(send, nodesum, total, type, op, 0, node_comm);
+   }
+   else{
+      coll_bytes[COLL_INTRA] += (long)total * elsize;
+      MPI_Reduce(send, NULL, total, type, op, 0, node_comm);
+   }
+
+   /* los lideres se reparten los bloques de sus nodos */
+   if(node_rank == 0){
+      if(nnodes > 1){
+         for(i=0;i<nnodes;i++)
+            for(q=node_first[i],lcounts[i]=0;q<node_first[i+1];q++)
+               lcounts[i] += counts[q];
+         coll_bytes[COLL_INTER] += (long)(total - mine) * elsize;
+         MPI_Reduce_scatter(nodesum, nodebins, lcounts, type, op,
+            leader_comm);
+      }
+      else memcpy(nodebins, nodesum, (size_t)mine * elsize);
+      coll_bytes[COLL_INTRA] += (long)(mine - counts[rank]) * elsize;
+   }
+
+   /* y cada lider el suyo entre los procesos del nodo */
+   for(i=0;i<m;i++){
+      lcounts[i] = counts[f+i];
+      ldispls[i+1] = ldispls[i] + lcounts[i];
+   }
+   MPI_Scatterv(nodebins, lcounts, ldispls, type, recv, counts[rank], type, 0,
+      node_comm);
+   free(nodesum);
+   free(nodebins);
+   free(lcounts);
+   free(ldispls);
+}
+//<------------------------- end coll.c ------------------------->
+
+//<------------------------- begin halo.c ------------------------->
+/*******************************************************************************
+* FILE: halo.c
+* Support for the row-strip decomposition of the canny pipeline (canny_halo).
+* Each process owns the rows [rowstart[rank], rowstart[rank+1]) of every
+* intermediate image and keeps only a halo of the rows of its neighbours, so
+* the traffic of each stage is proportional to the halo and not to the size
+* of the image. The kernels work on planes and compute any rectangular region
+* given in image coordinates. The halos are exchanged while the interior of
+* the strip is computed (overlap_stage), and the replicated stages start the
+* allgather of each piece of their strip while they compute the next one
+* (pipe_allgather).
+*******************************************************************************/
+
+/*******************************************************************************
+* PROCEDURE: make_partition
+* PURPOSE: Split rows in nparts strips whose sizes differ at most in one row.
+* Strip p is [rowstart[p], rowstart[p+1]).
+*******************************************************************************/
+void make_partition(int rows, int nparts, int *rowstart)
+{
+   int p;
+
+   for(p=0;p<=nparts;p++) rowstart[p] = (int)((long)p * rows / nparts);
+}
+
+/*******************************************************************************
+* PROCEDURE: weighted_partition
+* PURPOSE: Split rows in nparts strips of about the same total weight, given
+* the weight of every row. A row goes to the strip where its middle falls.
+* Without weights the strips are those of make_partition.
+*******************************************************************************/
+void weighted_partition(int rows, int nparts, double *weight, int *rowstart)
+{
+   double total = 0.0, sum = 0.0;
+   int p, r;
+
+   for(r=0;r<rows;r++) total += weight[r];
+   if(total <= 0.0){
+      make_partition(rows, nparts, rowstart);
+      return;
+   }
+   rowstart[0] = 0;
+   for(p=1,r=0;p<nparts;p++){
+      while((r < rows) && (sum + weight[r]/2 < total * p / nparts))
+         sum += weight[r++];
+      rowstart[p] = r;
+   }
+   rowstart[nparts] = rows;
+}
+
+/*******************************************************************************
+* PROCEDURE: share_partition
+* PURPOSE: Split rows in nparts strips whose sizes are proportional to share.
+*******************************************************************************/
+void share_partition(int rows, int nparts, double *share, int *rowstart)
+{
+   double total = 0.0, sum = 0.0;
+   int p;
+
+   for(p=0;p<nparts;p++) total += share[p];
+   if(total <= 0.0){
+      make_partition(rows, nparts, rowstart);
+      return;
+   }
+   rowstart[0] = 0;
+   for(p=1;p<nparts;p++){
+      sum += share[p-1];
+      rowstart[p] = (int)(rows * sum / total + 0.5);
+      if(rowstart[p] > rows) rowstart[p] = rows;
+      if(rowstart[p] < rowstart[p-1]) rowstart[p] = rowstart[p-1];
+   }
+   rowstart[nparts] = rows;
+}
+
+/*******************************************************************************
+* PROCEDURE: move_strips
+* PURPOSE: Replace the strip plane p, that holds at least the rows of the
+* partition from, by a plane with the rows of the partition to and no halo.
+* Every process sends the rows it had that go to another one.
+*******************************************************************************/
+void move_strips(plane *p, MPI_Datatype type, int *from, int *to, int rows,
+        int cols, char *name)
+{
+   MPI_Request *reqs;
+   plane q;
+   int o, lo, hi, nreq = 0, elsize;
+   char *src, *dst;
+
+   MPI_Type_size(type, &elsize);
+   strip_plane(&q, to, 0, rows, cols, elsize, name);
+   if((reqs = (MPI_Request *) calloc(2*size, sizeof(MPI_Request))) == NULL){
+      fprintf(stderr, "Error allocating the strip requests.\n");
+      exit(1);
+   }
+   for(o=0;o<size;o++){
+      /* filas propias que pasan a o */
+      lo = (from[rank] > to[o]) ? from[rank] : to[o];
+      hi = (from[rank+1] < to[o+1]) ? from[rank+1] : to[o+1];
+      src = (char *) p->data + (long)(lo - p->r0) * cols * elsize;
+      dst = (char *) q.data + (long)(lo - q.r0) * cols * elsize;
+      if((lo < hi) && (o == rank)) memcpy(dst, src, (size_t)(hi-lo)*cols*elsize);
+      else if(lo < hi)
+         MPI_Isend(src, (hi-lo) * cols, type, o, 0, canny_comm, &reqs[nreq++]);
+
+      /* filas de o que pasan a este rank */
+      lo = (from[o] > to[rank]) ? from[o] : to[rank];
+      hi = (from[o+1] < to[rank+1]) ? from[o+1] : to[rank+1];
+      dst = (char *) q.data + (long)(lo - q.r0) * cols * elsize;
+      if((lo < hi) && (o != rank))
+         MPI_Irecv(dst, (hi-lo) * cols, type, o, 0, canny_comm, &reqs[nreq++]);
+   }
+   MPI_Waitall(nreq, reqs, MPI_STATUSES_IGNORE);
+   free(reqs);
+   plane_free(p);
+   *p = q;
+}
+
+/*******************************************************************************
+* PROCEDURE: balance_edges
+* PURPOSE: Collective in canny_comm. The hysteresis costs a pass over every
+* pixel plus the labelling of the possible edges, which crowd where the image
+* has detail, so equal strips leave some processes idle. Count the possible
+* edges of every row, split the rows again so that every strip has the same
+* cost (BALANCE_EDGE_COST pixels for each possible edge) and move the rows of
+* mag and nms to their new process. rowstart receives the new strips.
+*******************************************************************************/
+void balance_edges(plane *mag, plane *nms, int rows, int cols, int *rowstart)
+{
+   int *count, *counts, *displs, *newstart, r, q, words = BITS_WORDS(cols);
+   double *weight;
+
+   phase_begin(PHASE_BALANCE);
+   if(((count = (int *) calloc(rows, sizeof(int))) == NULL) ||
+      ((weight = (double *) calloc(rows, sizeof(double))) == NULL) ||
+      ((counts = (int *) calloc(size, sizeof(int))) == NULL) ||
+      ((displs = (int *) calloc(size, sizeof(int))) == NULL) ||
+      ((newstart = (int *) calloc(size+1, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the row costs.\n");
+      exit(1);
+   }
+   for(r=rowstart[rank];r<rowstart[rank+1];r++)
+      count[r] = bits_count(PLANE_PTR(nms, bitword, r, 0), words);
+   for(q=0;q<size;q++){
+      counts[q] = rowstart[q+1] - rowstart[q];
+      displs[q] = rowstart[q];
+   }
+   MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_INT, count, counts, displs, MPI_INT,
+      canny_comm);
+   for(r=0;r<rows;r++) weight[r] = cols + BALANCE_EDGE_COST * count[r];
+   weighted_partition(rows, size, weight, newstart);
+
+   move_strips(mag, MPI_SHORT, rowstart, newstart, rows, cols, "magnitude");
+   move_strips(nms, MPI_BITWORD, rowstart, newstart, rows, words, "nms");
+   for(q=0;q<=size;q++) rowstart[q] = newstart[q];
+   free(count);
+   free(weight);
+   free(counts);
+   free(displs);
+   free(newstart);
+   phase_end(PHASE_BALANCE);
+}
+
+/*******************************************************************************
+* PROCEDURE: balance_time
+* PURPOSE: Collective in canny_comm. Record the speed, in pixels per second of
+* computation, of every process on the image just processed with the strips
+* rowstart, t being the computing time of this one. The next image is split
+* in proportion (see canny_file), which also evens out processes of unequal
+* speed.
+*******************************************************************************/
+void balance_time(int *rowstart, int cols, double t)
+{
+   double speed;
+   int q;
+
+   if(balance_nparts != size){
+      free(balance_speed);
+      if((balance_speed = (double *) calloc(size, sizeof(double))) == NULL){
+         fprintf(stderr, "Error allocating the speeds of the processes.\n");
+         exit(1);
+      }
+   }
+   phase_begin(PHASE_BALANCE);
+   speed = (t > 0.0) ? (double)(rowstart[rank+1] - rowstart[rank]) * cols / t
+      : 0.0;
+   MPI_Allgather(&speed, 1, MPI_DOUBLE, balance_speed, 1, MPI_DOUBLE,
+      canny_comm);
+   phase_end(PHASE_BALANCE);
+   /* sin una medida de cada rank se vuelve a las franjas iguales */
+   balance_nparts = size;
+   for(q=0;q<size;q++) if(balance_speed[q] <= 0.0) balance_nparts = 0;
+}
+
+/*******************************************************************************
+* PROCEDURE: plane_alloc
+* PURPOSE: Allocate from the arena a plane that stores rows [r0,r1) and
+* columns [c0,c1) of an image. The pixels are not initialised: the planes
+* whose stage leaves pixels unwritten are cleared with plane_clear.
+*******************************************************************************/
+void plane_alloc(plane *p, int r0, int r1, int c0, int c1, size_t elsize,
+        char *name)
+{
+   long n;
+
+   p->r0 = r0; p->r1 = r1;
+   p->c0 = c0; p->c1 = c1;
+   n = (long)(r1 - r0) * (c1 - c0);
+   p->data = arena_alloc(((n > 0) ? n : 1) * elsize, 0, name);
+}
+
+/*******************************************************************************
+* PROCEDURE: plane_clear
+* PURPOSE: Set the pixels of a plane to 0.
+*******************************************************************************/
+void plane_clear(plane *p, size_t elsize)
+{
+   memset(p->data, 0, (size_t)(p->r1 - p->r0) * (p->c1 - p->c0) * elsize);
+}
+
+/*******************************************************************************
+* PROCEDURE: plane_free
+* PURPOSE: Return the buffer of a plane to the arena.
+*******************************************************************************/
+void plane_free(plane *p)
+{
+   arena_free(p->data);
+   p->data = NULL;
+}
+
+/*******************************************************************************
+* PROCEDURE: plane_move
+* PURPOSE: Point an allocated plane to another region of the image, clipped
+* to the image. The buffer of the plane must be large enough for it.
+*******************************************************************************/
+void plane_move(plane *p, int r0, int r1, int c0, int c1, int rows, int cols)
+{
+   p->r0 = (r0 > 0) ? r0 : 0;
+   p->r1 = (r1 < rows) ? r1 : rows;
+   p->c0 = (c0 > 0) ? c0 : 0;
+   p->c1 = (c1 < cols) ? c1 : cols;
+}
+
+/*******************************************************************************
+* PROCEDURE: strip_plane
+* PURPOSE: Allocate the plane of the strip of this process with halo rows
+* above and below, clipped to the image. An empty strip stores no rows.
+*******************************************************************************/
+void strip_plane(plane *p, int *rowstart, int halo, int rows, int cols,
+        size_t elsize, char *name)
+{
+   int r0 = rowstart[rank], r1 = rowstart[rank+1];
+
+   if(r0 == r1) plane_alloc(p, r0, r1, 0, cols, elsize, name);
+   else plane_alloc(p, (r0-halo > 0) ? r0-halo : 0,
+      (r1+halo < rows) ? r1+halo : rows, 0, cols, elsize, name);
+}
+
+/*******************************************************************************
+* PROCEDURE: exchange_halo
+* PURPOSE: Fill the halo rows of a strip plane with the rows owned by the
+* other processes, and send them the rows of this strip that fall in their
+* halos. Usually only the two neighbouring strips are involved, but a strip
+* thinner than the halo takes rows from several processes.
+*******************************************************************************/
+void exchange_halo(plane *p, MPI_Datatype type, int halo, int *rowstart)
+{
+   MPI_Request *reqs;
+   int nreq;
+
+   if((reqs = (MPI_Request *) calloc(2*size, sizeof(MPI_Request))) == NULL){
+      fprintf(stderr, "Error allocating the halo requests.\n");
+      exit(1);
+   }
+   nreq = exchange_halo_start(p, type, halo, rowstart, reqs);
+   MPI_Waitall(nreq, reqs, MPI_STATUSES_IGNORE);
+   free(reqs);
+}
+
+/*******************************************************************************
+* FUNCTION: exchange_halo_start
+* PURPOSE: Start the messages of exchange_halo in reqs, room for 2*size, and
+* return how many there are. Only the first and last halo rows of the strip
+* are sent, so the others may be written until the messages are complete.
+*******************************************************************************/
+int exchange_halo_start(plane *p, MPI_Datatype type, int halo, int *rowstart,
+        MPI_Request *reqs)
+{
+   int q, nreq, lo, hi, elsize, stride;
+   int r0 = rowstart[rank], r1 = rowstart[rank+1];
+   char *base = (char *) p->data;
+
+   MPI_Type_size(type, &elsize);
+   stride = p->c1 - p->c0;
+   nreq = 0;
+   for(q=0;q<size;q++){
+      if((q == rank) || (rowstart[q] == rowstart[q+1])) continue;
+
+      /* filas de q que caen en el halo propio */
+      lo = (p->r0 > rowstart[q]) ? p->r0 : rowstart[q];
+      hi = (p->r1 < rowstart[q+1]) ? p->r1 : rowstart[q+1];
+      if(lo < hi)
+         MPI_Irecv(base + (long)(lo - p->r0) * stride * elsize,
+            (hi - lo) * stride, type, q, 0, canny_comm, &reqs[nreq++]);
+
+      /* filas propias que caen en el halo de q */
+      lo = (rowstart[q] - halo > r0) ? rowstart[q] - halo : r0;
+      hi = (rowstart[q+1] + halo < r1) ? rowstart[q+1] + halo : r1;
+      if(lo < hi)
+         MPI_Isend(base + (long)(lo - p->r0) * stride * elsize,
+            (hi - lo) * stride, type, q, 0, canny_comm, &reqs[nreq++]);
+   }
+   return(nreq);
+}
+
+/*******************************************************************************
+* PROCEDURE: overlap_stage
+* PURPOSE: Run stage op on the rows of the strip, as run_stage, and fill the
+* halo of the output plane, as exchange_halo, while the interior rows are
+* computed. The halo rows the neighbours need are computed first and their
+* messages started; the interior follows in PIPE_CHUNKS pieces, testing the
+* messages in between so that MPI keeps moving them. Only the wait for what
+* is left is the halo phase.
+*******************************************************************************/
+void overlap_stage(int op, plane *in, plane *in2, plane *in3, plane *out,
+        MPI_Datatype type, int halo, int rows, int cols, int *rowstart,
+        blur_kernel *bk)
+{
+   MPI_Request *reqs;
+   int r0 = rowstart[rank], r1 = rowstart[rank+1];
+   int nreq, k, a, b, flag;
+
+   if((reqs = (MPI_Request *) calloc(2*size, sizeof(MPI_Request))) == NULL){
+      fprintf(stderr, "Error allocating the halo requests.\n");
+      exit(1);
+   }
+   if(r1 - r0 <= 2*halo){
+      /* en una franja delgada todas las filas van a los vecinos */
+      run_stage(op, in, in2, in3, out, r0, r1, 0, cols, rows, cols, bk);
+      nreq = exchange_halo_start(out, type, halo, rowstart, reqs);
+   }
+   else{
+      run_stage(op, in, in2, in3, out, r0, r0+halo, 0, cols, rows, cols, bk);
+      run_stage(op, in, in2, in3, out, r1-halo, r1, 0, cols, rows, cols, bk);
+      nreq = exchange_halo_start(out, type, halo, rowstart, reqs);
+      for(k=0;k<PIPE_CHUNKS;k++){
+         a = r0 + halo + (int)((long)k * (r1-r0-2*halo) / PIPE_CHUNKS);
+         b = r0 + halo + (int)((long)(k+1) * (r1-r0-2*halo) / PIPE_CHUNKS);
+         run_stage(op, in, in2, in3, out, a, b, 0, cols, rows, cols, bk);
+         MPI_Testall(nreq, reqs, &flag, MPI_STATUSES_IGNORE);
+      }
+   }
+   phase_begin(PHASE_HALO);
+   MPI_Waitall(nreq, reqs, MPI_STATUSES_IGNORE);
+   phase_end(PHASE_HALO);
+   free(reqs);
+}
+
+/*******************************************************************************
+* PROCEDURE: full_plane
+* PURPOSE: Describe a whole image of rows x cols as a plane.
+*******************************************************************************/
+void full_plane(plane *p, void *data, int rows, int cols)
+{
+   p->data = data;
+   p->r0 = 0; p->r1 = rows;
+   p->c0 = 0; p->c1 = cols;
+}
+
+/*******************************************************************************
+* PROCEDURE: pipe_open
+* PURPOSE: Prepare sp for up to max allgathers of pieces of the strips.
+* The replicated stages compute their strip in PIPE_CHUNKS pieces and start
+* the allgather of each piece as soon as it is done, so the pieces travel
+* while the next ones are computed, instead of a blocking allgather of the
+* whole strips at the end.
+*******************************************************************************/
+void pipe_open(strip_pipe *sp, int max)
+{
+   if(((sp->counts = (int *) calloc((long)max*size, sizeof(int))) == NULL) ||
+      ((sp->displs = (int *) calloc((long)max*size, sizeof(int))) == NULL) ||
+      ((sp->reqs = (MPI_Request *) calloc(max, sizeof(MPI_Request)))
+      == NULL)){
+      fprintf(stderr, "Error allocating the gather counts.\n");
+      exit(1);
+   }
+   sp->nreq = 0;
+   sp->max = max;
+}
+
+/*******************************************************************************
+* PROCEDURE: pipe_rows
+* PURPOSE: Rows [a,b) of piece k of the strip of process q.
+*******************************************************************************/
+void pipe_rows(int *rowstart, int q, int k, int *a, int *b)
+{
+   int n = rowstart[q+1] - rowstart[q];
+
+   *a = rowstart[q] + (int)((long)k * n / PIPE_CHUNKS);
+   *b = rowstart[q] + (int)((long)(k+1) * n / PIPE_CHUNKS);
+}
+
+/*******************************************************************************
+* PROCEDURE: pipe_allgather
+* PURPOSE: Start the allgather of piece k of every strip of the replicated
+* image p, whose piece k of this process is computed, and test those
+* already started so that they keep moving. With node_shared or COLL_NODE
+* the strips go through the node leaders once the last piece is done (see
+* node_allgather).
+*******************************************************************************/
+void pipe_allgather(strip_pipe *sp, plane *p, MPI_Datatype type,
+        int *rowstart, int cols, int k)
+{
+   int *counts, *displs, q, a, b, flag, elsize;
+
+   if(node_shared || (coll == COLL_NODE)){
+      /* las franjas pasan por los lideres de los nodos, todas juntas despues
+         del ultimo trozo */
+      if(k == PIPE_CHUNKS-1) node_allgather(p, type, rowstart, cols);
+      return;
+   }
+   if(sp->nreq == sp->max){
+      fprintf(stderr, "Too many allgathers in pipe_allgather().\n");
+      exit(1);
+   }
+   phase_begin(PHASE_ALLGATHER);
+   counts = sp->counts + (long)sp->nreq * size;
+   displs = sp->displs + (long)sp->nreq * size;
+   for(q=0;q<size;q++){
+      pipe_rows(rowstart, q, k, &a, &b);
+      counts[q] = (b - a) * cols;
+      displs[q] = a * cols;
+   }
+   MPI_Type_size(type, &elsize);
+   coll_flat_bytes((long)counts[rank] * elsize);
+   MPI_Iallgatherv(MPI_IN_PLACE, 0, type, p->data, counts, displs, type,
+      canny_comm, &sp->reqs[sp->nreq++]);
+   MPI_Testall(sp->nreq, sp->reqs, &flag, MPI_STATUSES_IGNORE);
+   phase_end(PHASE_ALLGATHER);
+}
+
+/*******************************************************************************
+* PROCEDURE: pipe_close
+* PURPOSE: Wait for the allgathers of sp and free it.
+*******************************************************************************/
+void pipe_close(strip_pipe *sp)
+{
+   phase_begin(PHASE_ALLGATHER);
+   MPI_Waitall(sp->nreq, sp->reqs, MPI_STATUSES_IGNORE);
+   phase_end(PHASE_ALLGATHER);
+   free(sp->counts);
+   free(sp->displs);
+   free(sp->reqs);
+}
+
+/*******************************************************************************
+* PROCEDURE: gather_strips
+* PURPOSE: Gather the strips of rows of a plane in the full image of rank 0.
+*******************************************************************************/
+void gather_strips(plane *p, MPI_Datatype type, int *rowstart, int cols,
+        void *full)
+{
+   int *counts, *displs, q, elsize;
+   char *first;
+
+   if(((counts = (int *) calloc(size, sizeof(int))) == NULL) ||
+      ((displs = (int *) calloc(size, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the gather counts.\n");
+      exit(1);
+   }
+   for(q=0;q<size;q++){
+      counts[q] = (rowstart[q+1] - rowstart[q]) * cols;
+      displs[q] = rowstart[q] * cols;
+   }
+   MPI_Type_size(type, &elsize);
+   first = (char *) p->data + (long)(rowstart[rank] - p->r0) * cols * elsize;
+   coll_gatherv(first, counts[rank], full, counts, displs, type, coll);
+   free(counts);
+   free(displs);
+}
+
+/*******************************************************************************
+* PROCEDURE: derivative_x_plane
+* PURPOSE: Compute the x-derivative [-1 0 +1] of rows [r0,r1) and columns
+* [c0,c1). At the left and right borders of the image the derivative is
+* one-sided to avoid losing pixels.
+*******************************************************************************/
+void derivative_x_plane(plane *sm, plane *dx, int r0, int r1, int c0, int c1,
+        int cols)
+{
+   int r, c;
+   short int *src, *dst;
+
+   for(r=r0;r<r1;r++){
+      src = PLANE_PTR(sm, short int, r, c0);
+      dst = PLANE_PTR(dx, short int, r, c0);
+      for(c=c0;c<c1;c++,src++,dst++){
+         if(c == 0) *dst = src[1] - src[0];
+         else if(c == cols-1) *dst = src[0] - src[-1];
+         else *dst = src[1] - src[-1];
+      }
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: derivative_y_plane
+* PURPOSE: Compute the y-derivative [-1 0 +1]' of rows [r0,r1) and columns
+* [c0,c1). At the top and bottom borders of the image the derivative is
+* one-sided to avoid losing pixels.
+*******************************************************************************/
+void derivative_y_plane(plane *sm, plane *dy, int r0, int r1, int c0, int c1,
+        int rows)
+{
+   int r, c, stride;
+   short int *src, *dst;
+
+   stride = sm->c1 - sm->c0;
+   for(r=r0;r<r1;r++){
+      src = PLANE_PTR(sm, short int, r, c0);
+      dst = PLANE_PTR(dy, short int, r, c0);
+      for(c=c0;c<c1;c++,src++,dst++){
+         if(r == 0) *dst = src[stride] - src[0];
+         else if(r == rows-1) *dst = src[0] - src[-stride];
+         else *dst = src[stride] - src[-stride];
+      }
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: magnitude_plane
+* PURPOSE: Compute the magnitude of the gradient of rows [r0,r1) and columns
+* [c0,c1).
+*******************************************************************************/
+void magnitude_plane(plane *dx, plane *dy, plane *mag, int r0, int r1, int c0,
+        int c1)
+{
+   int r, c, sq1, sq2;
+   short int *gx, *gy, *dst;
+
+   for(r=r0;r<r1;r++){
+      gx = PLANE_PTR(dx, short int, r, c0);
+      gy = PLANE_PTR(dy, short int, r, c0);
+      dst = PLANE_PTR(mag, short int, r, c0);
+      for(c=c0;c<c1;c++){
+         sq1 = (int)gx[c-c0] * (int)gx[c-c0];
+         sq2 = (int)gy[c-c0] * (int)gy[c-c0];
+         dst[c-c0] = (short)(0.5 + sqrt((float)sq1 + (float)sq2));
+      }
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: non_max_supp_plane
+* PURPOSE: Apply non-maximal suppression to rows [r0,r1) and columns [c0,c1)
+* of the magnitude of the gradient. The magnitude plane must hold one pixel
+* around the region. As in non_max_supp, only rows 1 to rows-3 and columns 1
+* to cols-3 of the image are examined; the rest of the region is set to 0.
+* result is a bit map (see bitmap.c): the bits of the words shared with other
+* regions are kept, and the last word of a row is filled up with zeros.
+*******************************************************************************/
+void non_max_supp_plane(plane *mag, plane *gradx, plane *grady, plane *result,
+        int r0, int r1, int c0, int c1, int rows, int cols)
+{
+    int r, k, a, b, e, k0 = c0/BITS_WORD, isa = nms_isa();
+    unsigned char run[BITS_WORD];       /* la supresion de una palabra */
+    bitword *res, bits;
+
+    for(r=r0;r<r1;r++){
+        res = PLANE_PTR(result, bitword, r, k0);
+        for(k=k0;k<BITS_WORDS(c1);k++){
+            /* pixeles examinados [a,b) de la palabra y fin e de la region */
+            a = (k*BITS_WORD > c0) ? k*BITS_WORD : c0;
+            e = (c1 == cols) ? (k+1)*BITS_WORD : c1;
+            if(e > (k+1)*BITS_WORD) e = (k+1)*BITS_WORD;
+            b = (e < cols-2) ? e : cols-2;
+            if(a < 1) a = 1;
+            bits = 0;
+            if((r >= 1) && (r < rows-2) && (a < b)){
+                nms_row(PLANE_PTR(mag, short, r, a), mag->c1 - mag->c0,
+                    PLANE_PTR(gradx, short, r, a),
+                    PLANE_PTR(grady, short, r, a), run, b-a, isa);
+                bits = bits_word(run, b-a, POSSIBLE_EDGE, isa) <<
+                    (a - k*BITS_WORD);
+            }
+            res[k-k0] = (res[k-k0] & ~bits_range(k, c0, e)) | bits;
+        }
+    }
+}
+//<------------------------- end halo.c ------------------------->
+
+//<------------------------- begin blur.c ------------------------->
+/*******************************************************************************
+* FILE: blur.c
+* Separable gaussian blur of the planes. The interior pixels, whose whole
+* window is inside the image, are blurred by vector engines without any test
+* per tap, 4 to 32 pixels per instruction; the columns and rows of the
+* borders use the sums of their in-image weights, computed once per image in
+* blur_setup. There are two variants:
+*   float: the x-blurred image is kept in floats. The taps are added in the
+*          same order as the original code and no fused multiply-add is
+*          used, so the result is identical to it.
+*   fixed: the weights are 16 bit integers whose sum is exact, with as
+*          many fraction bits as fit (qxbits, qybits). The pixels are
+*          centered on 128 before weighting, which halves the error of the
+*          weights, and the x-blurred image is kept in 16 bits as Q8 minus
+*          128. BOOSTBLURFACTOR is applied after the y-direction. The
+*          smoothed image differs at most in 1 from the float result.
+* The engine is chosen at run time from the instructions of the processor
+* (SSE2, AVX2 or AVX-512), or with -isa.
+* With -blur iir the kernel is replaced by the third order recursive filter
+* of Young and van Vliet, a causal and an anti-causal pass of 4 multiplies
+* per pixel whatever sigma. To keep the halos and tiles of the kernel blur,
+* the rows and columns are cut in blocks of IIR_BLOCK*warmup pixels, warmup
+* being IIR_WARMUP*sigma: each block starts its passes warmup pixels away
+* (the first pixel repeated before them), so a pixel only depends on its
+* block and its neighbours and the result is the same for any number of
+* processes, threads or tiles. This costs 3.5 steps of the filter per pixel
+* and direction and halos of 9*sigma rows instead of 2.5*sigma. Against the
+* float kernel the smoothed image differs by 0.3-0.7 grey levels on average
+* inside the image for sigma 2-8 (at most about 6 where the contrast
+* changes sharply, and up to 30 at the border, where the kernel renormalises
+* its in-image weights). The filter is about 10% wider than the truncated
+* kernel, so the edges move: at sigma 2, 4 and 8, 91%, 85% and 54% of the
+* edges of the kernel lie within a pixel of an edge of -blur iir on a noisy
+* synthetic image. Against a filter without blocks it differs by 1.5 grey
+* levels at most. On a 2048x2048 image it takes about 30 ms per image
+* for any sigma, the AVX-512 kernel 16 ms at sigma 2 and 49 ms at 16.
+*******************************************************************************/
+
+/* atributos de los motores; en AVX-512 gcc fusionaria mul y add en un FMA */
+#ifdef BLUR_X86
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#if defined(__clang__)
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#else
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw"), \
+   optimize("fp-contract=off")))
+#endif
+#endif
+
+/*******************************************************************************
+* PROCEDURE: blur_setup
+* PURPOSE: Create the gaussian kernel and the tables of the borders for an
+* image of rows x cols, and choose the engine.
+*******************************************************************************/
+void blur_setup(blur_kernel *bk, float sigma, int rows, int cols)
+{
+   int s, k, klo, khi, n, dir, bits, total, sum, best, ws, center;
+   float *norm;
+   double maxw;
+   short *q;
+   char *isaname[] = {"scalar", "SSE2", "AVX2", "AVX-512"};
+
+   bk->rows = rows;
+   bk->cols = cols;
+   bk->boosted = 0;
+   bk->iir = blur_iir && (sigma >= IIR_MINSIGMA);
+   if(blur_iir && !bk->iir && (rank == 0))
+      fprintf(stderr, "The recursive blur needs sigma >= %.1f, using the "
+         "kernel.\n", IIR_MINSIGMA);
+   bk->fixed = blur_fixed;
+
+   bk->isa = blur_best_isa();
+   if((blur_isa != ISA_AUTO) && (blur_isa <= bk->isa)) bk->isa = blur_isa;
+   else if((blur_isa != ISA_AUTO) && (rank == 0))
+      fprintf(stderr, "The processor lacks %s, using %s.\n", isaname[blur_isa],
+         isaname[bk->isa]);
+#if !PRODUCTION
+   if(rank == 0) printf("   Blur engine: %s, %s.\n", bk->iir ? "recursive" :
+      (bk->fixed ? "16 bit fixed point" : "float"), isaname[bk->isa]);
+#endif
+   if(bk->iir){
+      blur_iir_setup(bk, sigma);
+      return;
+   }
+
+   make_gaussian_kernel(sigma, &bk->kernel, &bk->windowsize);
+   ws = bk->windowsize;
+   center = bk->center = ws / 2;
+
+   if(((bk->normx = (float *) calloc(2*center+1, sizeof(float))) == NULL) ||
+      ((bk->normy = (float *) calloc(2*center+1, sizeof(float))) == NULL) ||
+      ((bk->qx = (short *) calloc((2*center+1)*ws, sizeof(short))) == NULL) ||
+      ((bk->qy = (short *) calloc((2*center+1)*ws, sizeof(short))) == NULL)){
+      fprintf(stderr, "Error allocating the blur tables.\n");
+      exit(1);
+   }
+
+   /****************************************************************************
+   * Slot s < center is column (row) s of the image, slot center is the
+   * interior and slot center+1+i is column (row) n-center+i. The sums of the
+   * weights are those of the original code, added in the same order. The
+   * fixed point weights take as many bits as fit in a short.
+   ****************************************************************************/
+   for(dir=0;dir<2;dir++){
+      n = (dir == 0) ? cols : rows;
+      norm = (dir == 0) ? bk->normx : bk->normy;
+      maxw = 0.0;
+      for(s=0;s<=2*center;s++){
+         if(blur_slot_taps(s, n, center, &klo, &khi) == 0) continue;
+         norm[s] = 0.0;
+         for(k=klo;k<=khi;k++) norm[s] += bk->kernel[k];
+         for(k=klo;k<=khi;k++)
+            if(bk->kernel[k] / norm[s] > maxw) maxw = bk->kernel[k] / norm[s];
+      }
+
+      bits = (dir == 0) ? BLUR_QXBITS : BLUR_QYBITS;
+      while(maxw * (1 << bits) > BLUR_QMAX) bits--;
+      if(dir == 0) bk->qxbits = bits;
+      else bk->qybits = bits;
+      total = 1 << bits;
+
+      for(s=0;s<=2*center;s++){
+         if(blur_slot_taps(s, n, center, &klo, &khi) == 0) continue;
+         q = ((dir == 0) ? bk->qx : bk->qy) + s*ws;
+         /* se trunca y lo que falta va a los pesos de mayor resto */
+         sum = 0;
+         for(k=klo;k<=khi;k++){
+            q[k] = (short)floor(bk->kernel[k] / norm[s] * total);
+            sum += q[k];
+         }
+         for(;sum<total;sum++){
+            best = klo;
+            for(k=klo;k<=khi;k++)
+               if(bk->kernel[k] / norm[s] * total - q[k] >
+                  bk->kernel[best] / norm[s] * total - q[best]) best = k;
+            q[best]++;
+         }
+      }
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_free
+* PURPOSE: Free the kernel and the tables of blur_setup.
+*******************************************************************************/
+void blur_free(blur_kernel *bk)
+{
+   free(bk->kernel);
+   free(bk->normx);
+   free(bk->normy);
+   free(bk->qx);
+   free(bk->qy);
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_cascade_setup
+* PURPOSE: As blur_setup, for a blur whose input is a smoothed image (short,
+* scaled by BOOSTBLURFACTOR) instead of the pixels: blur_x_plane divides the
+* input by BOOSTBLURFACTOR. It uses the float kernel or the recursive blur,
+* since the pixels of the smoothed image do not fit the 16 bit engines.
+*******************************************************************************/
+void blur_cascade_setup(blur_kernel *bk, float sigma, int rows, int cols)
+{
+   int fixed = blur_fixed;
+
+   blur_fixed = 0;
+   blur_setup(bk, sigma, rows, cols);
+   blur_fixed = fixed;
+   bk->boosted = 1;
+}
+
+/*******************************************************************************
+* FUNCTION: blur_window
+* PURPOSE: Pixels that the blur of a given sigma reads around each one: the
+* gaussian kernel, or the block and the warm-up of the recursive blur.
+*******************************************************************************/
+int blur_window(float sigma)
+{
+   int w = (int)ceil(IIR_WARMUP * sigma);
+
+   if(blur_iir && (sigma >= IIR_MINSIGMA))
+      return(1 + 2 * ((IIR_BLOCK+1)*w - 1));
+   return(gaussian_window(sigma));
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_iir_setup
+* PURPOSE: Coefficients of the recursive blur of Young and van Vliet for
+* sigma, and its blocks. center is the most pixels a block reads past its
+* own, so the halos and the tiles of the kernel blur serve it unchanged.
+*******************************************************************************/
+void blur_iir_setup(blur_kernel *bk, float sigma)
+{
+   double q, b0, b1, b2, b3;
+
+   if(sigma >= 2.5) q = 0.98711 * sigma - 0.96330;
+   else q = 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+   b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+   b1 = 2.44413*q + 2.85619*q*q + 1.26661*q*q*q;
+   b2 = -(1.4281*q*q + 1.26661*q*q*q);
+   b3 = 0.422205*q*q*q;
+   bk->iirb[0] = (float)(1.0 - (b1 + b2 + b3) / b0);
+   bk->iirb[1] = (float)(b1 / b0);
+   bk->iirb[2] = (float)(b2 / b0);
+   bk->iirb[3] = (float)(b3 / b0);
+
+   bk->warmup = (int)ceil(IIR_WARMUP * sigma);
+   bk->block = IIR_BLOCK * bk->warmup;
+   bk->windowsize = blur_window(sigma);
+   bk->center = bk->windowsize / 2;
+   bk->fixed = 0;
+   bk->kernel = bk->normx = bk->normy = NULL;
+   bk->qx = bk->qy = NULL;
+   if(VERBOSE && rank==0)
+      printf("      The recursive blur runs on blocks of %d pixels with %d "
+         "more on each side.\n", bk->block, bk->warmup);
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_iir_block
+* PURPOSE: Recursive blur of a block of len rows of n floats in buf, which
+* has room for one row more. Each column is a sequence of the filter: the
+* causal pass runs down all the rows and the anti-causal pass up to row
+* from; rows [from,len) receive the blur. Each pass starts as if the first
+* pixel of the sequence repeated itself before it.
+*******************************************************************************/
+void blur_iir_block(blur_kernel *bk, float *buf, int len, int from, int n)
+{
+   float *row, *edge = buf + (long)len * n;
+   int i;
+
+   memcpy(edge, buf, n * sizeof(float));
+   for(i=0,row=buf;i<len;i++,row+=n)
+      blur_iir_row(bk, row, (i >= 1) ? row-n : edge, (i >= 2) ? row-2*n : edge,
+         (i >= 3) ? row-3*n : edge, n);
+   memcpy(edge, buf + (long)(len-1) * n, n * sizeof(float));
+   for(i=len-1,row=buf+(long)i*n;i>=from;i--,row-=n)
+      blur_iir_row(bk, row, (i+1 < len) ? row+n : edge,
+         (i+2 < len) ? row+2*n : edge, (i+3 < len) ? row+3*n : edge, n);
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_iir_row
+* PURPOSE: One step of the filter on n sequences: row becomes
+* B*row + b1/b0*p1 + b2/b0*p2 + b3/b0*p3, the previous outputs being p1 to p3.
+* The engines add in the same order, so the result does not depend on the
+* instruction set.
+*******************************************************************************/
+void blur_iir_row(blur_kernel *bk, float *row, float *p1, float *p2,
+        float *p3, int n)
+{
+   float *k = bk->iirb;
+   int c;
+
+   c = blur_iir_simd(bk->isa, row, p1, p2, p3, k, n);
+   for(;c<n;c++) row[c] = k[0]*row[c] + k[1]*p1[c] + k[2]*p2[c] + k[3]*p3[c];
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_x_iir
+* PURPOSE: Recursive blur of rows [r0,r1) and columns [c0,c1) in the
+* x-direction, for blur_x_plane. The rows go IIR_GROUP at a time: each block
+* of their columns is transposed to a buffer, so the pixels of the group
+* that are in the same column make one row of blur_iir_block.
+*******************************************************************************/
+void blur_x_iir(plane *in, plane *out, int r0, int r1, int c0, int c1,
+        blur_kernel *bk)
+{
+   int g0, ng, g, c, j, s, e, a, b, cols = bk->cols, nb = bk->block,
+       nw = bk->warmup;
+   unsigned char *src;
+   short *ssrc;
+   float *buf, *dst;
+
+   if((buf = (float *) malloc((long)(nb + 2*nw + 1) * IIR_GROUP *
+      sizeof(float))) == NULL){
+      fprintf(stderr, "Error allocating the blur rows.\n");
+      exit(1);
+   }
+   for(g0=r0;g0<r1;g0+=IIR_GROUP){
+      ng = (r1-g0 < IIR_GROUP) ? r1-g0 : IIR_GROUP;
+      for(j=c0/nb;j*nb<c1;j++){
+         s = (j*nb-nw > 0) ? j*nb-nw : 0;
+         e = ((j+1)*nb+nw < cols) ? (j+1)*nb+nw : cols;
+         a = (j*nb > c0) ? j*nb : c0;
+         b = ((j+1)*nb < c1) ? (j+1)*nb : c1;
+         for(g=0;g<ng;g++){
+            if(bk->boosted){
+               ssrc = PLANE_PTR(in, short, g0+g, s);
+               for(c=0;c<e-s;c++)
+                  buf[(long)c*ng+g] = (float)(ssrc[c] / BOOSTBLURFACTOR);
+               continue;
+            }
+            src = PLANE_PTR(in, unsigned char, g0+g, s);
+            for(c=0;c<e-s;c++) buf[(long)c*ng+g] = (float)src[c];
+         }
+         blur_iir_block(bk, buf, e-s, a-s, ng);
+         for(g=0;g<ng;g++){
+            dst = PLANE_PTR(out, float, g0+g, a);
+            for(c=a;c<b;c++) dst[c-a] = buf[(long)(c-s)*ng+g];
+         }
+      }
+   }
+   free(buf);
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_y_iir
+* PURPOSE: Recursive blur of rows [r0,r1) and columns [c0,c1) of the
+* x-blurred image in the y-direction, scaled by BOOSTBLURFACTOR, for
+* blur_y_plane. The rows of each block are copied to a buffer and filtered
+* whole, so the columns are the lanes of the engines.
+*******************************************************************************/
+void blur_y_iir(plane *in, plane *out, int r0, int r1, int c0, int c1,
+        blur_kernel *bk)
+{
+   int r, c, j, s, e, a, b, n = c1 - c0, rows = bk->rows, nb = bk->block,
+       nw = bk->warmup;
+   float *buf, *row;
+   short int *dst;
+
+   if(n <= 0) return;
+   if((buf = (float *) malloc((long)(nb + 2*nw + 1) * n * sizeof(float)))
+      == NULL){
+      fprintf(stderr, "Error allocating the blur rows.\n");
+      exit(1);
+   }
+   for(j=r0/nb;j*nb<r1;j++){
+      s = (j*nb-nw > 0) ? j*nb-nw : 0;
+      e = ((j+1)*nb+nw < rows) ? (j+1)*nb+nw : rows;
+      a = (j*nb > r0) ? j*nb : r0;
+      b = ((j+1)*nb < r1) ? (j+1)*nb : r1;
+      for(r=s;r<e;r++)
+         memcpy(buf + (long)(r-s) * n, PLANE_PTR(in, float, r, c0),
+            n * sizeof(float));
+      blur_iir_block(bk, buf, e-s, a-s, n);
+      for(r=a;r<b;r++){
+         row = buf + (long)(r-s) * n;
+         dst = PLANE_PTR(out, short int, r, c0);
+         for(c=0;c<n;c++) dst[c] = (short int)(row[c]*BOOSTBLURFACTOR + 0.5);
+      }
+   }
+   free(buf);
+}
+
+/*******************************************************************************
+* FUNCTION: blur_slot
+* PURPOSE: Slot of the tables of blur_setup of column (row) pos of n.
+*******************************************************************************/
+int blur_slot(int pos, int n, int center)
+{
+   if(pos < center) return(pos);
+   if(pos >= n-center) return(center+1+pos-(n-center));
+   return(center);
+}
+
+/*******************************************************************************
+* FUNCTION: blur_slot_taps
+* PURPOSE: First and last tap inside the image of slot s. Returns 0 when the
+* image is too small to have a column (row) in that slot.
+*******************************************************************************/
+int blur_slot_taps(int s, int n, int center, int *klo, int *khi)
+{
+   int pos;
+
+   if(s == center){
+      *klo = 0;
+      *khi = 2*center;
+      return(1);
+   }
+   pos = (s < center) ? s : n-center+(s-center-1);
+   if((pos < 0) || (pos >= n) || ((s > center) && (pos < center))) return(0);
+   *klo = (pos < center) ? center-pos : 0;
+   *khi = (pos+center >= n) ? n-1-pos+center : 2*center;
+   return(1);
+}
+
+/*******************************************************************************
+* FUNCTION: blur_best_isa
+* PURPOSE: Widest instruction set of the processor that has an engine.
+*******************************************************************************/
+int blur_best_isa(void)
+{
+#ifdef BLUR_X86
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+      return(ISA_AVX512);
+   if(__builtin_cpu_supports("avx2")) return(ISA_AVX2);
+   if(__builtin_cpu_supports("sse2")) return(ISA_SSE2);
+#endif
+   return(ISA_SCALAR);
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_x_pixels
+* PURPOSE: Blur in the x-direction columns [from,to) of a row, one by one.
+* row holds the row converted by blur_x_plane from column rc0 and dst the
+* x-blurred row from column dc0.
+*******************************************************************************/
+void blur_x_pixels(blur_kernel *bk, void *row, int rc0, void *dst, int dc0,
+        int from, int to)
+{
+   int c, k, klo, khi, acc, ws = bk->windowsize, center = bk->center;
+   float *frow = (float *) row, *norm = bk->normx, dot;
+   short *srow = (short *) row, *w;
+
+   for(c=from;c<to;c++){
+      klo = (c < center) ? center-c : 0;
+      khi = (c+center >= bk->cols) ? bk->cols-1-c+center : ws-1;
+      if(bk->fixed){
+         w = bk->qx + blur_slot(c, bk->cols, center)*ws;
+         acc = 1 << (bk->qxbits-9);
+         for(k=klo;k<=khi;k++) acc += srow[c+k-center-rc0] * w[k];
+         ((short *)dst)[c-dc0] = (short)(acc >> (bk->qxbits-8));
+      }
+      else{
+         dot = 0.0;
+         for(k=klo;k<=khi;k++) dot += frow[c+k-center-rc0] * bk->kernel[k];
+         ((float *)dst)[c-dc0] = dot / norm[blur_slot(c, bk->cols, center)];
+      }
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_x_plane
+* PURPOSE: Blur rows [r0,r1) and columns [c0,c1) in the x-direction. The
+* input plane must hold the columns of the kernel window that are inside the
+* image. The weights of the taps that fall outside are left out of the sum.
+* Each row is first converted to float (or short), so the taps of the
+* engines are plain loads. Columns [cs,ce) have their whole window inside
+* the image and go to the engine; the borders and the columns the engine
+* leaves at the end go to blur_x_pixels.
+*******************************************************************************/
+void blur_x_plane(plane *in, plane *out, int r0, int r1, int c0, int c1,
+        blur_kernel *bk)
+{
+   int r, c, n, cs, ce, ws = bk->windowsize, center = bk->center;
+   unsigned char *src;
+   short *ssrc;
+   void *row, *dst;
+
+   if(bk->iir){
+      blur_x_iir(in, out, r0, r1, c0, c1, bk);
+      return;
+   }
+   n = in->c1 - in->c0;
+   if((row = malloc(((n > 0) ? n : 1) * (bk->fixed ? sizeof(short) :
+      sizeof(float)))) == NULL){
+      fprintf(stderr, "Error allocating the blur row.\n");
+      exit(1);
+   }
+
+   cs = (center < c0) ? c0 : ((center > c1) ? c1 : center);
+   ce = (bk->cols-center > c1) ? c1 : bk->cols-center;
+   if(ce < cs) ce = cs;
+
+   for(r=r0;r<r1;r++){
+      if(bk->fixed){
+         src = PLANE_PTR(in, unsigned char, r, in->c0);
+         for(c=0;c<n;c++) ((short *)row)[c] = src[c] - 128;
+         dst = PLANE_PTR(out, short, r, c0);
+         c = cs + blur_x_fixed_simd(bk->isa, (short *)row + cs-center-in->c0,
+            (short *)dst + cs-c0, ce-cs, bk->qx + center*ws, ws, bk->qxbits-8);
+      }
+      else{
+         if(bk->boosted){
+            /* la escala anterior de -scales, de vuelta a niveles de gris */
+            ssrc = PLANE_PTR(in, short, r, in->c0);
+            for(c=0;c<n;c++)
+               ((float *)row)[c] = (float)(ssrc[c] / BOOSTBLURFACTOR);
+         }
+         else{
+            src = PLANE_PTR(in, unsigned char, r, in->c0);
+            for(c=0;c<n;c++) ((float *)row)[c] = (float)src[c];
+         }
+         dst = PLANE_PTR(out, float, r, c0);
+         c = cs + blur_x_float_simd(bk->isa, (float *)row + cs-center-in->c0,
+            (float *)dst + cs-c0, ce-cs, bk->kernel, ws, bk->normx[center]);
+      }
+      blur_x_pixels(bk, row, in->c0, dst, c0, c0, cs);
+      blur_x_pixels(bk, row, in->c0, dst, c0, c, c1);
+   }
+   free(row);
+}
+
+/*******************************************************************************
+* PROCEDURE: blur_y_plane
+* PURPOSE: Blur rows [r0,r1) and columns [c0,c1) of the x-blurred image in
+* the y-direction and scale the result by BOOSTBLURFACTOR. The input plane
+* must hold the rows of the kernel window that are inside the image. The
+* kernel slides down the rows: every tap of a row is a contiguous run of
+* the input, so whole rows go to the engine, with the taps and the sum of
+* weights of the row.
+*******************************************************************************/
+void blur_y_plane(plane *in, plane *out, int r0, int r1, int c0, int c1,
+        blur_kernel *bk)
+{
+   int r, c, k, klo, khi, s, n, stride, acc,
+       ws = bk->windowsize, center = bk->center, rows = bk->rows;
+   float *fsrc, *kernel, norm, dot;
+   short *ssrc, *w, *dst;
+
+   if(bk->iir){
+      blur_y_iir(in, out, r0, r1, c0, c1, bk);
+      return;
+   }
+   stride = in->c1 - in->c0;
+   n = c1 - c0;
+   for(r=r0;r<r1;r++){
+      s = blur_slot(r, rows, center);
+      klo = (r < center) ? center-r : 0;
+      khi = (r+center >= rows) ? rows-1-r+center : ws-1;
+      dst = PLANE_PTR(out, short int, r, c0);
+      if(bk->fixed){
+         ssrc = PLANE_PTR(in, short, r+klo-center, c0);
+         w = bk->qy + s*ws + klo;
+         c = blur_y_fixed_simd(bk->isa, ssrc, stride, w, khi-klo+1,
+            bk->qybits-7, dst, n);
+         for(;c<n;c++){
+            acc = 1 << (bk->qybits-8);
+            for(k=0;k<=khi-klo;k++) acc += ssrc[c+k*stride] * w[k];
+            acc = (acc >> (bk->qybits-7)) + (128 << 15);
+            dst[c] = (short int)((acc * BLUR_BOOST + (1<<14)) >> 15);
+         }
+      }
+      else{
+         fsrc = PLANE_PTR(in, float, r+klo-center, c0);
+         kernel = bk->kernel + klo;
+         norm = bk->normy[s];
+         c = blur_y_float_simd(bk->isa, fsrc, stride, kernel, khi-klo+1, norm,
+            dst, n);
+         for(;c<n;c++){
+            dot = 0.0;
+            for(k=0;k<=khi-klo;k++) dot += fsrc[c+k*stride] * kernel[k];
+            dst[c] = (short int)(dot*BOOSTBLURFACTOR/norm + 0.5);
+         }
+      }
+   }
+}
+
+/*******************************************************************************
+* FUNCTION: blur_x_float_simd, blur_y_float_simd, blur_x_fixed_simd,
+*           blur_y_fixed_simd
+* PURPOSE: Call the engine of the instruction set isa. They return how many
+* of the n pixels were done, the rest is left to the caller.
+*******************************************************************************/
+int blur_x_float_simd(int isa, float *src, float *dst, int n, float *kernel,
+        int ntaps, float norm)
+{
+#ifdef BLUR_X86
+   switch(isa){
+      case ISA_AVX512: return(blur_x_float_avx512(src, dst, n, kernel, ntaps,
+                          norm));
+      case ISA_AVX2:   return(blur_x_float_avx2(src, dst, n, kernel, ntaps,
+                          norm));
+      case ISA_SSE2:   return(blur_x_float_sse2(src, dst, n, kernel, ntaps,
+                          norm));
+   }
+#endif
+   return(0);
+}
+
+int blur_y_float_simd(int isa, float *src, int stride, float *kernel,
+        int ntaps, double norm, short *dst, int n)
+{
+#ifdef BLUR_X86
+   switch(isa){
+      case ISA_AVX512: return(blur_y_float_avx512(src, stride, kernel, ntaps,
+                          norm, dst, n));
+      case ISA_AVX2:   return(blur_y_float_avx2(src, stride, kernel, ntaps,
+                          norm, dst, n));
+      case ISA_SSE2:   return(blur_y_float_sse2(src, stride, kernel, ntaps,
+                          norm, dst, n));
+   }
+#endif
+   return(0);
+}
+
+int blur_x_fixed_simd(int isa, short *src, short *dst, int n, short *w,
+        int ntaps, int shift)
+{
+#ifdef BLUR_X86
+   switch(isa){
+      case ISA_AVX512: return(blur_x_fixed_avx512(src, dst, n, w, ntaps,
+                          shift));
+      case ISA_AVX2:   return(blur_x_fixed_avx2(src, dst, n, w, ntaps, shift));
+      case ISA_SSE2:   return(blur_x_fixed_sse2(src, dst, n, w, ntaps, shift));
+   }
+#endif
+   return(0);
+}
+
+int blur_y_fixed_simd(int isa, short *src, int stride, short *w, int ntaps,
+        int shift, short *dst, int n)
+{
+#ifdef BLUR_X86
+   switch(isa){
+      case ISA_AVX512: return(blur_y_fixed_avx512(src, stride, w, ntaps, shift,
+                          dst, n));
+      case ISA_AVX2:   return(blur_y_fixed_avx2(src, stride, w, ntaps, shift,
+                          dst, n));
+      case ISA_SSE2:   return(blur_y_fixed_sse2(src, stride, w, ntaps, shift,
+                          dst, n));
+   }
+#endif
+   return(0);
+}
+
+/*******************************************************************************
+* FUNCTION: blur_iir_simd
+* PURPOSE: Call the engine of blur_iir_row of the instruction set isa.
+* Returns how many of the n pixels were done.
+*******************************************************************************/
+int blur_iir_simd(int isa, float *row, float *p1, float *p2, float *p3,
+        float *k, int n)
+{
+#ifdef BLUR_X86
+   switch(isa){
+      case ISA_AVX512: return(blur_iir_avx512(row, p1, p2, p3, k, n));
+      case ISA_AVX2:   return(blur_iir_avx2(row, p1, p2, p3, k, n));
+      case ISA_SSE2:   return(blur_iir_sse2(row, p1, p2, p3, k, n));
+   }
+#endif
+   return(0);
+}
+
+#ifdef BLUR_X86
+/*******************************************************************************
+* The float engines blur two vectors of pixels per iteration, so the two
+* chains of additions overlap (the x-direction ends with single vectors). Every lane adds its taps in the order of the
+* original code, and the y-direction rounds in double like it:
+* (short)(dot*BOOSTBLURFACTOR/sum + 0.5).
+*******************************************************************************/
+TARGET_SSE2
+int blur_x_float_sse2(float *src, float *dst, int n, float *kernel, int ntaps,
+        float norm)
+{
+   int c, k;
+   __m128 a0, a1, wk;
+
+   for(c=0;c+8<=n;c+=8){
+      a0 = a1 = _mm_setzero_ps();
+      for(k=0;k<ntaps;k++){
+         wk = _mm_set1_ps(kernel[k]);
+         a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(src+c+k), wk));
+         a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(src+c+k+4), wk));
+      }
+      _mm_storeu_ps(dst+c, _mm_div_ps(a0, _mm_set1_ps(norm)));
+      _mm_storeu_ps(dst+c+4, _mm_div_ps(a1, _mm_set1_ps(norm)));
+   }
+   for(;c+4<=n;c+=4){
+      a0 = _mm_setzero_ps();
+      for(k=0;k<ntaps;k++)
+         a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(src+c+k),
+            _mm_set1_ps(kernel[k])));
+      _mm_storeu_ps(dst+c, _mm_div_ps(a0, _mm_set1_ps(norm)));
+   }
+   return(c);
+}
+
+TARGET_AVX2
+int blur_x_float_avx2(float *src, float *dst, int n, float *kernel, int ntaps,
+        float norm)
+{
+   int c, k;
+   __m256 a0, a1, wk;
+
+   for(c=0;c+16<=n;c+=16){
+      a0 = a1 = _mm256_setzero_ps();
+      for(k=0;k<ntaps;k++){
+         wk = _mm256_set1_ps(kernel[k]);
+         a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(src+c+k), wk));
+         a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(src+c+k+8), wk));
+      }
+      _mm256_storeu_ps(dst+c, _mm256_div_ps(a0, _mm256_set1_ps(norm)));
+      _mm256_storeu_ps(dst+c+8, _mm256_div_ps(a1, _mm256_set1_ps(norm)));
+   }
+   for(;c+8<=n;c+=8){
+      a0 = _mm256_setzero_ps();
+      for(k=0;k<ntaps;k++)
+         a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(src+c+k),
+            _mm256_set1_ps(kernel[k])));
+      _mm256_storeu_ps(dst+c, _mm256_div_ps(a0, _mm256_set1_ps(norm)));
+   }
+   return(c);
+}
+
+TARGET_AVX512
+int blur_x_float_avx512(float *src, float *dst, int n, float *kernel,
+        int ntaps, float norm)
+{
+   int c, k;
+   __m512 a0, a1, wk;
+
+   for(c=0;c+32<=n;c+=32){
+      a0 = a1 = _mm512_setzero_ps();
+      for(k=0;k<ntaps;k++){
+         wk = _mm512_set1_ps(kernel[k]);
+         a0 = _mm512_add_ps(a0, _mm512_mul_ps(_mm512_loadu_ps(src+c+k), wk));
+         a1 = _mm512_add_ps(a1, _mm512_mul_ps(_mm512_loadu_ps(src+c+k+16), wk));
+      }
+      _mm512_storeu_ps(dst+c, _mm512_div_ps(a0, _mm512_set1_ps(norm)));
+      _mm512_storeu_ps(dst+c+16, _mm512_div_ps(a1, _mm512_set1_ps(norm)));
+   }
+   for(;c+16<=n;c+=16){
+      a0 = _mm512_setzero_ps();
+      for(k=0;k<ntaps;k++)
+         a0 = _mm512_add_ps(a0, _mm512_mul_ps(_mm512_loadu_ps(src+c+k),
+            _mm512_set1_ps(kernel[k])));
+      _mm512_storeu_ps(dst+c, _mm512_div_ps(a0, _mm512_set1_ps(norm)));
+   }
+   return(c);
+}
+
+TARGET_SSE2
+int blur_y_float_sse2(float *src, int stride, float *kernel, int ntaps,
+        double norm, short *dst, int n)
+{
+   int c, k;
+   float *p;
+   __m128 a0, a1, wk;
+   __m128d boost = _mm_set1_pd(BOOSTBLURFACTOR), half = _mm_set1_pd(0.5),
+           sum = _mm_set1_pd(norm), d0, d1, d2, d3;
+   __m128i i0, i1;
+
+   for(c=0;c+8<=n;c+=8){
+      a0 = a1 = _mm_setzero_ps();
+      for(k=0,p=src+c;k<ntaps;k++,p+=stride){
+         wk = _mm_set1_ps(kernel[k]);
+         a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(p), wk));
+         a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(p+4), wk));
+      }
+      d0 = _mm_cvtps_pd(a0);
+      d1 = _mm_cvtps_pd(_mm_movehl_ps(a0, a0));
+      d2 = _mm_cvtps_pd(a1);
+      d3 = _mm_cvtps_pd(_mm_movehl_ps(a1, a1));
+      d0 = _mm_add_pd(_mm_div_pd(_mm_mul_pd(d0, boost), sum), half);
+      d1 = _mm_add_pd(_mm_div_pd(_mm_mul_pd(d1, boost), sum), half);
+      d2 = _mm_add_pd(_mm_div_pd(_mm_mul_pd(d2, boost), sum), half);
+      d3 = _mm_add_pd(_mm_div_pd(_mm_mul_pd(d3, boost), sum), half);
+      i0 = _mm_unpacklo_epi64(_mm_cvttpd_epi32(d0), _mm_cvttpd_epi32(d1));
+      i1 = _mm_unpacklo_epi64(_mm_cvttpd_epi32(d2), _mm_cvttpd_epi32(d3));
+      _mm_storeu_si128((__m128i *)(dst+c), _mm_packs_epi32(i0, i1));
+   }
+   return(c);
+}
+
+TARGET_AVX2
+int blur_y_float_avx2(float *src, int stride, float *kernel, int ntaps,
+        double norm, short *dst, int n)
+{
+   int c, k;
+   float *p;
+   __m256 a0, a1, wk;
+   __m256d boost = _mm256_set1_pd(BOOSTBLURFACTOR), half = _mm256_set1_pd(0.5),
+           sum = _mm256_set1_pd(norm), d0, d1, d2, d3;
+   __m128i i0, i1, i2, i3;
+
+   for(c=0;c+16<=n;c+=16){
+      a0 = a1 = _mm256_setzero_ps();
+      for(k=0,p=src+c;k<ntaps;k++,p+=stride){
+         wk = _mm256_set1_ps(kernel[k]);
+         a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(p), wk));
+         a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(p+8), wk));
+      }
+      d0 = _mm256_cvtps_pd(_mm256_castps256_ps128(a0));
+      d1 = _mm256_cvtps_pd(_mm256_extractf128_ps(a0, 1));
+      d2 = _mm256_cvtps_pd(_mm256_castps256_ps128(a1));
+      d3 = _mm256_cvtps_pd(_mm256_extractf128_ps(a1, 1));
+      i0 = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_div_pd(
+         _mm256_mul_pd(d0, boost), sum), half));
+      i1 = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_div_pd(
+         _mm256_mul_pd(d1, boost), sum), half));
+      i2 = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_div_pd(
+         _mm256_mul_pd(d2, boost), sum), half));
+      i3 = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_div_pd(
+         _mm256_mul_pd(d3, boost), sum), half));
+      _mm_storeu_si128((__m128i *)(dst+c), _mm_packs_epi32(i0, i1));
+      _mm_storeu_si128((__m128i *)(dst+c+8), _mm_packs_epi32(i2, i3));
+   }
+   return(c);
+}
+
+TARGET_AVX512
+int blur_y_float_avx512(float *src, int stride, float *kernel, int ntaps,
+        double norm, short *dst, int n)
+{
+   int c, k;
+   float *p;
+   __m512 a0, a1, wk;
+   __m512d boost = _mm512_set1_pd(BOOSTBLURFACTOR), half = _mm512_set1_pd(0.5),
+           sum = _mm512_set1_pd(norm), d0, d1, d2, d3;
+   __m256i i0, i1, i2, i3;
+
+   for(c=0;c+32<=n;c+=32){
+      a0 = a1 = _mm512_setzero_ps();
+      for(k=0,p=src+c;k<ntaps;k++,p+=stride){
+         wk = _mm512_set1_ps(kernel[k]);
+         a0 = _mm512_add_ps(a0, _mm512_mul_ps(_mm512_loadu_ps(p), wk));
+         a1 = _mm512_add_ps(a1, _mm512_mul_ps(_mm512_loadu_ps(p+16), wk));
+      }
+      d0 = _mm512_cvtps_pd(_mm512_castps512_ps256(a0));
+      d1 = _mm512_cvtps_pd(_mm256_castsi256_ps(_mm512_extracti64x4_epi64(
+         _mm512_castps_si512(a0), 1)));
+      d2 = _mm512_cvtps_pd(_mm512_castps512_ps256(a1));
+      d3 = _mm512_cvtps_pd(_mm256_castsi256_ps(_mm512_extracti64x4_epi64(
+         _mm512_castps_si512(a1), 1)));
+      i0 = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_div_pd(
+         _mm512_mul_pd(d0, boost), sum), half));
+      i1 = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_div_pd(
+         _mm512_mul_pd(d1, boost), sum), half));
+      i2 = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_div_pd(
+         _mm512_mul_pd(d2, boost), sum), half));
+      i3 = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_div_pd(
+         _mm512_mul_pd(d3, boost), sum), half));
+      _mm256_storeu_si256((__m256i *)(dst+c), _mm512_cvtepi32_epi16(
+         _mm512_inserti64x4(_mm512_castsi256_si512(i0), i1, 1)));
+      _mm256_storeu_si256((__m256i *)(dst+c+16), _mm512_cvtepi32_epi16(
+         _mm512_inserti64x4(_mm512_castsi256_si512(i2), i3, 1)));
+   }
+   return(c);
+}
+
+/*******************************************************************************
+* The engines of the recursive blur advance one vector of sequences per
+* iteration, multiplying and adding in the order of blur_iir_row.
+*******************************************************************************/
+TARGET_SSE2
+int blur_iir_sse2(float *row, float *p1, float *p2, float *p3, float *k,
+        int n)
+{
+   int c;
+   __m128 k0 = _mm_set1_ps(k[0]), k1 = _mm_set1_ps(k[1]),
+          k2 = _mm_set1_ps(k[2]), k3 = _mm_set1_ps(k[3]), a;
+
+   for(c=0;c+4<=n;c+=4){
+      a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(row+c), k0),
+         _mm_mul_ps(_mm_loadu_ps(p1+c), k1));
+      a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(p2+c), k2));
+      a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(p3+c), k3));
+      _mm_storeu_ps(row+c, a);
+   }
+   return(c);
+}
+
+TARGET_AVX2
+int blur_iir_avx2(float *row, float *p1, float *p2, float *p3, float *k,
+        int n)
+{
+   int c;
+   __m256 k0 = _mm256_set1_ps(k[0]), k1 = _mm256_set1_ps(k[1]),
+          k2 = _mm256_set1_ps(k[2]), k3 = _mm256_set1_ps(k[3]), a;
+
+   for(c=0;c+8<=n;c+=8){
+      a = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(row+c), k0),
+         _mm256_mul_ps(_mm256_loadu_ps(p1+c), k1));
+      a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(p2+c), k2));
+      a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(p3+c), k3));
+      _mm256_storeu_ps(row+c, a);
+   }
+   return(c);
+}
+
+TARGET_AVX512
+int blur_iir_avx512(float *row, float *p1, float *p2, float *p3, float *k,
+        int n)
+{
+   int c;
+   __m512 k0 = _mm512_set1_ps(k[0]), k1 = _mm512_set1_ps(k[1]),
+          k2 = _mm512_set1_ps(k[2]), k3 = _mm512_set1_ps(k[3]), a;
+
+   for(c=0;c+16<=n;c+=16){
+      a = _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(row+c), k0),
+         _mm512_mul_ps(_mm512_loadu_ps(p1+c), k1));
+      a = _mm512_add_ps(a, _mm512_mul_ps(_mm512_loadu_ps(p2+c), k2));
+      a = _mm512_add_ps(a, _mm512_mul_ps(_mm512_loadu_ps(p3+c), k3));
+      _mm512_storeu_ps(row+c, a);
+   }
+   return(c);
+}
+
+/*******************************************************************************
+* The fixed point engines take the taps in pairs: the pixels of two taps are
+* interleaved and madd multiplies them by both weights and adds the products
+* in 32 bits. The sums are rounded and shifted right by shift bits: to Q8 in
+* the x-direction and to Q15 in the y-direction, where 128 is added back and
+* the result is multiplied by BOOSTBLURFACTOR and rounded.
+*******************************************************************************/
+TARGET_SSE2
+int blur_x_fixed_sse2(short *src, short *dst, int n, short *w, int ntaps,
+        int shift)
+{
+   int c, k;
+   __m128i a, b, wk, lo, hi, round;
+   __m128i count = _mm_cvtsi32_si128(shift);
+
+   round = _mm_set1_epi32(1 << (shift-1));
+   for(c=0;c+8<=n;c+=8){
+      lo = hi = round;
+      for(k=0;k<ntaps;k+=2){
+         a = _mm_loadu_si128((__m128i *)(src+c+k));
+         if(k+1 < ntaps){
+            b = _mm_loadu_si128((__m128i *)(src+c+k+1));
+            wk = _mm_set1_epi32(((int)w[k+1] << 16) | (unsigned short)w[k]);
+         }
+         else{
+            b = _mm_setzero_si128();
+            wk = _mm_set1_epi32((unsigned short)w[k]);
+         }
+         lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+         hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+      }
+      lo = _mm_sra_epi32(lo, count);
+      hi = _mm_sra_epi32(hi, count);
+      _mm_storeu_si128((__m128i *)(dst+c), _mm_packs_epi32(lo, hi));
+   }
+   return(c);
+}
+
+TARGET_AVX2
+int blur_x_fixed_avx2(short *src, short *dst, int n, short *w, int ntaps,
+        int shift)
+{
+   int c, k;
+   __m256i a, b, wk, lo, hi, round;
+   __m128i count = _mm_cvtsi32_si128(shift);
+
+   round = _mm256_set1_epi32(1 << (shift-1));
+   for(c=0;c+16<=n;c+=16){
+      lo = hi = round;
+      for(k=0;k<ntaps;k+=2){
+         a = _mm256_loadu_si256((__m256i *)(src+c+k));
+         if(k+1 < ntaps){
+            b = _mm256_loadu_si256((__m256i *)(src+c+k+1));
+            wk = _mm256_set1_epi32(((int)w[k+1] << 16) | (unsigned short)w[k]);
+         }
+         else{
+            b = _mm256_setzero_si256();
+            wk = _mm256_set1_epi32((unsigned short)w[k]);
+         }
+         lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b),
+            wk));
+         hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b),
+            wk));
+      }
+      lo = _mm256_sra_epi32(lo, count);
+      hi = _mm256_sra_epi32(hi, count);
+      /* unpack y packs trabajan por mitades de 128 bits: el orden se recupera */
+      _mm256_storeu_si256((__m256i *)(dst+c), _mm256_packs_epi32(lo, hi));
+   }
+   return(c);
+}
+
+TARGET_AVX512
+int blur_x_fixed_avx512(short *src, short *dst, int n, short *w, int ntaps,
+        int shift)
+{
+   int c, k;
+   __m512i a, b, wk, lo, hi, round;
+   __m128i count = _mm_cvtsi32_si128(shift);
+
+   round = _mm512_set1_epi32(1 << (shift-1));
+   for(c=0;c+32<=n;c+=32){
+      lo = hi = round;
+      for(k=0;k<ntaps;k+=2){
+         a = _mm512_loadu_si512((void *)(src+c+k));
+         if(k+1 < ntaps){
+            b = _mm512_loadu_si512((void *)(src+c+k+1));
+            wk = _mm512_set1_epi32(((int)w[k+1] << 16) | (unsigned short)w[k]);
+         }
+         else{
+            b = _mm512_setzero_si512();
+            wk = _mm512_set1_epi32((unsigned short)w[k]);
+         }
+         lo = _mm512_add_epi32(lo, _mm512_madd_epi16(_mm512_unpacklo_epi16(a, b),
+            wk));
+         hi = _mm512_add_epi32(hi, _mm512_madd_epi16(_mm512_unpackhi_epi16(a, b),
+            wk));
+      }
+      lo = _mm512_sra_epi32(lo, count);
+      hi = _mm512_sra_epi32(hi, count);
+      _mm512_storeu_si512((void *)(dst+c), _mm512_packs_epi32(lo, hi));
+   }
+   return(c);
+}
+
+/*******************************************************************************
+* FUNCTION: blur_mullo_sse2
+* PURPOSE: Low 32 bits of the products of the lanes of a and b, that SSE2
+* lacks (_mm_mullo_epi32 is SSE4.1). The lanes of a must not be negative.
+*******************************************************************************/
+TARGET_SSE2
+__m128i blur_mullo_sse2(__m128i a, __m128i b)
+{
+   __m128i even, odd;
+
+   even = _mm_mul_epu32(a, b);
+   odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+   return(_mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+      _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0))));
+}
+
+TARGET_SSE2
+int blur_y_fixed_sse2(short *src, int stride, short *w, int ntaps,
+        int shift, short *dst, int n)
+{
+   int c, k;
+   short *p;
+   __m128i a, b, wk, lo, hi, round, offset, boost, half;
+   __m128i count = _mm_cvtsi32_si128(shift);
+
+   round = _mm_set1_epi32(1 << (shift-1));
+   offset = _mm_set1_epi32(128 << 15);
+   boost = _mm_set1_epi32(BLUR_BOOST);
+   half = _mm_set1_epi32(1 << 14);
+   for(c=0;c+8<=n;c+=8){
+      lo = hi = round;
+      for(k=0,p=src+c;k<ntaps;k+=2,p+=2*stride){
+         a = _mm_loadu_si128((__m128i *)p);
+         if(k+1 < ntaps){
+            b = _mm_loadu_si128((__m128i *)(p+stride));
+            wk = _mm_set1_epi32(((int)w[k+1] << 16) | (unsigned short)w[k]);
+         }
+         else{
+            b = _mm_setzero_si128();
+            wk = _mm_set1_epi32((unsigned short)w[k]);
+         }
+         lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+         hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+      }
+      lo = _mm_add_epi32(_mm_sra_epi32(lo, count), offset);
+      hi = _mm_add_epi32(_mm_sra_epi32(hi, count), offset);
+      lo = blur_mullo_sse2(lo, boost);
+      hi = blur_mullo_sse2(hi, boost);
+      lo = _mm_srai_epi32(_mm_add_epi32(lo, half), 15);
+      hi = _mm_srai_epi32(_mm_add_epi32(hi, half), 15);
+      _mm_storeu_si128((__m128i *)(dst+c), _mm_packs_epi32(lo, hi));
+   }
+   return(c);
+}
+
+TARGET_AVX2
+int blur_y_fixed_avx2(short *src, int stride, short *w, int ntaps,
+        int shift, short *dst, int n)
+{
+   int c, k;
+   short *p;
+   __m256i a, b, wk, lo, hi, round, offset, boost, half;
+   __m128i count = _mm_cvtsi32_si128(shift);
+
+   round = _mm256_set1_epi32(1 << (shift-1));
+   offset = _mm256_set1_epi32(128 << 15);
+   boost = _mm256_set1_epi32(BLUR_BOOST);
+   half = _mm256_set1_epi32(1 << 14);
+   for(c=0;c+16<=n;c+=16){
+      lo = hi = round;
+      for(k=0,p=src+c;k<ntaps;k+=2,p+=2*stride){
+         a = _mm256_loadu_si256((__m256i *)p);
+         if(k+1 < ntaps){
+            b = _mm256_loadu_si256((__m256i *)(p+stride));
+            wk = _mm256_set1_epi32(((int)w[k+1] << 16) | (unsigned short)w[k]);
+         }
+         else{
+            b = _mm256_setzero_si256();
+            wk = _mm256_set1_epi32((unsigned short)w[k]);
+         }
+         lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b),
+            wk));
+         hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b),
+            wk));
+      }
+      lo = _mm256_add_epi32(_mm256_sra_epi32(lo, count), offset);
+      hi = _mm256_add_epi32(_mm256_sra_epi32(hi, count), offset);
+      lo = _mm256_mullo_epi32(lo, boost);
+      hi = _mm256_mullo_epi32(hi, boost);
+      lo = _mm256_srai_epi32(_mm256_add_epi32(lo, half), 15);
+      hi = _mm256_srai_epi32(_mm256_add_epi32(hi, half), 15);
+      _mm256_storeu_si256((__m256i *)(dst+c), _mm256_packs_epi32(lo, hi));
+   }
+   return(c);
+}
+
+TARGET_AVX512
+int blur_y_fixed_avx512(short *src, int stride, short *w, int ntaps,
+        int shift, short *dst, int n)
+{
+   int c, k;
+   short *p;
+   __m512i a, b, wk, lo, hi, round, offset, boost, half;
+   __m128i count = _mm_cvtsi32_si128(shift);
+
+   round = _mm512_set1_epi32(1 << (shift-1));
+   offset = _mm512_set1_epi32(128 << 15);
+   boost = _mm512_set1_epi32(BLUR_BOOST);
+   half = _mm512_set1_epi32(1 << 14);
+   for(c=0;c+32<=n;c+=32){
+      lo = hi = round;
+      for(k=0,p=src+c;k<ntaps;k+=2,p+=2*stride){
+         a = _mm512_loadu_si512((void *)p);
+         if(k+1 < ntaps){
+            b = _mm512_loadu_si512((void *)(p+stride));
+            wk = _mm512_set1_epi32(((int)w[k+1] << 16) | (unsigned short)w[k]);
+         }
+         else{
+            b = _mm512_setzero_si512();
+            wk = _mm512_set1_epi32((unsigned short)w[k]);
+         }
+         lo = _mm512_add_epi32(lo, _mm512_madd_epi16(_mm512_unpacklo_epi16(a, b),
+            wk));
+         hi = _mm512_add_epi32(hi, _mm512_madd_epi16(_mm512_unpackhi_epi16(a, b),
+            wk));
+      }
+      lo = _mm512_add_epi32(_mm512_sra_epi32(lo, count), offset);
+      hi = _mm512_add_epi32(_mm512_sra_epi32(hi, count), offset);
+      lo = _mm512_mullo_epi32(lo, boost);
+      hi = _mm512_mullo_epi32(hi, boost);
+      lo = _mm512_srai_epi32(_mm512_add_epi32(lo, half), 15);
+      hi = _mm512_srai_epi32(_mm512_add_epi32(hi, half), 15);
+      _mm512_storeu_si512((void *)(dst+c), _mm512_packs_epi32(lo, hi));
+   }
+   return(c);
+}
+#endif
+//<------------------------- end blur.c ------------------------->
+
+//<------------------------- begin nms.c ------------------------->
+/*******************************************************************************
+* FILE: nms.c
+* Non-maximal suppression without a branch per pixel. In the eight octants
+* of the original code the neighbours compared with the center are the axis
+* neighbour a on the side of the major component of the gradient and the
+* diagonal d next to it, and the test on each side reduces to the sign of
+*    mag1 = (a - m00) * P/m00 + (d - a) * Q/m00
+* where P and Q are the absolute values of the major and minor components.
+* The octant only chooses a, d, P and Q, so the neighbours are picked with
+* blends. The vector engines (SSE2 or AVX2, 8 or 16 pixels per iteration)
+* compute the numerator S = (a - m00)*P + (d - a)*Q exactly in 32 bit
+* integers with one multiply-add and test its sign, without any division.
+* The original code rounds the quotients in float, which can change the
+* sign of mag1 when S is almost 0; those pixels (a handful per image) are
+* redone by nms_pixel, which rounds like the original code, so the map is
+* identical to it.
+*******************************************************************************/
+
+/*******************************************************************************
+* FUNCTION: nms_isa
+* PURPOSE: Instruction set of the suppression: the one of -isa (or the
+* widest of the processor), at most AVX2.
+*******************************************************************************/
+int nms_isa(void)
+{
+   int isa = blur_best_isa();
+
+   if((blur_isa != ISA_AUTO) && (blur_isa < isa)) isa = blur_isa;
+   return((isa > ISA_AVX2) ? ISA_AVX2 : isa);
+}
+
+/*******************************************************************************
+* FUNCTION: nms_pixel
+* PURPOSE: Suppression of the pixel at magptr, whose rows are stride shorts
+* apart. Returns NOEDGE or POSSIBLE_EDGE, with the float arithmetic of the
+* original code.
+*******************************************************************************/
+unsigned char nms_pixel(short *magptr, short gx, short gy, int stride)
+{
+   int m00 = *magptr, ax, ay, xmajor, dc, dr, da, p, q, a1, d1, a2, d2;
+   float pm, qm, mag1, mag2;
+
+   if(m00 == 0) return((unsigned char) NOEDGE);
+
+   /* octante: eje mayor y lado de los vecinos de la izquierda */
+   ax = (gx < 0) ? -gx : gx;
+   ay = (gy < 0) ? -gy : gy;
+   xmajor = (ax > ay) || ((ax == ay) && ((gx >= 0) || (gy >= 0)));
+   dc = (gx >= 0) ? -1 : 1;
+   dr = (gy >= 0) ? -stride : stride;
+   da = xmajor ? dc : dr;
+   p = xmajor ? ax : ay;
+   q = xmajor ? ay : ax;
+
+   a1 = magptr[da];
+   d1 = magptr[dr+dc];
+   a2 = magptr[-da];
+   d2 = magptr[-dr-dc];
+
+   /* -gx/m00 y gy/m00 del original, salvo el signo */
+   pm = p / ((float)m00);
+   qm = q / ((float)m00);
+   mag1 = (a1 - m00)*pm + (d1 - a1)*qm;
+   mag2 = (a2 - m00)*pm + (d2 - a2)*qm;
+
+   if((mag1 > 0.0) || (mag2 >= 0.0)) return((unsigned char) NOEDGE);
+   return((unsigned char) POSSIBLE_EDGE);
+}
+
+/*******************************************************************************
+* PROCEDURE: nms_row
+* PURPOSE: Suppression of n consecutive pixels of a row. mag, gx and gy point
+* to the first pixel, the rows of mag are stride shorts apart and must hold
+* the pixels around the run.
+*******************************************************************************/
+void nms_row(short *mag, int stride, short *gx, short *gy,
+        unsigned char *result, int n, int isa)
+{
+   int c = 0;
+
+#ifdef BLUR_X86
+   if(isa == ISA_AVX2) c = nms_row_avx2(mag, stride, gx, gy, result, n);
+   else if(isa == ISA_SSE2) c = nms_row_sse2(mag, stride, gx, gy, result, n);
+#endif
+   for(;c<n;c++) result[c] = nms_pixel(mag+c, gx[c], gy[c], stride);
+}
+
+#ifdef BLUR_X86
+/*******************************************************************************
+* The engines compute the numerators S1 and S2 of both sides and the sums
+* T = |a - m00|*P + |d - a|*Q of the absolute values of their terms. The
+* float quotients of the original code are off by less than T*2^-22/m00 in
+* all, so when |S| > T >> 21 the sign of S is the sign of mag1. When T is 0
+* both terms are exact zeros. The other pixels, and those whose values do
+* not fit in the 16 bit differences (negative shorts), go to nms_pixel.
+*******************************************************************************/
+/* seleccion por mascara de los motores SSE2: m ? a : b */
+#define NMS_SEL128(m, a, b) _mm_or_si128(_mm_and_si128(m, a), \
+   _mm_andnot_si128(m, b))
+
+TARGET_SSE2
+int nms_row_sse2(short *mag, int stride, short *gx, short *gy,
+        unsigned char *result, int n)
+{
+   int c, i, redo;
+   __m128i zero = _mm_setzero_si128(), m, x, y, ax, ay, negx, negy, xmaj,
+           w, e, nr, s, nw, ne, sw, se, a1, d1, a2, d2, p, q, pq, bad,
+           u, v, s1, s2, t1, t2, k, safe[2], edge[2], ok, out;
+
+   for(c=0;c+8<=n;c+=8){
+      m = _mm_loadu_si128((__m128i *)(mag+c));
+      x = _mm_loadu_si128((__m128i *)(gx+c));
+      y = _mm_loadu_si128((__m128i *)(gy+c));
+      w = _mm_loadu_si128((__m128i *)(mag+c-1));
+      e = _mm_loadu_si128((__m128i *)(mag+c+1));
+      nr = _mm_loadu_si128((__m128i *)(mag+c-stride));
+      s = _mm_loadu_si128((__m128i *)(mag+c+stride));
+      nw = _mm_loadu_si128((__m128i *)(mag+c-stride-1));
+      ne = _mm_loadu_si128((__m128i *)(mag+c-stride+1));
+      sw = _mm_loadu_si128((__m128i *)(mag+c+stride-1));
+      se = _mm_loadu_si128((__m128i *)(mag+c+stride+1));
+
+      ax = _mm_max_epi16(x, _mm_sub_epi16(zero, x));
+      ay = _mm_max_epi16(y, _mm_sub_epi16(zero, y));
+      negx = _mm_srai_epi16(x, 15);
+      negy = _mm_srai_epi16(y, 15);
+      xmaj = _mm_or_si128(_mm_cmpgt_epi16(ax, ay),
+         _mm_andnot_si128(_mm_and_si128(negx, negy), _mm_cmpeq_epi16(ax, ay)));
+
+      a1 = NMS_SEL128(xmaj, NMS_SEL128(negx, e, w), NMS_SEL128(negy, s, nr));
+      a2 = NMS_SEL128(xmaj, NMS_SEL128(negx, w, e), NMS_SEL128(negy, nr, s));
+      d1 = NMS_SEL128(negy, NMS_SEL128(negx, se, sw), NMS_SEL128(negx, ne, nw));
+      d2 = NMS_SEL128(negy, NMS_SEL128(negx, nw, ne), NMS_SEL128(negx, sw, se));
+      p = NMS_SEL128(xmaj, ax, ay);
+      q = NMS_SEL128(xmaj, ay, ax);
+      bad = _mm_srai_epi16(_mm_or_si128(_mm_or_si128(_mm_or_si128(m, a1),
+         _mm_or_si128(d1, a2)), _mm_or_si128(d2, _mm_or_si128(ax, ay))), 15);
+
+      /* cada mitad del vector: 4 pixeles en 32 bits */
+      for(i=0;i<2;i++){
+         pq = i ? _mm_unpackhi_epi16(p, q) : _mm_unpacklo_epi16(p, q);
+         u = _mm_sub_epi16(a1, m);
+         v = _mm_sub_epi16(d1, a1);
+         s1 = _mm_madd_epi16(i ? _mm_unpackhi_epi16(u, v) :
+            _mm_unpacklo_epi16(u, v), pq);
+         u = _mm_max_epi16(u, _mm_sub_epi16(zero, u));
+         v = _mm_max_epi16(v, _mm_sub_epi16(zero, v));
+         t1 = _mm_madd_epi16(i ? _mm_unpackhi_epi16(u, v) :
+            _mm_unpacklo_epi16(u, v), pq);
+         u = _mm_sub_epi16(a2, m);
+         v = _mm_sub_epi16(d2, a2);
+         s2 = _mm_madd_epi16(i ? _mm_unpackhi_epi16(u, v) :
+            _mm_unpacklo_epi16(u, v), pq);
+         u = _mm_max_epi16(u, _mm_sub_epi16(zero, u));
+         v = _mm_max_epi16(v, _mm_sub_epi16(zero, v));
+         t2 = _mm_madd_epi16(i ? _mm_unpackhi_epi16(u, v) :
+            _mm_unpacklo_epi16(u, v), pq);
+
+         k = _mm_srai_epi32(t1, 21);
+         ok = _mm_or_si128(_mm_cmpeq_epi32(t1, zero),
+            _mm_or_si128(_mm_cmpgt_epi32(s1, k),
+            _mm_cmplt_epi32(s1, _mm_sub_epi32(zero, k))));
+         k = _mm_srai_epi32(t2, 21);
+         ok = _mm_and_si128(ok, _mm_or_si128(_mm_cmpeq_epi32(t2, zero),
+            _mm_or_si128(_mm_cmpgt_epi32(s2, k),
+            _mm_cmplt_epi32(s2, _mm_sub_epi32(zero, k)))));
+         safe[i] = ok;
+         /* borde posible si mag1 <= 0 y mag2 < 0 */
+         edge[i] = _mm_andnot_si128(_mm_cmpgt_epi32(s1, zero),
+            _mm_cmplt_epi32(s2, zero));
+      }
+
+      ok = _mm_andnot_si128(bad, _mm_packs_epi32(safe[0], safe[1]));
+      out = _mm_and_si128(_mm_packs_epi32(edge[0], edge[1]),
+         _mm_cmpgt_epi16(m, zero));
+      out = NMS_SEL128(out, _mm_set1_epi16(POSSIBLE_EDGE),
+         _mm_set1_epi16(NOEDGE));
+      _mm_storel_epi64((__m128i *)(result+c), _mm_packus_epi16(out, out));
+
+      /* los pixeles dudosos (con magnitud) se rehacen como el original */
+      redo = _mm_movemask_epi8(_mm_andnot_si128(_mm_or_si128(ok,
+         _mm_cmpeq_epi16(m, zero)), _mm_set1_epi16(-1)));
+      for(i=0;redo!=0;i++,redo>>=2)
+         if(redo & 1)
+            result[c+i] = nms_pixel(mag+c+i, gx[c+i], gy[c+i], stride);
+   }
+   return(c);
+}
+
+TARGET_AVX2
+int nms_row_avx2(short *mag, int stride, short *gx, short *gy,
+        unsigned char *result, int n)
+{
+   int c, i, redo;
+   __m256i zero = _mm256_setzero_si256(), m, x, y, ax, ay, negx, negy, xmaj,
+           w, e, nr, s, nw, ne, sw, se, a1, d1, a2, d2, p, q, pq, bad,
+           u, v, s1, s2, t1, t2, safe[2], edge[2], ok, out;
+
+   for(c=0;c+16<=n;c+=16){
+      m = _mm256_loadu_si256((__m256i *)(mag+c));
+      x = _mm256_loadu_si256((__m256i *)(gx+c));
+      y = _mm256_loadu_si256((__m256i *)(gy+c));
+      w = _mm256_loadu_si256((__m256i *)(mag+c-1));
+      e = _mm256_loadu_si256((__m256i *)(mag+c+1));
+      nr = _mm256_loadu_si256((__m256i *)(mag+c-stride));
+      s = _mm256_loadu_si256((__m256i *)(mag+c+stride));
+      nw = _mm256_loadu_si256((__m256i *)(mag+c-stride-1));
+      ne = _mm256_loadu_si256((__m256i *)(mag+c-stride+1));
+      sw = _mm256_loadu_si256((__m256i *)(mag+c+stride-1));
+      se = _mm256_loadu_si256((__m256i *)(mag+c+stride+1));
+
+      ax = _mm256_abs_epi16(x);
+      ay = _mm256_abs_epi16(y);
+      negx = _mm256_srai_epi16(x, 15);
+      negy = _mm256_srai_epi16(y, 15);
+      xmaj = _mm256_or_si256(_mm256_cmpgt_epi16(ax, ay),
+         _mm256_andnot_si256(_mm256_and_si256(negx, negy),
+         _mm256_cmpeq_epi16(ax, ay)));
+
+      a1 = _mm256_blendv_epi8(_mm256_blendv_epi8(nr, s, negy),
+         _mm256_blendv_epi8(w, e, negx), xmaj);
+      a2 = _mm256_blendv_epi8(_mm256_blendv_epi8(s, nr, negy),
+         _mm256_blendv_epi8(e, w, negx), xmaj);
+      d1 = _mm256_blendv_epi8(_mm256_blendv_epi8(nw, ne, negx),
+         _mm256_blendv_epi8(sw, se, negx), negy);
+      d2 = _mm256_blendv_epi8(_mm256_blendv_epi8(se, sw, negx),
+         _mm256_blendv_epi8(ne, nw, negx), negy);
+      p = _mm256_blendv_epi8(ay, ax, xmaj);
+      q = _mm256_blendv_epi8(ax, ay, xmaj);
+      bad = _mm256_srai_epi16(_mm256_or_si256(_mm256_or_si256(
+         _mm256_or_si256(m, a1), _mm256_or_si256(d1, a2)),
+         _mm256_or_si256(d2, _mm256_or_si256(ax, ay))), 15);
+
+      for(i=0;i<2;i++){
+         pq = i ? _mm256_unpackhi_epi16(p, q) : _mm256_unpacklo_epi16(p, q);
+         u = _mm256_sub_epi16(a1, m);
+         v = _mm256_sub_epi16(d1, a1);
+         s1 = _mm256_madd_epi16(i ? _mm256_unpackhi_epi16(u, v) :
+            _mm256_unpacklo_epi16(u, v), pq);
+         u = _mm256_abs_epi16(u);
+         v = _mm256_abs_epi16(v);
+         t1 = _mm256_madd_epi16(i ? _mm256_unpackhi_epi16(u, v) :
+            _mm256_unpacklo_epi16(u, v), pq);
+         u = _mm256_sub_epi16(a2, m);
+         v = _mm256_sub_epi16(d2, a2);
+         s2 = _mm256_madd_epi16(i ? _mm256_unpackhi_epi16(u, v) :
+            _mm256_unpacklo_epi16(u, v), pq);
+         u = _mm256_abs_epi16(u);
+         v = _mm256_abs_epi16(v);
+         t2 = _mm256_madd_epi16(i ? _mm256_unpackhi_epi16(u, v) :
+            _mm256_unpacklo_epi16(u, v), pq);
+
+         ok = _mm256_and_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi32(t1, zero),
+               _mm256_cmpgt_epi32(_mm256_abs_epi32(s1),
+               _mm256_srai_epi32(t1, 21))),
+            _mm256_or_si256(_mm256_cmpeq_epi32(t2, zero),
+               _mm256_cmpgt_epi32(_mm256_abs_epi32(s2),
+               _mm256_srai_epi32(t2, 21))));
+         safe[i] = ok;
+         edge[i] = _mm256_andnot_si256(_mm256_cmpgt_epi32(s1, zero),
+            _mm256_cmpgt_epi32(zero, s2));
+      }
+
+      /* packs deshace el orden de unpacklo/unpackhi en cada mitad */
+      ok = _mm256_andnot_si256(bad, _mm256_packs_epi32(safe[0], safe[1]));
+      out = _mm256_and_si256(_mm256_packs_epi32(edge[0], edge[1]),
+         _mm256_cmpgt_epi16(m, zero));
+      out = _mm256_blendv_epi8(_mm256_set1_epi16(NOEDGE),
+         _mm256_set1_epi16(POSSIBLE_EDGE), out);
+      _mm_storeu_si128((__m128i *)(result+c), _mm_packus_epi16(
+         _mm256_castsi256_si128(out), _mm256_extracti128_si256(out, 1)));
+
+      redo = _mm256_movemask_epi8(_mm256_andnot_si256(_mm256_or_si256(ok,
+         _mm256_cmpeq_epi16(m, zero)), _mm256_set1_epi16(-1)));
+      for(i=0;redo!=0;i++,redo=(int)((unsigned)redo>>2))
+         if(redo & 1)
+            result[c+i] = nms_pixel(mag+c+i, gx[c+i], gy[c+i], stride);
+   }
+   return(c);
+}
+#endif
+//<------------------------- end nms.c ------------------------->
+
+//<------------------------- begin bitmap.c ------------------------->
+/*******************************************************************************
+* FILE: bitmap.c
+* Bit maps of the non-maximal suppression and of the edges. The nms map only
+* tells the possible edges from the rest and the edge map the edges from the
+* rest, so each pixel is one bit: a row is BITS_WORDS(cols) words and pixel c
+* is bit c%64 of word c/64. The maps take 8 times less memory and the
+* allgathers, the moves of -balance and the gather of the edges send 8 times
+* less bytes. The passes of the hysteresis only visit the set bits of each
+* word, the border of the image is cleared with a mask per word and the three
+* neighbours above a pixel are read at once. The bits past the last column
+* are always 0. The edge image is expanded to bytes only to be written.
+*******************************************************************************/
+
+/*******************************************************************************
+* FUNCTION: bits_word
+* PURPOSE: Pack n <= 64 pixels: bit i is set when src[i] is value.
+*******************************************************************************/
+bitword bits_word(unsigned char *src, int n, unsigned char value, int isa)
+{
+   bitword w = 0;
+   int i;
+
+#ifdef BLUR_X86
+   if((isa >= ISA_SSE2) && (n == BITS_WORD)) return(bits_word_sse2(src, value));
+#endif
+   for(i=0;i<n;i++) if(src[i] == value) w |= (bitword)1 << i;
+   return(w);
+}
+
+#ifdef BLUR_X86
+/*******************************************************************************
+* FUNCTION: bits_word_sse2
+* PURPOSE: bits_word of 64 pixels, 16 per comparison.
+*******************************************************************************/
+TARGET_SSE2
+bitword bits_word_sse2(unsigned char *src, unsigned char value)
+{
+   __m128i v = _mm_set1_epi8((char) value);
+   bitword w = 0;
+   int i;
+
+   for(i=0;i<4;i++)
+      w |= (bitword)(unsigned short) _mm_movemask_epi8(_mm_cmpeq_epi8(
+         _mm_loadu_si128((__m128i *)(src + 16*i)), v)) << (16*i);
+   return(w);
+}
+#endif
+
+/*******************************************************************************
+* FUNCTION: bits_range
+* PURPOSE: Mask of the columns [c0,c1) that fall in word k.
+*******************************************************************************/
+bitword bits_range(int k, int c0, int c1)
+{
+   int a = c0 - k*BITS_WORD, b = c1 - k*BITS_WORD;
+   bitword lo, hi;
+
+   if(a < 0) a = 0;
+   if(b > BITS_WORD) b = BITS_WORD;
+   if(a >= b) return(0);
+   lo = ~(bitword)0 << a;
+   hi = (b == BITS_WORD) ? ~(bitword)0 : ((bitword)1 << b) - 1;
+   return(lo & hi);
+}
+
+/*******************************************************************************
+* FUNCTION: bits_interior
+* PURPOSE: Mask of the columns 1 to cols-2 in word k, the ones that can be
+* edges.
+*******************************************************************************/
+bitword bits_interior(int k, int cols)
+{
+   return(bits_range(k, 1, cols-1));
+}
+
+/*******************************************************************************
+* FUNCTION: bits_near
+* PURPOSE: The bits of columns c-1, c and c+1 of a row of words words, in
+* bits 0, 1 and 2 of the result. The columns out of the image are 0.
+*******************************************************************************/
+int bits_near(bitword *row, int c, int words)
+{
+   int k = c / BITS_WORD, i = c % BITS_WORD, n;
+
+   n = (int)(row[k] >> i) & 1;
+   n <<= 1;
+   if(i > 0) n |= (int)(row[k] >> (i-1)) & 1;
+   else if(k > 0) n |= (int)(row[k-1] >> (BITS_WORD-1)) & 1;
+   if(i < BITS_WORD-1) n |= ((int)(row[k] >> (i+1)) & 1) << 2;
+   else if(k+1 < words) n |= ((int)row[k+1] & 1) << 2;
+   return(n);
+}
+
+/*******************************************************************************
+* FUNCTION: bits_ctz
+* PURPOSE: Position of the lowest set bit of w, which is not 0.
+*******************************************************************************/
+int bits_ctz(bitword w)
+{
+#if defined(__GNUC__)
+   return(__builtin_ctzll(w));
+#else
+   int n = 0;
+
+   while((w & 1) == 0){ w >>= 1; n++; }
+   return(n);
+#endif
+}
+
+/*******************************************************************************
+* FUNCTION: bits_count
+* PURPOSE: Number of set bits of a row of words words.
+*******************************************************************************/
+int bits_count(bitword *row, int words)
+{
+   int k, n = 0;
+   bitword w;
+
+   for(k=0;k<words;k++){
+      w = row[k];
+#if defined(__GNUC__)
+      n += __builtin_popcountll(w);
+#else
+      for(;w!=0;w&=w-1) n++;
+#endif
+   }
+   return(n);
+}
+
+/*******************************************************************************
+* PROCEDURE: bits_unpack
+* PURPOSE: Expand n bits to n bytes, one for the set bits and zero for the
+* others.
+*******************************************************************************/
+void bits_unpack(bitword *src, int n, unsigned char one, unsigned char zero,
+        unsigned char *dst)
+{
+   int c;
+
+   for(c=0;c<n;c++)
+      dst[c] = ((src[c/BITS_WORD] >> (c%BITS_WORD)) & 1) ? one : zero;
+}
+
+/*******************************************************************************
+* PROCEDURE: bits_expand
+* PURPOSE: Allocate bytes with the rows of the edge bit map bits, as EDGE and
+* NOEDGE pixels of an image of cols columns. A bit map of some of the words
+* of the rows (a tile of -grid) gives the columns of those words.
+*******************************************************************************/
+void bits_expand(plane *bits, plane *bytes, int cols)
+{
+   int r, c0 = bits->c0 * BITS_WORD, c1 = bits->c1 * BITS_WORD;
+
+   if(c1 > cols) c1 = cols;
+   plane_alloc(bytes, bits->r0, bits->r1, c0, c1, sizeof(unsigned char),
+      "edge bytes");
+   for(r=bits->r0;r<bits->r1;r++)
+      bits_unpack(PLANE_PTR(bits, bitword, r, bits->c0), c1-c0, EDGE, NOEDGE,
+         PLANE_PTR(bytes, unsigned char, r, c0));
+}
+//<------------------------- end bitmap.c ------------------------->
+
+//<------------------------- begin fused.c ------------------------->
+/*******************************************************************************
+* FILE: fused.c
+* Fused execution of the stages from the blur to the non-maximal suppression.
+* The strip is cut in tiles small enough for the L1/L2 caches and every tile
+* goes through all the stages before the next one is started. Each tile
+* recomputes the halo it needs from the input image, so the intermediate
+* images (tempim, smoothedim, delta_x, delta_y) never reach main memory and
+* no halo has to be exchanged between processes.
+*******************************************************************************/
+
+/*******************************************************************************
+* PROCEDURE: fused_strip
+* PURPOSE: Compute the magnitude and the nms map of rows [r0,r1) of the image
+* tile by tile. The tiles are tilerows x tilecols pixels; when tilerows is 0
+* the height is chosen from the kernel so the recomputed halo rows stay a
+* small fraction of the tile; the width is rounded up to whole words of the
+* nms bit map. dxout and dyout are optional and receive the
+* derivatives when the direction image is requested. The tiles are the tasks
+* of the thread pool.
+*******************************************************************************/
+void fused_strip(plane *img, int rows, int cols, int r0, int r1,
+        blur_kernel *bk, plane *mag, plane *nms, plane *dxout, plane *dyout)
+{
+   int th, tw, w, center = bk->center;
+   long n;
+   plane *buf;
+   fused_job job;
+
+   th = tilerows;
+   if(th <= 0) th = (4*(2*center+1) > 32) ? 4*(2*center+1) : 32;
+   tw = (tilecols > 0) ? tilecols : cols;
+   /* las teselas no comparten palabras del mapa nms (bitmap.c) */
+   tw = BITS_WORDS(tw) * BITS_WORD;
+
+   /****************************************************************************
+   * Every thread allocates its buffers once for the largest tile and reuses
+   * them for all the tiles it takes: tempim, smoothedim, dx, dy and the
+   * magnitude.
+   ****************************************************************************/
+   if((buf = (plane *) calloc(5*nthreads, sizeof(plane))) == NULL){
+      fprintf(stderr, "Error allocating the tile buffers.\n");
+      exit(1);
+   }
+   for(w=0;w<nthreads;w++){
+      n = (long)(th + 4 + 2*center) * (tw + 4);
+      plane_alloc(&buf[5*w], 0, 1, 0, n, bk->fixed ? sizeof(short int) :
+         sizeof(float), "tile tempim");
+      n = (long)(th + 4) * (tw + 4);
+      plane_alloc(&buf[5*w+1], 0, 1, 0, n, sizeof(short int),
+         "tile smoothedim");
+      plane_alloc(&buf[5*w+2], 0, 1, 0, n, sizeof(short int), "tile delta_x");
+      plane_alloc(&buf[5*w+3], 0, 1, 0, n, sizeof(short int), "tile delta_y");
+      plane_alloc(&buf[5*w+4], 0, 1, 0, n, sizeof(short int),
+         "tile magnitude");
+   }
+
+   job.img = img; job.mag = mag; job.nms = nms;
+   job.dxout = dxout; job.dyout = dyout;
+   job.rows = rows; job.cols = cols; job.r0 = r0; job.r1 = r1;
+   job.th = th; job.tw = tw; job.ntilecols = (cols + tw - 1) / tw;
+   job.bk = bk;
+   job.buf = buf;
+   pool_run(((r1 - r0 + th - 1) / th) * job.ntilecols, fused_tile, &job);
+
+   for(w=0;w<5*nthreads;w++) plane_free(&buf[w]);
+   free(buf);
+}
+
+/*******************************************************************************
+* PROCEDURE: fused_tile
+* PURPOSE: Run all the stages on tile t of fused_strip with the buffers of
+* the thread.
+*******************************************************************************/
+void fused_tile(int t, int worker, void *arg)
+{
+   fused_job *job = (fused_job *) arg;
+   int tr0, tr1, tc0, tc1, r, rows = job->rows, cols = job->cols,
+       center = job->bk->center;
+   plane *tempim, *smoothedim, *dx, *dy, *tmag;
+
+   tempim = &job->buf[5*worker];
+   smoothedim = tempim + 1;
+   dx = tempim + 2;
+   dy = tempim + 3;
+   tmag = tempim + 4;
+
+   tr0 = job->r0 + (t / job->ntilecols) * job->th;
+   tr1 = (tr0 + job->th < job->r1) ? tr0 + job->th : job->r1;
+   tc0 = (t % job->ntilecols) * job->tw;
+   tc1 = (tc0 + job->tw < cols) ? tc0 + job->tw : cols;
+
+   /* regiones de cada etapa, con el halo que pide la siguiente */
+   plane_move(tmag, tr0-1, tr1+1, tc0-1, tc1+1, rows, cols);
+   plane_move(dx, tr0-1, tr1+1, tc0-1, tc1+1, rows, cols);
+   plane_move(dy, tr0-1, tr1+1, tc0-1, tc1+1, rows, cols);
+   plane_move(smoothedim, tr0-2, tr1+2, tc0-2, tc1+2, rows, cols);
+   plane_move(tempim, smoothedim->r0-center, smoothedim->r1+center,
+      smoothedim->c0, smoothedim->c1, rows, cols);
+
+   blur_x_plane(job->img, tempim, tempim->r0, tempim->r1, tempim->c0,
+      tempim->c1, job->bk);
+   blur_y_plane(tempim, smoothedim, smoothedim->r0, smoothedim->r1,
+      smoothedim->c0, smoothedim->c1, job->bk);
+   derivative_x_plane(smoothedim, dx, dx->r0, dx->r1, dx->c0, dx->c1, cols);
+   derivative_y_plane(smoothedim, dy, dy->r0, dy->r1, dy->c0, dy->c1, rows);
+   magnitude_plane(dx, dy, tmag, tmag->r0, tmag->r1, tmag->c0, tmag->c1);
+   non_max_supp_plane(tmag, dx, dy, job->nms, tr0, tr1, tc0, tc1, rows, cols);
+
+   /* solo la magnitud (y las derivadas si se piden) salen de la tesela */
+   for(r=tr0;r<tr1;r++){
+      memcpy(PLANE_PTR(job->mag, short, r, tc0), PLANE_PTR(tmag, short, r, tc0),
+         (tc1-tc0)*sizeof(short));
+      if(job->dxout != NULL){
+         memcpy(PLANE_PTR(job->dxout, short, r, tc0),
+            PLANE_PTR(dx, short, r, tc0), (tc1-tc0)*sizeof(short));
+         memcpy(PLANE_PTR(job->dyout, short, r, tc0),
+            PLANE_PTR(dy, short, r, tc0), (tc1-tc0)*sizeof(short));
+      }
+   }
+}
+//<------------------------- end fused.c ------------------------->
+
+//<------------------------- begin grid.c ------------------------->
+/*******************************************************************************
+* FILE: grid.c
+* The 2-D decomposition of -grid. The processes form a Cartesian grid of
+* tiles, so each one exchanges halos as long as the sides of its tile
+* instead of the width of the image: with P processes each row of halo of a
+* tile of a square image is about 4*sqrt(pixels/P) pixels, against 2*cols
+* for a strip, and the image can be split among more processes than it has
+* rows. Every stage keeps the halo of its output filled from the four
+* neighbours of the tile, first the left and right sides on the rows of the
+* tile and then the top and bottom sides on the whole width of the plane,
+* which carries the corners. The tiles are never thinner than the deepest
+* halo, so only the neighbours are involved; the processes that do not fit
+* in such a grid keep an empty tile.
+*******************************************************************************/
+
+/*******************************************************************************
+* FUNCTION: canny_grid
+* PURPOSE: Collective. canny_file with the tile decomposition: every process
+* reads its tile of the image (plus the columns of the x-blur window), runs
+* the stages on it and writes its tile of the edge image to outfilename, and
+* of the direction image to dirname when it is not NULL (with -sweep, one
+* edge image per pair of thresholds, see hysteresis_sweep). Returns 0 in
+* every process when the image can not be read.
+*******************************************************************************/
+int canny_grid(char *infilename, MPI_Offset offset, int rows, int cols,
+        float sigma, float tlow, float thigh, char *dirname, char *outfilename)
+{
+   int r0, r1, c0, c1,        /* tesela de este rank */
+       a, b, center, ok, allok;
+   blur_kernel bk;            /* nucleo gaussiano y tablas del blur */
+   tile_grid tg;
+   plane img, tempim, smoothedim, dx, dy, magnitude, nms, edgep, edgeb;
+
+   blur_setup(&bk, sigma, rows, cols);
+   center = bk.center;
+   tile_setup(&tg, rows, cols, center);
+   r0 = tg.r0; r1 = tg.r1;
+   c0 = tg.c0; c1 = tg.c1;
+
+   /* si un rank no pudo leer su tesela ninguno sigue */
+   phase_begin(PHASE_READ);
+   a = c0; b = c1;
+   if(r0 < r1){
+      a = (c0-center > 0) ? c0-center : 0;
+      b = (c1+center < cols) ? c1+center : cols;
+   }
+   ok = read_pgm_tile(infilename, offset, rows, cols, r0, r1, a, b, &img);
+   MPI_Allreduce(&ok, &allok, 1, MPI_INT, MPI_MIN, canny_comm);
+   phase_end(PHASE_READ);
+   if(allok == 0){
+      if(rank == 0)
+         fprintf(stderr, "Error reading the input image, %s.\n", infilename);
+      if(ok) plane_free(&img);
+      blur_free(&bk);
+      tile_free(&tg);
+      return(0);
+   }
+
+   /****************************************************************************
+   * Perform gaussian smoothing on the tile. The x-blur needs center rows
+   * above and below the tile for the y-blur, which come from the tiles
+   * above and below.
+   ****************************************************************************/
+   phase_begin(PHASE_SMOOTH);
+   tile_plane(&tempim, &tg, center, 0, rows, cols,
+      bk.fixed ? sizeof(short int) : sizeof(float), "tempim");
+   phase_begin(PHASE_BLUR_X);
+   tile_stage(STAGE_BLUR_X, &img, NULL, NULL, &tempim,
+      bk.fixed ? MPI_SHORT : MPI_FLOAT, center, 0, rows, cols, &tg, &bk);
+   phase_end(PHASE_BLUR_X);
+   plane_free(&img);
+
+   tile_plane(&smoothedim, &tg, 1, 1, rows, cols, sizeof(short int),
+      "smoothedim");
+   phase_begin(PHASE_BLUR_Y);
+   tile_stage(STAGE_BLUR_Y, &tempim, NULL, NULL, &smoothedim, MPI_SHORT, 1, 1,
+      rows, cols, &tg, &bk);
+   phase_end(PHASE_BLUR_Y);
+   plane_free(&tempim);
+   blur_free(&bk);
+   phase_end(PHASE_SMOOTH);
+
+   /****************************************************************************
+   * Compute the first derivative in the x and y directions.
+   ****************************************************************************/
+   phase_begin(PHASE_DERIV);
+   tile_plane(&dx, &tg, 0, 0, rows, cols, sizeof(short int), "delta_x");
+   tile_plane(&dy, &tg, 0, 0, rows, cols, sizeof(short int), "delta_y");
+   run_stage(STAGE_DERIV_X, &smoothedim, NULL, NULL, &dx, r0, r1, c0, c1,
+      rows, cols, NULL);
+   run_stage(STAGE_DERIV_Y, &smoothedim, NULL, NULL, &dy, r0, r1, c0, c1,
+      rows, cols, NULL);
+   plane_free(&smoothedim);
+   phase_end(PHASE_DERIV);
+
+   if(dirname != NULL) write_direction_tile(&dx, &dy, rows, cols, dirname);
+
+   /****************************************************************************
+   * Compute the magnitude of the gradient, with one pixel around the tile
+   * for the non-maximal suppression and the hysteresis.
+   ****************************************************************************/
+   phase_begin(PHASE_MAGNITUDE);
+   tile_plane(&magnitude, &tg, 1, 1, rows, cols, sizeof(short int),
+      "magnitude");
+   tile_stage(STAGE_MAGNITUDE, &dx, &dy, NULL, &magnitude, MPI_SHORT, 1, 1,
+      rows, cols, &tg, NULL);
+   phase_end(PHASE_MAGNITUDE);
+
+   /****************************************************************************
+   * Perform non-maximal suppression.
+   ****************************************************************************/
+   phase_begin(PHASE_NMS);
+   tile_bits(&nms, &tg, "nms");
+   run_stage(STAGE_NMS, &magnitude, &dx, &dy, &nms, r0, r1, c0, c1, rows,
+      cols, NULL);
+   plane_free(&dx);
+   plane_free(&dy);
+   phase_end(PHASE_NMS);
+
+   /****************************************************************************
+   * Use hysteresis to mark the edge pixels of the tile. With -sweep every
+   * pair of thresholds writes its own edge image.
+   ****************************************************************************/
+   if(sweep){
+      ok = hysteresis_sweep(&magnitude, &nms, rows, cols, NULL, &tg,
+         infilename, sigma);
+      plane_free(&magnitude);
+      plane_free(&nms);
+      tile_free(&tg);
+      return(ok);
+   }
+   tile_bits(&edgep, &tg, "edge");
+   hysteresis_strip(&magnitude, &nms, rows, cols, tlow, thigh, &edgep, NULL,
+      &tg);
+   plane_free(&magnitude);
+   plane_free(&nms);
+
+   /****************************************************************************
+   * Every process writes its tile of the edge image.
+   ****************************************************************************/
+   phase_begin(PHASE_WRITE);
+   bits_expand(&edgep, &edgeb, cols);
+   ok = write_pgm_tile(outfilename, &edgeb, rows, cols, "", 255);
+   phase_end(PHASE_WRITE);
+   if(ok == 0)
+      fprintf(stderr, "Error writing the edge image, %s.\n", outfilename);
+   plane_free(&edgeb);
+   plane_free(&edgep);
+   tile_free(&tg);
+   return(ok);
+}
+
+/*******************************************************************************
+* PROCEDURE: tile_setup
+* PURPOSE: Collective. Build the grid of tiles of an image of rows x cols
+* whose stages have halos of up to halo rows. Among the grids of at most
+* size tiles, each at least halo rows high (when there is more than one row
+* of tiles) and 64 columns wide, the one with most tiles is taken, and among
+* those the one whose tiles have the shortest perimeter. The boundaries of
+* the columns are multiples of 64.
+*******************************************************************************/
+void tile_setup(tile_grid *tg, int rows, int cols, int halo)
+{
+   int py, px, q, trank, words = BITS_WORDS(cols), periods[2] = {0, 0};
+   double cost, best;
+
+   tg->dims[0] = tg->dims[1] = 1;
+   best = (double)rows + cols;
+   for(py=1;(py<=size)&&(py<=rows);py++){
+      /* las teselas son mas bajas cuanto mas filas de teselas */
+      if((py > 1) && (rows/py < halo)) break;
+      px = (size/py < words) ? size/py : words;
+      cost = (double)rows/py + (double)cols/px;
+      if((py*px > tg->dims[0]*tg->dims[1]) ||
+         ((py*px == tg->dims[0]*tg->dims[1]) && (cost < best))){
+         tg->dims[0] = py;
+         tg->dims[1] = px;
+         best = cost;
+      }
+   }
+#if !PRODUCTION
+   if(rank == 0) printf("   Tile grid: %d x %d.\n", tg->dims[0], tg->dims[1]);
+#endif
+   if((rank == 0) && (tg->dims[0]*tg->dims[1] < size))
+      fprintf(stderr, "The tile grid leaves %d processes idle.\n",
+         size - tg->dims[0]*tg->dims[1]);
+
+   if(((tg->rowstart = (int *) calloc(tg->dims[0]+1, sizeof(int))) == NULL) ||
+      ((tg->colstart = (int *) calloc(tg->dims[1]+1, sizeof(int))) == NULL)){
+      fprintf(stderr, "Error allocating the tile grid.\n");
+      exit(1);
+   }
+   make_partition(rows, tg->dims[0], tg->rowstart);
+   make_partition(words, tg->dims[1], tg->colstart);
+   for(q=0;q<=tg->dims[1];q++){
+      tg->colstart[q] *= BITS_WORD;
+      if(tg->colstart[q] > cols) tg->colstart[q] = cols;
+   }
+
+   /* los ranks de la malla son los de canny_comm */
+   MPI_Cart_create(canny_comm, 2, tg->dims, periods, 0, &tg->comm);
+   if(tg->comm == MPI_COMM_NULL){
+      tg->coords[0] = tg->coords[1] = -1;
+      tg->north = tg->south = tg->west = tg->east = MPI_PROC_NULL;
+      tg->r0 = tg->r1 = tg->c0 = tg->c1 = 0;
+      return;
+   }
+   MPI_Comm_rank(tg->comm, &trank);
+   MPI_Cart_coords(tg->comm, trank, 2, tg->coords);
+   MPI_Cart_shift(tg->comm, 0, 1, &tg->north, &tg->south);
+   MPI_Cart_shift(tg->comm, 1, 1, &tg->west, &tg->east);
+   tg->r0 = tg->rowstart[tg->coords[0]];
+   tg->r1 = tg->rowstart[tg->coords[0]+1];
+   tg->c0 = tg->colstart[tg->coords[1]];
+   tg->c1 = tg->colstart[tg->coords[1]+1];
+}
+
+/*******************************************************************************
+* PROCEDURE: tile_free
+* PURPOSE: Free the communicator and the boundaries of a grid of tiles.
+*******************************************************************************/
+void tile_free(tile_grid *tg)
+{
+   if(tg->comm != MPI_COMM_NULL) MPI_Comm_free(&tg->comm);
+   free(tg->rowstart);
+   free(tg->colstart);
+}
+
+/*******************************************************************************
+* PROCEDURE: tile_plane
+* PURPOSE: Allocate the plane of the tile of this process with hr halo rows
+* above and below and hc halo columns at each side, clipped to the image. An
+* empty tile stores no pixels.
+*******************************************************************************/
+void tile_plane(plane *p, tile_grid *tg, int hr, int hc, int rows, int cols,
+        size_t elsize, char *name)
+{
+   if((tg->r0 == tg->r1) || (tg->c0 == tg->c1))
+      plane_alloc(p, tg->r0, tg->r1, tg->c0, tg->c1, elsize, name);
+   else plane_alloc(p, (tg->r0-hr > 0) ? tg->r0-hr : 0,
+      (tg->r1+hr < rows) ? tg->r1+hr : rows, (tg->c0-hc > 0) ? tg->c0-hc : 0,
+      (tg->c1+hc < cols) ? tg->c1+hc : cols, elsize, name);
+}
+
+/*******************************************************************************
+* PROCEDURE: tile_bits
+* PURPOSE: Allocate a bit map (see bitmap.c) of the tile of this process: the
+* words of its columns, without halo.
+*******************************************************************************/
+void tile_bits(plane *p, tile_grid *tg, char *name)
+{
+   plane_alloc(p, tg->r0, tg->r1, tg->c0 / BITS_WORD, BITS_WORDS(tg->c1),
+      sizeof(bitword), name);
+}
+
+/*******************************************************************************
+* PROCEDURE: exchange_tile_cols
+* PURPOSE: Fill the hc halo columns at each side of a tile plane, on the rows
+* of the tile, with the columns of the tiles to the left and to the right,
+* and send them the columns of this tile that fall in their halos.
+*******************************************************************************/
+void exchange_tile_cols(plane *p, MPI_Datatype type, int hc, tile_grid *tg)
+{
+   MPI_Request reqs[4];
+   MPI_Datatype side;          /* hc columnas de las filas de la tesela */
+   int nreq = 0, elsize, stride;
+   char *row;
+
+   if((hc == 0) || (tg->comm == MPI_COMM_NULL)) return;
+   MPI_Type_size(type, &elsize);
+   stride = p->c1 - p->c0;
+   MPI_Type_vector(tg->r1 - tg->r0, hc, stride, type, &side);
+   MPI_Type_commit(&side);
+   row = (char *) p->data + (long)(tg->r0 - p->r0) * stride * elsize;
+   if(tg->west != MPI_PROC_NULL){
+      MPI_Irecv(row + (long)(tg->c0 - hc - p->c0) * elsize, 1, side, tg->west,
+         0, tg->comm, &reqs[nreq++]);
+      MPI_Isend(row + (long)(tg->c0 - p->c0) * elsize, 1, side, tg->west, 0,
+         tg->comm, &reqs[nreq++]);
+   }
+   if(tg->east != MPI_PROC_NULL){
+      MPI_Irecv(row + (long)(tg->c1 - p->c0) * elsize, 1, side, tg->east, 0,
+         tg->comm, &reqs[nreq++]);
+      MPI_Isend(row + (long)(tg->c1 - hc - p->c0) * elsize, 1, side, tg->east,
+         0, tg->comm, &reqs[nreq++]);
+   }
+   MPI_Waitall(nreq, reqs, MPI_STATUSES_IGNORE);
+   MPI_Type_free(&side);
+}
+
+/*******************************************************************************
+* FUNCTION: exchange_tile_rows_start
+* PURPOSE: Start the messages that fill the hr halo rows above and below a
+* tile plane with the rows of the tiles above and below, and send them the
+* rows of this tile that fall in their halos, in reqs, room for 4. Returns
+* how many there are. The rows go with the whole width of the plane, so once
+* the halo columns are filled (exchange_tile_cols) they carry the corners.
+*******************************************************************************/
+int exchange_tile_rows_start(plane *p, MPI_Datatype type, int hr,
+        tile_grid *tg, MPI_Request *reqs)
+{
+   int nreq = 0, elsize, stride;
+   char *base = (char *) p->data;
+
+   if((hr == 0) || (tg->comm == MPI_COMM_NULL)) return(0);
+   MPI_Type_size(type, &elsize);
+   stride = p->c1 - p->c0;
+   if(tg->north != MPI_PROC_NULL){
+      MPI_Irecv(base, (tg->r0 - p->r0) * stride, type, tg->north, 0, tg->comm,
+         &reqs[nreq++]);
+      MPI_Isend(base + (long)(tg->r0 - p->r0) * stride * elsize, hr * stride,
+         type, tg->north, 0, tg->comm, &reqs[nreq++]);
+   }
+   if(tg->south != MPI_PROC_NULL){
+      MPI_Irecv(base + (long)(tg->r1 - p->r0) * stride * elsize,
+         (p->r1 - tg->r1) * stride, type, tg->south, 0, tg->comm,
+         &reqs[nreq++]);
+      MPI_Isend(base + (long)(tg->r1 - hr - p->r0) * stride * elsize,
+         hr * stride, type, tg->south, 0, tg->comm, &reqs[nreq++]);
+   }
+   return(nreq);
+}
+
+/*******************************************************************************
+* PROCEDURE: exchange_tile_halo
+* PURPOSE: Fill the halo of a tile plane, hr rows and hc columns deep, with
+* the pixels of the eight neighbouring tiles.
+*******************************************************************************/
+void exchange_tile_halo(plane *p, MPI_Datatype type, int hr, int hc,
+        tile_grid *tg)
+{
+   MPI_Request reqs[4];
+   int nreq;
+
+   exchange_tile_cols(p, type, hc, tg);
+   nreq = exchange_tile_rows_start(p, type, hr, tg, reqs);
+   MPI_Waitall(nreq, reqs, MPI_STATUSES_IGNORE);
+}
+
+/*******************************************************************************
+* PROCEDURE: tile_stage
+* PURPOSE: Run stage op on the tile of this process, as run_stage, and fill
+* the halo of the output plane, hr rows and hc columns deep, as
+* exchange_tile_halo, overlapping the rows of the halo with the interior of
+* the tile, as overlap_stage does for strips. The sides of the tile are
+* computed first; the left and right halos, which are short, are exchanged
+* at once and the messages of the top and bottom halos travel while the
+* interior is computed in PIPE_CHUNKS pieces.
+*******************************************************************************/
+void tile_stage(int op, plane *in, plane *in2, plane *in3, plane *out,
+        MPI_Datatype type, int hr, int hc, int rows, int cols, tile_grid *tg,
+        blur_kernel *bk)
+{
+   MPI_Request reqs[4];
+   int r0 = tg->r0, r1 = tg->r1, c0 = tg->c0, c1 = tg->c1;
+   int nreq, k, a, b, flag;
+
+   if(tg->comm == MPI_COMM_NULL) return;
+   if((r1 - r0 <= 2*hr) || (c1 - c0 <= 2*hc)){
+      /* en una tesela pequenia todo va a los vecinos */
+      run_stage(op, in, in2, in3, out, r0, r1, c0, c1, rows, cols, bk);
+      phase_begin(PHASE_HALO);
+      exchange_tile_cols(out, type, hc, tg);
+      phase_end(PHASE_HALO);
+      nreq = exchange_tile_rows_start(out, type, hr, tg, reqs);
+   }
+   else{
+      run_stage(op, in, in2, in3, out, r0, r0+hr, c0, c1, rows, cols, bk);
+      run_stage(op, in, in2, in3, out, r1-hr, r1, c0, c1, rows, cols, bk);
+      if(hc > 0){
+         run_stage(op, in, in2, in3, out, r0+hr, r1-hr, c0, c0+hc, rows, cols,
+            bk);
+         run_stage(op, in, in2, in3, out, r0+hr, r1-hr, c1-hc, c1, rows, cols,
+            bk);
+      }
+      phase_begin(PHASE_HALO);
+      exchange_tile_cols(out, type, hc, tg);
+      phase_end(PHASE_HALO);
+      nreq = exchange_tile_rows_start(out, type, hr, tg, reqs);
+      for(k=0;k<PIPE_CHUNKS;k++){
+         a = r0 + hr + (int)((long)k * (r1-r0-2*hr) / PIPE_CHUNKS);
+         b = r0 + hr + (int)((long)(k+1) * (r1-r0-2*hr) / PIPE_CHUNKS);
+         run_stage(op, in, in2, in3, out, a, b, c0+hc, c1-hc, rows, cols, bk);
+         MPI_Testall(nreq, reqs, &flag, MPI_STATUSES_IGNORE);
+      }
+   }
+   phase_begin(PHASE_HALO);
+   MPI_Waitall(nreq, reqs, MPI_STATUSES_IGNORE);
+   phase_end(PHASE_HALO);
+}
+
+/*******************************************************************************
+* PROCEDURE: write_direction_tile
+* PURPOSE: Every process computes the direction of the gradient of its tile
+* and writes it at its place in the direction image, as
+* write_direction_strips.
+*******************************************************************************/
+void write_direction_tile(plane *dx, plane *dy, int rows, int cols,
+        char *fname)
+{
+   MPI_File fh;
+   int n;
+   float *dir_radians=NULL;   /* Gradient direction image.                */
+
+   phase_begin(PHASE_DIRECTION);
+   radian_direction((short *) dx->data, (short *) dy->data, dx->r1 - dx->r0,
+      dx->c1 - dx->c0, &dir_radians, -1, -1);
+   if(MPI_File_open(canny_comm, fname, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+      MPI_INFO_NULL, &fh) != MPI_SUCCESS){
+      fprintf(stderr, "Error opening the file %s for writing.\n", fname);
+      exit(1);
+   }
+   MPI_File_set_size(fh, 0);
+   n = tile_view(fh, 0, dx, rows, cols, MPI_FLOAT);
+   MPI_File_write_all(fh, dir_radians, n, MPI_FLOAT, MPI_STATUS_IGNORE);
+   MPI_File_close(&fh);
+   free(dir_radians);
+   phase_end(PHASE_DIRECTION);
+}
+//<------------------------- end grid.c ------------------------->
+
+//<------------------------- begin scales.c ------------------------->
+/*******************************************************************************
+* FILE: scales.c
+* The scale space of -scales: the edges of one image for a list of
+* increasing sigmas, read and split among the processes once. The blur of a
+* gaussian of sigma s1 followed by one of sqrt(s2^2 - s1^2) is a gaussian of
+* s2, so every scale blurs the smoothed image of the one before with that
+* smaller kernel instead of blurring the pixels again with the whole kernel
+* of s2. The smoothed image keeps its 1/BOOSTBLURFACTOR grey levels between
+* scales. The cascade is not identical to a run with s2: the kernels are
+* cut at 2.5 sigma and renormalised at the borders at each step, and the
+* smoothed image is rounded after each one. With sigmas 1,2,4,8 on a
+* 437x301 photograph, 97%, 86% and 82% of the edges of the scales 2, 4 and
+* 8 lie within a pixel of an edge of a run with that sigma, about what a
+* change of 1% in sigma gives. On a 2048x2048 image with 4 processes the
+* four scales run in about 40% of the wall time of four separate runs.
+*******************************************************************************/
+
+/*******************************************************************************
+* FUNCTION: canny_scales
+* PURPOSE: Collective. canny_halo for every sigma of scale_sigma, on the
+* strips of img. Each scale writes its edge image (and its direction image
+* with writedir) named after infilename and its sigma, or with -sweep one
+* per pair of thresholds; with -combine the edges of all the scales are
+* also written together, to the image named after the first and the last
+* sigma. Returns 0 when an image can not be written.
+*******************************************************************************/
+int canny_scales(plane *img, int rows, int cols, int *rowstart, float tlow,
+        float thigh, int writedir, char *infilename)
+{
+   int i, j, n, ok;
+   float sigma;
+   blur_kernel bk;
+   plane prev, smoothedim, magnitude, nms, edgep, combp;
+   bitword *e, *u;
+   char outfilename[BATCH_NAMELEN+64];    /* edge image of the scale */
+   char composedfname[BATCH_NAMELEN+64];  /* direction image of the scale */
+
+   ok = 1;
+   n = (rowstart[rank+1] - rowstart[rank]) * BITS_WORDS(cols);
+   if(scale_combine){
+      strip_plane(&combp, rowstart, 0, rows, BITS_WORDS(cols),
+         sizeof(bitword), "combined");
+      plane_clear(&combp, sizeof(bitword));
+   }
+   for(i=0;i<scale_n;i++){
+      /*************************************************************************
+      * The first scale blurs the pixels, the others the scale before.
+      *************************************************************************/
+      sigma = scale_sigma[i];
+      if(i == 0) blur_setup(&bk, sigma, rows, cols);
+      else blur_cascade_setup(&bk, sqrt(sigma*sigma -
+         scale_sigma[i-1]*scale_sigma[i-1]), rows, cols);
+      smooth_strip((i == 0) ? img : &prev, rows, cols, rowstart, &bk,
+         &smoothedim);
+      blur_free(&bk);
+      if(i > 0) plane_free(&prev);
+
+      snprintf(composedfname, sizeof(composedfname),
+         "%s_s_%3.2f_l_%3.2f_h_%3.2f.fim", infilename, sigma, tlow, thigh);
+      gradient_strip(&smoothedim, rows, cols, rowstart,
+         writedir ? composedfname : NULL, &magnitude, &nms);
+      /* la siguiente escala parte de esta */
+      if(i+1 < scale_n) prev = smoothedim;
+      else plane_free(&smoothedim);
+
+      /*************************************************************************
+      * Use hysteresis to mark the edge pixels of the scale.
+      *************************************************************************/
+      if(sweep){
+         if(hysteresis_sweep(&magnitude, &nms, rows, cols, rowstart, NULL,
+            infilename, sigma) == 0) ok = 0;
+      }
+      else{
+         strip_plane(&edgep, rowstart, 0, rows, BITS_WORDS(cols),
+            sizeof(bitword), "edge");
+         hysteresis_strip(&magnitude, &nms, rows, cols, tlow, thigh, &edgep,
+            rowstart, NULL);
+         if(scale_combine){
+            e = (bitword *) edgep.data;
+            u = (bitword *) combp.data;
+            for(j=0;j<n;j++) u[j] |= e[j];
+         }
+         snprintf(outfilename, sizeof(outfilename),
+            "%s_s_%3.2f_l_%3.2f_h_%3.2f.pgm", infilename, sigma, tlow, thigh);
+         if(write_edge_strip(&edgep, rows, cols, outfilename) == 0) ok = 0;
+         plane_free(&edgep);
+      }
+      plane_free(&magnitude);
+      plane_free(&nms);
+   }
+
+   if(scale_combine){
+      snprintf(outfilename, sizeof(outfilename),
+         "%s_s_%3.2f-%3.2f_l_%3.2f_h_%3.2f.pgm", infilename, scale_sigma[0],
+         scale_sigma[scale_n-1], tlow, thigh);
+      if(write_edge_strip(&combp, rows, cols, outfilename) == 0) ok = 0;
+      plane_free(&combp);
+   }
+   return(ok);
+}
+//<------------------------- end scales.c ------------------------->
+
+//<------------------------- begin pool.c ------------------------->
+/*******************************************************************************
+* FILE: pool.c
+* Pool of threads inside each process (-threads N), so a node can run one
+* process with N threads instead of N processes, with one copy of the images
+* and one participant in the collectives. Only the main thread calls MPI.
+* The work of a stage is split in tasks (bands of rows or tiles). Every
+* thread starts with a contiguous range of the tasks and takes them from its
+* front; a thread that runs out steals the back half of the range of the
+* busiest thread, so uneven tasks (dense edges, fallback pixels) do not leave
+* threads idle. Link with -pthread.
+*******************************************************************************/
+
+/* rango de tareas pendientes de cada hilo */
+typedef struct {
+   pthread_mutex_t lock;
+   int next, end;
+} pool_queue;
+
+pthread_t *pool_threads = NULL;
+pool_queue *pool_queues = NULL;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+int pool_gen = 0, pool_busy = 0, pool_quit = 0;
+void (*pool_task)(int task, int worker, void *arg) = NULL;
+void *pool_arg = NULL;
+
+/*******************************************************************************
+* PROCEDURE: pool_start
+* PURPOSE: Start the nthreads-1 worker threads; the main thread is worker 0.
+*******************************************************************************/
+void pool_start(void)
+{
+   long w;
+
+   if(nthreads < 1) nthreads = 1;
+   if((pool_queues = (pool_queue *) calloc(nthreads, sizeof(pool_queue)))
+      == NULL){
+      fprintf(stderr, "Error allocating the thread pool.\n");
+      exit(1);
+   }
+   for(w=0;w<nthreads;w++) pthread_mutex_init(&pool_queues[w].lock, NULL);
+   if(nthreads == 1) return;
+   if((pool_threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t)))
+      == NULL){
+      fprintf(stderr, "Error allocating the thread pool.\n");
+      exit(1);
+   }
+   for(w=1;w<nthreads;w++){
+      if(pthread_create(&pool_threads[w], NULL, pool_main, (void *)w) != 0){
+         fprintf(stderr, "Error creating the thread %ld.\n", w);
+         exit(1);
+      }
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: pool_stop
+* PURPOSE: Finish the worker threads.
+*******************************************************************************/
+void pool_stop(void)
+{
+   int w;
+
+   if(pool_threads != NULL){
+      pthread_mutex_lock(&pool_lock);
+      pool_quit = 1;
+      pthread_cond_broadcast(&pool_wake);
+      pthread_mutex_unlock(&pool_lock);
+      for(w=1;w<nthreads;w++) pthread_join(pool_threads[w], NULL);
+      free(pool_threads);
+   }
+   for(w=0;w<nthreads;w++) pthread_mutex_destroy(&pool_queues[w].lock);
+   free(pool_queues);
+}
+
+/*******************************************************************************
+* FUNCTION: pool_main
+* PURPOSE: Body of a worker thread: wait for a job, work on it, repeat.
+*******************************************************************************/
+void *pool_main(void *arg)
+{
+   int w = (int)(long)arg, gen = 0;
+
+   pthread_mutex_lock(&pool_lock);
+   for(;;){
+      while((pool_gen == gen) && !pool_quit)
+         pthread_cond_wait(&pool_wake, &pool_lock);
+      if(pool_quit) break;
+      gen = pool_gen;
+      pthread_mutex_unlock(&pool_lock);
+      pool_work(w);
+      pthread_mutex_lock(&pool_lock);
+      if(--pool_busy == 0) pthread_cond_signal(&pool_done);
+   }
+   pthread_mutex_unlock(&pool_lock);
+   return(NULL);
+}
+
+/*******************************************************************************
+* FUNCTION: pool_take
+* PURPOSE: Next task of worker w, from its own range or stolen from the
+* largest range of the others. Returns -1 when no task is left.
+*******************************************************************************/
+int pool_take(int w)
+{
+   pool_queue *q = &pool_queues[w], *v;
+   int t, i, best, left, n;
+
+   pthread_mutex_lock(&q->lock);
+   t = (q->next < q->end) ? q->next++ : -1;
+   pthread_mutex_unlock(&q->lock);
+
+   while(t < 0){
+      /* la victima es el hilo con mas tareas pendientes */
+      best = -1;
+      left = 0;
+      for(i=1;i<nthreads;i++){
+         v = &pool_queues[(w+i) % nthreads];
+         pthread_mutex_lock(&v->lock);
+         n = v->end - v->next;
+         pthread_mutex_unlock(&v->lock);
+         if(n > left){
+            left = n;
+            best = (w+i) % nthreads;
+         }
+      }
+      if(best < 0) return(-1);
+
+      v = &pool_queues[best];
+      pthread_mutex_lock(&v->lock);
+      n = (v->end - v->next + 1) / 2;
+      if(n > 0){
+         v->end -= n;
+         t = v->end;
+      }
+      pthread_mutex_unlock(&v->lock);
+      if(n > 1){
+         pthread_mutex_lock(&q->lock);
+         q->next = t+1;
+         q->end = t+n;
+         pthread_mutex_unlock(&q->lock);
+      }
+   }
+   return(t);
+}
+
+/*******************************************************************************
+* PROCEDURE: pool_work
+* PURPOSE: Run tasks of the current job until none is left.
+*******************************************************************************/
+void pool_work(int w)
+{
+   int t;
+
+   while((t = pool_take(w)) >= 0) pool_task(t, w, pool_arg);
+}
+
+/*******************************************************************************
+* PROCEDURE: pool_run
+* PURPOSE: Run task(t, worker, arg) for t in [0,ntasks) on the threads of the
+* pool and wait for all of them. Worker is the index of the thread, so a
+* task can use per-thread buffers.
+*******************************************************************************/
+void pool_run(int ntasks, void (*task)(int t, int worker, void *arg),
+        void *arg)
+{
+   int w, t;
+
+   if((nthreads == 1) || (ntasks <= 1)){
+      for(t=0;t<ntasks;t++) task(t, 0, arg);
+      return;
+   }
+   for(w=0;w<nthreads;w++){
+      pthread_mutex_lock(&pool_queues[w].lock);
+      pool_queues[w].next = (int)((long)w * ntasks / nthreads);
+      pool_queues[w].end = (int)((long)(w+1) * ntasks / nthreads);
+      pthread_mutex_unlock(&pool_queues[w].lock);
+   }
+
+   pthread_mutex_lock(&pool_lock);
+   pool_task = task;
+   pool_arg = arg;
+   pool_busy = nthreads - 1;
+   pool_gen++;
+   pthread_cond_broadcast(&pool_wake);
+   pthread_mutex_unlock(&pool_lock);
+
+   pool_work(0);
+
+   pthread_mutex_lock(&pool_lock);
+   while(pool_busy > 0) pthread_cond_wait(&pool_done, &pool_lock);
+   pthread_mutex_unlock(&pool_lock);
+}
+
+/*******************************************************************************
+* FUNCTION: pool_bands
+* PURPOSE: Number of bands of rows [r0,r1) for the pool: several per thread
+* so they can be stolen, of at least minrows rows.
+*******************************************************************************/
+int pool_bands(int r0, int r1, int minrows)
+{
+   int n = 8 * nthreads;
+
+   if(nthreads == 1) return((r1 > r0) ? 1 : 0);
+   if(minrows < 1) minrows = 1;
+   if((r1-r0) / minrows < n) n = (r1-r0) / minrows;
+   return((n < 1) ? ((r1 > r0) ? 1 : 0) : n);
+}
+
+/*******************************************************************************
+* PROCEDURE: stage_task
+* PURPOSE: Task of run_stage: band t of the rows of the stage.
+*******************************************************************************/
+void stage_task(int t, int worker, void *arg)
+{
+   stage_job *job = (stage_job *) arg;
+   int r0, r1;
+
+   (void)worker;              /* las etapas no usan buffers por hilo */
+   r0 = job->r0 + (int)((long)t * (job->r1 - job->r0) / job->nbands);
+   r1 = job->r0 + (int)((long)(t+1) * (job->r1 - job->r0) / job->nbands);
+   switch(job->op){
+      case STAGE_BLUR_X:
+         blur_x_plane(job->in, job->out, r0, r1, job->c0, job->c1, job->bk);
+         break;
+      case STAGE_BLUR_Y:
+         blur_y_plane(job->in, job->out, r0, r1, job->c0, job->c1, job->bk);
+         break;
+      case STAGE_DERIV_X:
+         derivative_x_plane(job->in, job->out, r0, r1, job->c0, job->c1,
+            job->cols);
+         break;
+      case STAGE_DERIV_Y:
+         derivative_y_plane(job->in, job->out, r0, r1, job->c0, job->c1,
+            job->rows);
+         break;
+      case STAGE_MAGNITUDE:
+         magnitude_plane(job->in, job->in2, job->out, r0, r1, job->c0,
+            job->c1);
+         break;
+      case STAGE_NMS:
+         non_max_supp_plane(job->in, job->in2, job->in3, job->out, r0, r1,
+            job->c0, job->c1, job->rows, job->cols);
+         break;
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: run_stage
+* PURPOSE: Run stage op on rows [r0,r1) and columns [c0,c1), split in bands
+* of rows among the threads. The inputs and the output are those of the
+* plane routine of the stage (in2 and in3 are the other inputs of the
+* magnitude and the suppression).
+*******************************************************************************/
+void run_stage(int op, plane *in, plane *in2, plane *in3, plane *out, int r0,
+        int r1, int c0, int c1, int rows, int cols, blur_kernel *bk)
+{
+   stage_job job;
+
+   job.op = op;
+   job.in = in; job.in2 = in2; job.in3 = in3; job.out = out;
+   job.r0 = r0; job.r1 = r1; job.c0 = c0; job.c1 = c1;
+   job.rows = rows; job.cols = cols;
+   job.bk = bk;
+   job.nbands = pool_bands(r0, r1, 4);
+   pool_run(job.nbands, stage_task, &job);
+}
+//<------------------------- end pool.c ------------------------->
+
+//<------------------------- begin batch.c ------------------------->
+/*******************************************************************************
+* The batch mode detects the edges of many images in one job. Process 0 is the
+* master: it reads the header of every image, decides how many processes each
+* one needs (one for the images up to 2*batch_pixels pixels, and a power of
+* two for the larger ones, so that each gets at least batch_pixels pixels) and
+* hands the images out on demand. The other processes run the images in
+* phases, from the largest groups to the smallest: in each phase they split
+* into groups of that size, and the first process of each group asks the
+* master for the next image of the phase, broadcasts it to its group and
+* returns the time the group took. Within a group canny_comm is the group, so
+* every image runs the -halo (or -fused) pipeline unchanged.
+*******************************************************************************/
+
+/*******************************************************************************
+* PROCEDURE: batch_run
+* PURPOSE: Collective. Detect the edges of every image of listname, a file
+* with one image per line or a directory, and report the time of each image
+* and the throughput of the job. The standard output of the workers is
+* discarded, since their per stage messages would drown the report.
+*******************************************************************************/
+void batch_run(char *listname, float sigma, float tlow, float thigh)
+{
+   double tini, tfin;
+   FILE *fp;
+   int wrank = rank, wsize = size;   /* rank y procesos de MPI_COMM_WORLD */
+   int n = 0, i, lo, hi, p, nphases = 0, nfail, *phases = NULL;
+   batch_item *items = NULL;
+   MPI_Comm workers, group;
+
+   tini = MPI_Wtime ();
+   if(wrank == 0){
+      /* la cabecera de cada imagen da el tamanio de su grupo */
+      n = batch_list(listname, &items);
+      for(i=0;i<n;i++){
+         items[i].ranks = 0;
+         items[i].time = -1.0;
+         if((fp = fopen(items[i].name, "rb")) == NULL){
+            fprintf(stderr, "Error reading the file %s in batch_run().\n",
+               items[i].name);
+            continue;
+         }
+         if(read_pgm_header(fp, items[i].name, &items[i].rows,
+            &items[i].cols))
+            items[i].ranks = batch_ranks((long)items[i].rows * items[i].cols,
+               (wsize > 1) ? wsize-1 : 1);
+         fclose(fp);
+      }
+      qsort(items, n, sizeof(batch_item), compare_batch);
+      if((phases = (int *) calloc(n+1, sizeof(int))) == NULL){
+         fprintf(stderr, "Error allocating the batch phases.\n");
+         exit(1);
+      }
+      for(i=0;i<n;i++){
+         if(items[i].ranks == 0) batch_report(&items[i]);
+         else if((nphases == 0) || (phases[nphases-1] != items[i].ranks))
+            phases[nphases++] = items[i].ranks;
+      }
+   }
+
+   if(wsize == 1){
+      /* sin otros procesos el maestro procesa las imagenes */
+      node_setup();
+      for(i=0;i<n;i++){
+         if(items[i].ranks == 0) continue;
+         tfin = MPI_Wtime ();
+         if(canny_file(items[i].name, sigma, tlow, thigh, 0, &items[i].rows,
+            &items[i].cols)) items[i].time = MPI_Wtime () - tfin;
+         batch_report(&items[i]);
+      }
+      node_free();
+   }
+   else{
+      MPI_Comm_split(MPI_COMM_WORLD, (wrank == 0) ? MPI_UNDEFINED : 0, wrank,
+         &workers);
+      if((wrank != 0) && (freopen("/dev/null", "w", stdout) == NULL))
+         fprintf(stderr, "Error discarding the output of the rank %d.\n",
+            wrank);
+      MPI_Bcast(&nphases, 1, MPI_INT, 0, MPI_COMM_WORLD);
+      if((wrank != 0) &&
+         ((phases = (int *) calloc(nphases+1, sizeof(int))) == NULL)){
+         fprintf(stderr, "Error allocating the batch phases.\n");
+         exit(1);
+      }
+      MPI_Bcast(phases, nphases, MPI_INT, 0, MPI_COMM_WORLD);
+
+      lo = 0;
+      for(p=0;p<nphases;p++){
+         if(wrank == 0){
+            for(hi=lo;(hi<n)&&(items[hi].ranks==phases[p]);hi++);
+            batch_serve(items, lo, hi, (wsize-1 + phases[p]-1) / phases[p]);
+            lo = hi;
+         }
+         else{
+            /* grupos de phases[p] procesos consecutivos */
+            MPI_Comm_split(workers, (wrank-1) / phases[p], wrank, &group);
+            canny_comm = group;
+            MPI_Comm_rank(group, &rank);
+            MPI_Comm_size(group, &size);
+            node_setup();
+            batch_work(sigma, tlow, thigh);
+            node_free();
+            balance_nparts = 0;        /* otro grupo, otras velocidades */
+            canny_comm = MPI_COMM_WORLD;
+            rank = wrank;
+            size = wsize;
+            MPI_Comm_free(&group);
+         }
+      }
+      if(wrank != 0) MPI_Comm_free(&workers);
+   }
+
+   if(wrank == 0){
+      tfin = MPI_Wtime ();
+      for(i=0,nfail=0;i<n;i++) if(items[i].time < 0.0) nfail++;
+      printf ("-----------------------------\nImagenes: %d (%d con errores)\n",
+         n, nfail);
+      printf ("Demoro: %f\n", tfin-tini);
+      printf ("Imagenes por segundo: %f\n",
+         (tfin > tini) ? (n-nfail) / (tfin-tini) : 0.0);
+      for(i=0;i<n;i++) free(items[i].name);
+      free(items);
+   }
+   free(phases);
+}
+
+/*******************************************************************************
+* FUNCTION: batch_list
+* PURPOSE: Return in items the images of listname and their number. listname
+* is either a directory, whose PGM images are taken in alphabetical order
+* (except the edge images written by a previous run), or a file with the name
+* of one image per line; empty lines and lines starting with # are skipped.
+*******************************************************************************/
+int batch_list(char *listname, batch_item **items)
+{
+   DIR *dir;
+   struct dirent *entry;
+   FILE *fp = NULL;
+   char buf[BATCH_NAMELEN], *name;
+   int n = 0, max = 1024, len;
+
+   if((*items = (batch_item *) calloc(max, sizeof(batch_item))) == NULL){
+      fprintf(stderr, "Error allocating the batch list.\n");
+      exit(1);
+   }
+   if(((dir = opendir(listname)) == NULL) &&
+      ((fp = fopen(listname, "r")) == NULL)){
+      fprintf(stderr, "Error reading the batch list %s.\n", listname);
+      return(0);
+   }
+   while(1){
+      if(dir != NULL){
+         if((entry = readdir(dir)) == NULL) break;
+         len = strlen(entry->d_name);
+         if((len < 5) || (strcmp(entry->d_name+len-4, ".pgm") != 0) ||
+            (strstr(entry->d_name, "_s_") && strstr(entry->d_name, "_l_") &&
+             strstr(entry->d_name, "_h_"))) continue;
+         if(strlen(listname) + len + 2 > BATCH_NAMELEN) continue;
+         sprintf(buf, "%s/%s", listname, entry->d_name);
+      }
+      else{
+         if(fgets(buf, BATCH_NAMELEN, fp) == NULL) break;
+         buf[strcspn(buf, "\r\n")] = '\0';
+         if((buf[0] == '\0') || (buf[0] == '#')) continue;
+      }
+      if(n == max){
+         max *= 2;
+         if((*items = (batch_item *) realloc(*items,
+            max * sizeof(batch_item))) == NULL){
+            fprintf(stderr, "Error allocating the batch list.\n");
+            exit(1);
+         }
+      }
+      if((name = (char *) malloc(strlen(buf)+1)) == NULL){
+         fprintf(stderr, "Error allocating the batch list.\n");
+         exit(1);
+      }
+      strcpy(name, buf);
+      (*items)[n].name = name;
+      (*items)[n].rows = (*items)[n].cols = (*items)[n].ranks = 0;
+      n++;
+   }
+   if(dir != NULL){
+      closedir(dir);
+      /* el orden de readdir depende del sistema de archivos */
+      qsort(*items, n, sizeof(batch_item), compare_batch);
+   }
+   else fclose(fp);
+   return(n);
+}
+
+/*******************************************************************************
+* FUNCTION: batch_ranks
+* PURPOSE: Return the processes that detect the edges of an image of pixels
+* pixels: the largest power of two, up to nworkers, that leaves at least
+* batch_pixels pixels to each of them.
+*******************************************************************************/
+int batch_ranks(long pixels, int nworkers)
+{
+   int k = 1;
+
+   while((2*k <= nworkers) && (2*k*batch_pixels <= pixels)) k *= 2;
+   return(k);
+}
+
+/*******************************************************************************
+* FUNCTION: compare_batch
+* PURPOSE: Order the images of the batch by decreasing group size and then by
+* decreasing size, so each phase starts with its largest images; equal ones
+* (and the just listed ones, without a size yet) go in alphabetical order.
+*******************************************************************************/
+int compare_batch(const void *a, const void *b)
+{
+   const batch_item *x = (const batch_item *)a, *y = (const batch_item *)b;
+   long px = (long)x->rows * x->cols, py = (long)y->rows * y->cols;
+
+   if(x->ranks != y->ranks) return((x->ranks > y->ranks) ? -1 : 1);
+   if(px != py) return((px > py) ? -1 : 1);
+   return(strcmp(x->name, y->name));
+}
+
+/*******************************************************************************
+* PROCEDURE: batch_serve
+* PURPOSE: Master side of a phase. Hand the images [lo,hi) out, one at a time,
+* to the first process of each of the ngroups groups as it asks for work, and
+* report the result each one returns. Every group gets -1 when the images of
+* the phase are over.
+*******************************************************************************/
+void batch_serve(batch_item *items, int lo, int hi, int ngroups)
+{
+   MPI_Status status;
+   double result[2];          /* imagen procesada (o -1) y lo que demoro */
+   int msg[2];                /* imagen asignada y largo de su nombre */
+
+   while(ngroups > 0){
+      MPI_Recv(result, 2, MPI_DOUBLE, MPI_ANY_SOURCE, BATCH_TAG_READY,
+         MPI_COMM_WORLD, &status);
+      if(result[0] >= 0.0){
+         items[(int)result[0]].time = result[1];
+         batch_report(&items[(int)result[0]]);
+      }
+      if(lo < hi){
+         msg[0] = lo;
+         msg[1] = strlen(items[lo].name) + 1;
+         MPI_Send(msg, 2, MPI_INT, status.MPI_SOURCE, BATCH_TAG_WORK,
+            MPI_COMM_WORLD);
+         MPI_Send(items[lo].name, msg[1], MPI_CHAR, status.MPI_SOURCE,
+            BATCH_TAG_WORK, MPI_COMM_WORLD);
+         lo++;
+      }
+      else{
+         msg[0] = -1;
+         msg[1] = 0;
+         MPI_Send(msg, 2, MPI_INT, status.MPI_SOURCE, BATCH_TAG_WORK,
+            MPI_COMM_WORLD);
+         ngroups--;
+      }
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: batch_work
+* PURPOSE: Collective in canny_comm, the group of a phase. Detect the edges of
+* the images the master hands to the first process of the group until it
+* answers -1. The first process returns the time of each image with its next
+* request.
+*******************************************************************************/
+void batch_work(float sigma, float tlow, float thigh)
+{
+   MPI_Status status;
+   double result[2] = {-1.0, 0.0}, tini;
+   char name[BATCH_NAMELEN];
+   int msg[2], rows, cols;
+
+   while(1){
+      if(rank == 0){
+         MPI_Send(result, 2, MPI_DOUBLE, 0, BATCH_TAG_READY, MPI_COMM_WORLD);
+         MPI_Recv(msg, 2, MPI_INT, 0, BATCH_TAG_WORK, MPI_COMM_WORLD,
+            &status);
+         if(msg[0] >= 0)
+            MPI_Recv(name, BATCH_NAMELEN, MPI_CHAR, 0, BATCH_TAG_WORK,
+               MPI_COMM_WORLD, &status);
+      }
+      MPI_Bcast(msg, 2, MPI_INT, 0, canny_comm);
+      if(msg[0] < 0) break;
+      MPI_Bcast(name, msg[1], MPI_CHAR, 0, canny_comm);
+
+      tini = MPI_Wtime ();
+      result[0] = msg[0];
+      if(canny_file(name, sigma, tlow, thigh, 0, &rows, &cols))
+         result[1] = MPI_Wtime () - tini;
+      else result[1] = -1.0;
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: batch_report
+* PURPOSE: Print the result of an image of the batch.
+*******************************************************************************/
+void batch_report(batch_item *item)
+{
+   if(item->time < 0.0) printf (">>>%s: error\n", item->name);
+   else printf (">>>%s %dx%d ranks:%d demoro: %f\n", item->name,
+      item->rows, item->cols, item->ranks, item->time);
+}
+//<------------------------- end batch.c ------------------------->
+
+//<------------------------- begin stream.c ------------------------->
+/*******************************************************************************
+* FILE: stream.c
+* Streaming mode (-stream) for images larger than the memory. Every process
+* walks its strip in bands of STREAM_ROWS rows: it reads the rows of the band
+* plus the halo rows the blur needs, and runs the fused tile pipeline on them
+* (see fused_strip), so only one band of the image, the magnitude and the
+* nms map is stored at a time. The strip is walked twice. The first walk
+* builds the histogram that gives the thresholds. The second labels the
+* possible edges row by row with a union-find and writes each row of edges
+* once the stream_lag rows below it have been labelled. Memory is about
+* cols x (STREAM_ROWS + stream_lag + windowsize) pixels, whatever the height
+* of the image.
+* The edges are those of the in-memory detector unless a chain of possible
+* edges runs more than stream_lag rows below a pixel before it meets a pixel
+* above the high threshold; the chain is cut there. The second walk starts
+* stream_lag rows above the strip, so the chains that enter it from the strip
+* above are cut in the same way.
+*******************************************************************************/
+
+/*******************************************************************************
+* FUNCTION: canny_stream
+* PURPOSE: Collective in canny_comm. Detect the edges of the PGM image
+* infilename, whose pixels start at offset, streaming the strip of this
+* process, and write them to outfilename. Returns 0 when the image can not be
+* read or the edges can not be written.
+*******************************************************************************/
+int canny_stream(char *infilename, MPI_Offset offset, int rows, int cols,
+        int *rowstart, float sigma, float tlow, float thigh, char *outfilename)
+{
+   MPI_File fin, fout;
+   MPI_Offset len;            /* largo de la cabecera de la salida */
+   blur_kernel bk;
+   plane img, mag, nms;       /* la banda en curso */
+   int r0 = rowstart[rank], r1 = rowstart[rank+1];
+   int s0, s1,                /* filas de la segunda pasada */
+       b0, b1, e, last,       /* banda en curso, primera fila sin escribir y limite */
+       r, c, k, n, ok, ringrows, halo, localmax, lowthreshold, highthreshold,
+       words = BITS_WORDS(cols);
+   int *hist, *labels, *lab;
+   unsigned char *out, *map;
+   bitword *bits, w;
+   short *magptr;
+   stream_labels sl;
+
+   if(MPI_File_open(canny_comm, infilename, MPI_MODE_RDONLY, MPI_INFO_NULL,
+      &fin) != MPI_SUCCESS){
+      fprintf(stderr, "Error reading the file %s in canny_stream().\n",
+         infilename);
+      return(0);
+   }
+   if((len = open_pgm_rows(outfilename, rows, cols, "", 255, &fout)) == 0){
+      MPI_File_close(&fin);
+      return(0);
+   }
+
+   if(VERBOSE && rank==0) printf("Streaming the image in bands of %d rows.\n",
+      STREAM_ROWS);
+   blur_setup(&bk, sigma, rows, cols);
+   halo = bk.center + 2;
+   plane_alloc(&img, 0, STREAM_ROWS + 2*halo, 0, cols, sizeof(unsigned char),
+      "stream image");
+   plane_alloc(&mag, 0, STREAM_ROWS, 0, cols, sizeof(short int),
+      "stream magnitude");
+   plane_alloc(&nms, 0, STREAM_ROWS, 0, words, sizeof(bitword), "stream nms");
+   hist = (int *) arena_alloc(32768*sizeof(int), 1, "histogram");
+
+   /****************************************************************************
+   * First walk: the histogram of the magnitude of the possible edges of the
+   * strip, with the rules of hysteresis_strip, gives the thresholds.
+   ****************************************************************************/
+   phase_begin(PHASE_HISTOGRAM);
+   ok = 1;
+   localmax = 0;
+   img.r1 = img.r0;
+   for(b0=r0;(b0<r1)&&ok;b0+=STREAM_ROWS){
+      b1 = (b0 + STREAM_ROWS < r1) ? b0 + STREAM_ROWS : r1;
+      if((ok = stream_band(fin, offset, rows, cols, b0, b1, halo, &bk, &img,
+         &mag, &nms)) == 0) break;
+      for(r=b0;r<b1;r++){
+         if((r == 0) || (r == rows-1)) continue;
+         bits = PLANE_PTR(&nms, bitword, r, 0);
+         magptr = PLANE_PTR(&mag, short, r, 0);
+         for(k=0;k<words;k++)
+            for(w=bits[k]&bits_interior(k, cols);w!=0;w&=w-1){
+               c = k*BITS_WORD + bits_ctz(w);
+               if(sample_pixel(r, c, cols, thresh_sample)){
+                  hist[magptr[c]]++;
+                  if(magptr[c] > localmax) localmax = magptr[c];
+               }
+            }
+      }
+   }
+   phase_begin(PHASE_THRESHOLDS);
+   select_thresholds(hist, localmax, tlow, thigh, &lowthreshold,
+      &highthreshold);
+   phase_end(PHASE_THRESHOLDS);
+   phase_end(PHASE_HISTOGRAM);
+   arena_free(hist);
+   if(VERBOSE && rank==0){
+      printf("The input low and high fractions of %f and %f computed to\n",
+         tlow, thigh);
+      printf("magnitude of the gradient threshold values of: %d %d\n",
+         lowthreshold, highthreshold);
+   }
+
+   /****************************************************************************
+   * Second walk: label the rows [s0,s1) and write the edges of the strip.
+   * The labels of the last ringrows rows are kept in a ring; the rows [e,b0)
+   * are the ones still needed.
+   ****************************************************************************/
+   phase_begin(PHASE_HYSTERESIS);
+   s0 = (r0 < r1) ? ((r0-stream_lag > 0) ? r0-stream_lag : 0) : r0;
+   s1 = (r0 < r1) ? ((r1+stream_lag < rows) ? r1+stream_lag : rows) : r1;
+   ringrows = stream_lag + STREAM_ROWS;
+   if(ringrows > s1 - s0) ringrows = (s1 > s0) ? s1 - s0 : 1;
+   if(((labels = (int *) calloc((long)ringrows*cols, sizeof(int))) == NULL) ||
+      ((out = (unsigned char *) calloc((long)STREAM_ROWS*cols, 1)) == NULL)){
+      fprintf(stderr, "Error allocating the stream labels.\n");
+      exit(1);
+   }
+   stream_labels_init(&sl, (long)ringrows*((cols+1)/2) + 1);
+
+   e = s0;
+   img.r1 = img.r0;
+   for(b0=s0;(b0<s1)&&(e<r1)&&ok;b0+=STREAM_ROWS){
+      b1 = (b0 + STREAM_ROWS < s1) ? b0 + STREAM_ROWS : s1;
+      if((ok = stream_band(fin, offset, rows, cols, b0, b1, halo, &bk, &img,
+         &mag, &nms)) == 0) break;
+
+      /* espacio para las etiquetas nuevas de la banda */
+      stream_labels_reserve(&sl, labels, ringrows, cols, e, b0,
+         (long)(b1-b0)*((cols+1)/2));
+      for(r=b0;r<b1;r++){
+         lab = labels + (long)(r % ringrows) * cols;
+         memset(lab, 0, cols*sizeof(int));
+         if((r == 0) || (r == rows-1)) continue;
+         stream_label_row(&sl, lab, (r > s0) ?
+            labels + (long)((r-1) % ringrows) * cols : NULL,
+            PLANE_PTR(&mag, short, r, 0), PLANE_PTR(&nms, bitword, r, 0),
+            cols, lowthreshold, highthreshold);
+      }
+
+      /* las filas con stream_lag filas etiquetadas debajo ya no cambian */
+      last = (b1 == s1) ? r1 : b1 - stream_lag;
+      if(last > r1) last = r1;
+      while(e < last){
+         n = (last - e < STREAM_ROWS) ? last - e : STREAM_ROWS;
+         if(e < r0){
+            /* las filas de arriba de la franja solo se etiquetan */
+            if(n > r0 - e) n = r0 - e;
+         }
+         else{
+            for(r=e;r<e+n;r++){
+               lab = labels + (long)(r % ringrows) * cols;
+               map = out + (long)(r - e) * cols;
+               for(c=0;c<cols;c++)
+                  map[c] = (lab[c] && sl.seed[find_root(sl.parent, lab[c])]) ?
+                     EDGE : NOEDGE;
+            }
+            phase_begin(PHASE_WRITE);
+            MPI_File_write_at(fout, len + (MPI_Offset)e * cols, out, n * cols,
+               MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE);
+            phase_end(PHASE_WRITE);
+         }
+         e += n;
+      }
+   }
+   phase_end(PHASE_HYSTERESIS);
+
+   MPI_File_close(&fin);
+   MPI_File_close(&fout);
+   blur_free(&bk);
+   stream_labels_free(&sl);
+   free(labels);
+   free(out);
+   plane_free(&img);
+   plane_free(&mag);
+   plane_free(&nms);
+   MPI_Allreduce(&ok, &r, 1, MPI_INT, MPI_MIN, canny_comm);
+   return(r);
+}
+
+/*******************************************************************************
+* FUNCTION: stream_band
+* PURPOSE: Compute the magnitude and the nms map of rows [b0,b1). img holds
+* the rows of the previous band and its halo: the rows the new band shares
+* with them are kept and the others are read from fin. Returns 0 when the
+* rows can not be read.
+*******************************************************************************/
+int stream_band(MPI_File fin, MPI_Offset offset, int rows, int cols, int b0,
+        int b1, int halo, blur_kernel *bk, plane *img, plane *mag, plane *nms)
+{
+   MPI_Status status;
+   int nr0, nr1, keep = 0, count;
+
+   nr0 = (b0-halo > 0) ? b0-halo : 0;
+   nr1 = (b1+halo < rows) ? b1+halo : rows;
+   if((img->r0 < img->r1) && (img->r0 <= nr0) && (nr0 < img->r1)){
+      keep = img->r1 - nr0;
+      memmove(img->data, PLANE_PTR(img, unsigned char, nr0, 0),
+         (long)keep * cols);
+   }
+   plane_move(img, nr0, nr1, 0, cols, rows, cols);
+   phase_begin(PHASE_READ);
+   MPI_File_read_at(fin, offset + (MPI_Offset)(nr0 + keep) * cols,
+      PLANE_PTR(img, unsigned char, nr0 + keep, 0), (nr1 - nr0 - keep) * cols,
+      MPI_UNSIGNED_CHAR, &status);
+   MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &count);
+   phase_end(PHASE_READ);
+   if(count != (nr1 - nr0 - keep) * cols){
+      fprintf(stderr, "Error reading the image data in stream_band().\n");
+      return(0);
+   }
+
+   /* la supresion escribe todas las palabras del mapa nms */
+   plane_move(mag, b0, b1, 0, cols, rows, cols);
+   plane_move(nms, b0, b1, 0, BITS_WORDS(cols), rows, BITS_WORDS(cols));
+   fused_strip(img, rows, cols, b0, b1, bk, mag, nms, NULL, NULL);
+   return(1);
+}
+
+/*******************************************************************************
+* PROCEDURE: stream_label_row
+* PURPOSE: Label the possible edges of a row that are above the low threshold
+* (or above the high one), joining them with their 8-neighbours of the row
+* and of the row above, lab_up (NULL in the first row of the walk). The
+* components with a pixel above the high threshold are seeds.
+*******************************************************************************/
+void stream_label_row(stream_labels *sl, int *lab, int *lab_up, short *mag,
+        bitword *nms, int cols, int lowthreshold, int highthreshold)
+{
+   int c, d, k, l, b;
+   bitword w;
+
+   for(k=0;k<BITS_WORDS(cols);k++) for(w=nms[k]&bits_interior(k, cols);w!=0;
+      w&=w-1){
+      c = k*BITS_WORD + bits_ctz(w);
+      if((mag[c] <= lowthreshold) && (mag[c] < highthreshold)) continue;
+      l = lab[c-1] ? find_root(sl->parent, lab[c-1]) : 0;
+      for(d=-1;(d<=1)&&(lab_up!=NULL);d++){
+         if(lab_up[c+d] == 0) continue;
+         b = find_root(sl->parent, lab_up[c+d]);
+         if(l == 0) l = b;
+         else if(b != l){
+            sl->parent[b] = l;
+            sl->seed[l] |= sl->seed[b];
+         }
+      }
+      if(l == 0){
+         l = ++sl->nlabels;
+         sl->parent[l] = l;
+         sl->seed[l] = 0;
+      }
+      lab[c] = l;
+      if(mag[c] >= highthreshold) sl->seed[l] = 1;
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: stream_labels_init
+* PURPOSE: Allocate the union-find of the streaming mode for cap labels.
+*******************************************************************************/
+void stream_labels_init(stream_labels *sl, long cap)
+{
+   sl->nlabels = 0;
+   sl->cap = cap;
+   if(((sl->parent = (int *) calloc(cap+1, sizeof(int))) == NULL) ||
+      ((sl->seed = (unsigned char *) calloc(cap+1, 1)) == NULL)){
+      fprintf(stderr, "Error allocating the stream labels.\n");
+      exit(1);
+   }
+}
+
+/*******************************************************************************
+* PROCEDURE: stream_labels_reserve
+* PURPOSE: Make room for need more labels. The labels of the rows already
+* written are dead, so when the union-find is full the components of the
+* rows [e,b0) still in the ring are renumbered 1..n, and the union-find only
+* grows when they do not leave room enough.
+*******************************************************************************/
+void stream_labels_reserve(stream_labels *sl, int *labels, int ringrows,
+        int cols, int e, int b0, long need)
+{
+   int *remap, *lab, r, c, a, n;
+   unsigned char *seed;
+
+   if(sl->nlabels + need <= sl->cap) return;
+   if(((remap = (int *) calloc(sl->nlabels+1, sizeof(int))) == NULL) ||
+      ((seed = (unsigned char *) calloc(sl->nlabels+1, 1)) == NULL)){
+      fprintf(stderr, "Error allocating the stream labels.\n");
+      exit(1);
+   }
+   n = 0;
+   for(r=e;r<b0;r++){
+      lab = labels + (long)(r % ringrows) * cols;
+      for(c=0;c<cols;c++){
+         if(lab[c] == 0) continue;
+         a = find_root(sl->parent, lab[c]);
+         if(remap[a] == 0){
+            remap[a] = ++n;
+            seed[n] = sl->seed[a];
+         }
+         lab[c] = remap[a];
+      }
+   }
+   if(n + need > sl->cap){
+      sl->cap = 2 * (n + need);
+      if(((sl->parent = (int *) realloc(sl->parent,
+         (sl->cap+1) * sizeof(int))) == NULL) ||
+         ((sl->seed = (unsigned char *) realloc(sl->seed, sl->cap+1))
+         == NULL)){
+         fprintf(stderr, "Error allocating the stream labels.\n");
+         exit(1);
+      }
+   }
+   for(a=1;a<=n;a++){
+      sl->parent[a] = a;
+      sl->seed[a] = seed[a];
+   }
+   sl->nlabels = n;
+   free(remap);
+   free(seed);
+}
+
+/*******************************************************************************
+* PROCEDURE: stream_labels_free
+* PURPOSE: Free the union-find of the streaming mode.
+*******************************************************************************/
+void stream_labels_free(stream_labels *sl)
+{
+   free(sl->parent);
+   free(sl->seed);
+}
+//<------------------------- end stream.c ------------------------->
+
+//<------------------------- begin metrics.c ------------------------->
+/*******************************************************************************
+* FILE: metrics.c
+* Instrumentation of the phases of the detector. The code marks each phase
+* with phase_begin and phase_end. The phases nest (the halo exchange inside
+* the smoothing, the thresholds inside the hysteresis) and the time of each
+* one leaves out the phases inside it, so the times of a process add up to
+* the time it spent in the detector. metrics_report gathers the minimum,
+* maximum and mean of every phase over the processes. In a collective the
+* processes that take longer than the fastest one were waiting for the
+* others: that difference is reported as the wait of the phase.
+* Unless compiled with -DPRODUCTION=1 the end of every phase is printed as
+* it happens and phase_barrier lines up the processes first, so the times
+* printed by rank 0 are those of the slowest process. With PRODUCTION the
+* barriers and the messages are compiled out and only the report remains.
+* Only the main thread marks phases.
+*******************************************************************************/
+
+char *phase_name[NPHASES] = {"smooth", "blur-x", "blur-y", "derivatives",
+   "magnitude", "nms", "fused", "histogram", "hysteresis", "halo",
+   "allgather", "gather", "allreduce", "thresholds", "merge", "read",
+   "write", "direction", "barrier", "balance"};
+int phase_kind[NPHASES] = {PHASE_COMPUTE, PHASE_COMPUTE, PHASE_COMPUTE,
+   PHASE_COMPUTE, PHASE_COMPUTE, PHASE_COMPUTE, PHASE_COMPUTE, PHASE_COMPUTE,
+   PHASE_COMPUTE, PHASE_COMM, PHASE_COMM, PHASE_COMM, PHASE_COMM, PHASE_COMM,
+   PHASE_COMM, PHASE_IO, PHASE_IO, PHASE_IO, PHASE_WAIT, PHASE_COMM};
+char *kind_name[4] = {"compute", "comm", "io", "wait"};
+
+double phase_time[NPHASES];        /* tiempo propio acumulado de cada fase */
+long phase_calls[NPHASES];
+int phase_stack[PHASE_DEPTH], phase_depth = 0;   /* fases abiertas */
+double phase_start[PHASE_DEPTH];   /* comienzo de cada fase abierta */
+double phase_mark;                 /* desde cuando corre la fase de arriba */
+
+/*******************************************************************************
+* PROCEDURE: phase_begin
+* PURPOSE: Start phase id, pausing the phase that contains it.
+*******************************************************************************/
+void phase_begin(int id)
+{
+   double t = MPI_Wtime ();
+
+   if(phase_depth == PHASE_DEPTH){
+      fprintf(stderr, "Too many nested phases in phase_begin().\n");
+      exit(1);
+   }
+   if(phase_depth > 0) phase_time[phase_stack[phase_depth-1]] += t - phase_mark;
+   phase_stack[phase_depth] = id;
+   phase_start[phase_depth] = t;
+   phase_depth++;
+   phase_mark = t;
+}
+
+/*******************************************************************************
+* PROCEDURE: phase_end
+* PURPOSE: End phase id, the innermost one, and resume the one that contains
+* it. The computing and communication phases are printed unless PRODUCTION.
+*******************************************************************************/
+void phase_end(int id)
+{
+   double t = MPI_Wtime ();
+
+   if((phase_depth == 0) || (phase_stack[phase_depth-1] != id)){
+      fprintf(stderr, "Phase %s ended out of order in phase_end().\n",
+         phase_name[id]);
+      exit(1);
+   }
+   phase_depth--;
+   phase_time[id] += t - phase_mark;
+   phase_calls[id]++;
+   phase_mark = t;
+#if !PRODUCTION
+   if(phase_kind[id] == PHASE_COMPUTE)
+      printf (">rank:%d termino %s\n", rank, phase_name[id]);
+   if((rank == 0) && ((phase_kind[id] == PHASE_COMPUTE) ||
+      (phase_kind[id] == PHASE_COMM))){
+      if(phase_depth == 0)
+         printf ("----------------------> %s demoro: %f\n", phase_name[id],
+            t - phase_start[phase_depth]);
+      else printf (">>>%s demoro: %f\n", phase_name[id],
+         t - phase_start[phase_depth]);
+   }
+#endif
+}
+
+/*******************************************************************************
+* PROCEDURE: phase_barrier
+* PURPOSE: Line up the processes of canny_comm before a phase, so the times
+* printed by rank 0 make sense. Compiled out with PRODUCTION; otherwise the
+* time spent in the barrier is the barrier phase.
+*******************************************************************************/
+void phase_barrier(void)
+{
+#if !PRODUCTION
+   phase_begin(PHASE_BARRIER);
+   MPI_Barrier (canny_comm);
+   phase_end(PHASE_BARRIER);
+#endif
+}
+
+/*******************************************************************************
+* FUNCTION: phase_total
+* PURPOSE: Time this process has spent so far in the phases of a kind.
+*******************************************************************************/
+double phase_total(int kind)
+{
+   double t = 0.0;
+   int p;
+
+   for(p=0;p<NPHASES;p++) if(phase_kind[p] == kind) t += phase_time[p];
+   return(t);
+}
+
+/*******************************************************************************
+* PROCEDURE: metrics_report
+* PURPOSE: Collective in MPI_COMM_WORLD. Gather the time of every phase over
+* the processes that ran it and have rank 0 write, for each one, its kind,
+* calls and the minimum, maximum and mean time and wait, to fname: as CSV
+* when the name ends in .csv and as JSON otherwise, "-" is the standard
+* output. The wait of a communication phase is the time beyond that of the
+* fastest process, and all the time of the barriers. The JSON also has the
+* most buffers a process had to take from the system (see arena.c) and the
+* bytes all of them sent in the collectives of coll.c.
+*******************************************************************************/
+void metrics_report(char *fname)
+{
+   double mine[NPHASES+1], lo[NPHASES+1], hi[NPHASES+1], sum[NPHASES+1];
+   double wait[NPHASES+1], wlo[NPHASES+1], whi[NPHASES+1], wsum[NPHASES+1];
+   long calls[NPHASES+1], ran[NPHASES+1], nran[NPHASES+1], ncalls[NPHASES+1];
+   long misses;               /* mayor numero de buffers pedidos al sistema */
+   long bytes[2];             /* enviados por las colectivas, la suma */
+   char *name, *kind;
+   FILE *fp = stdout;
+   int p, csv, first, len, nproc;
+
+   /* los procesos que no corrieron una fase no cuentan para ella */
+   calls[NPHASES] = 0;
+   mine[NPHASES] = 0.0;
+   for(p=0;p<NPHASES;p++){
+      calls[p] = phase_calls[p];
+      calls[NPHASES] += phase_calls[p];
+      mine[p] = phase_time[p];
+      mine[NPHASES] += phase_time[p];
+   }
+   for(p=0;p<=NPHASES;p++){
+      ran[p] = (calls[p] > 0);
+      lo[p] = ran[p] ? mine[p] : HUGE_VAL;
+   }
+   MPI_Allreduce(MPI_IN_PLACE, lo, NPHASES+1, MPI_DOUBLE, MPI_MIN,
+      MPI_COMM_WORLD);
+   wait[NPHASES] = 0.0;
+   for(p=0;p<NPHASES;p++){
+      if(!ran[p]) wait[p] = 0.0;
+      else if(phase_kind[p] == PHASE_COMM) wait[p] = mine[p] - lo[p];
+      else if(phase_kind[p] == PHASE_WAIT) wait[p] = mine[p];
+      else wait[p] = 0.0;
+      wait[NPHASES] += wait[p];
+   }
+   for(p=0;p<=NPHASES;p++) wlo[p] = ran[p] ? wait[p] : HUGE_VAL;
+   MPI_Allreduce(MPI_IN_PLACE, wlo, NPHASES+1, MPI_DOUBLE, MPI_MIN,
+      MPI_COMM_WORLD);
+   for(p=0;p<=NPHASES;p++) if(!ran[p]) mine[p] = wait[p] = -HUGE_VAL;
+   MPI_Reduce(mine, hi, NPHASES+1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+   MPI_Reduce(wait, whi, NPHASES+1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+   for(p=0;p<=NPHASES;p++) if(!ran[p]) mine[p] = wait[p] = 0.0;
+   MPI_Reduce(mine, sum, NPHASES+1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+   MPI_Reduce(wait, wsum, NPHASES+1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+   MPI_Reduce(ran, nran, NPHASES+1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+   MPI_Reduce(calls, ncalls, NPHASES+1, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+   MPI_Reduce(&arena_misses, &misses, 1, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+   MPI_Reduce(coll_bytes, bytes, 2, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+   if(rank != 0) return;
+
+   if((strcmp(fname, "-") != 0) && ((fp = fopen(fname, "w")) == NULL)){
+      fprintf(stderr, "Error opening the file %s for writing.\n", fname);
+      return;
+   }
+   len = strlen(fname);
+   csv = (len > 4) && (strcmp(fname+len-4, ".csv") == 0);
+   MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+   if(csv) fprintf(fp, "phase,kind,calls,processes,min,max,mean,"
+      "wait_min,wait_max,wait_mean\n");
+   else fprintf(fp, "{\n  \"processes\": %d,\n  \"buffers\": %ld,\n"
+      "  \"bytes_intra\": %ld,\n  \"bytes_inter\": %ld,\n  \"phases\": [",
+      nproc, misses, bytes[COLL_INTRA], bytes[COLL_INTER]);
+   first = 1;
+   for(p=0;p<=NPHASES;p++){
+      if(nran[p] == 0) continue;
+      name = (p < NPHASES) ? phase_name[p] : "total";
+      kind = (p < NPHASES) ? kind_name[phase_kind[p]] : "all";
+      if(csv) fprintf(fp, "%s,%s,%ld,%ld,%f,%f,%f,%f,%f,%f\n", name, kind,
+         ncalls[p], nran[p], lo[p], hi[p], sum[p]/nran[p], wlo[p], whi[p],
+         wsum[p]/nran[p]);
+      else fprintf(fp, "%s\n    {\"phase\": \"%s\", \"kind\": \"%s\", "
+         "\"calls\": %ld, \"processes\": %ld, \"min\": %f, \"max\": %f, "
+         "\"mean\": %f, \"wait_min\": %f, \"wait_max\": %f, "
+         "\"wait_mean\": %f}", first ? "" : ",", name, kind, ncalls[p],
+         nran[p], lo[p], hi[p], sum[p]/nran[p], wlo[p], whi[p],
+         wsum[p]/nran[p]);
+      first = 0;
+   }
+   if(!csv) fprintf(fp, "\n  ]\n}\n");
+   if(fp != stdout) fclose(fp);
+   else fflush(fp);
+}
+//<------------------------- end metrics.c ------------------------->
+
+//<------------------------- begin bench.c ------------------------->
+/*******************************************************************************
+* FILE: bench.c
+* Benchmark of the detector on synthetic images. synth_image writes a PGM
+* image computed pixel by pixel from its coordinates, so the same class and
+* size always give the same image, whatever the number of processes that
+* write it. bench_run sweeps the classes, the sizes, sigma, tlow, thigh and
+* the number of processes: 1, 2, 4... and all of them. In strong scaling the
+* image keeps its size; in weak scaling its side grows with the square root
+* of the processes, so each one keeps the pixels it had alone. Every case
+* runs the -halo (or -fused, -stream) pipeline in a communicator with the
+* first processes, as the groups of the batch mode, and keeps the time of
+* every phase of metrics.c. The images and the edges are removed after use.
+* Build with -DPRODUCTION=1 so the barriers of the messages do not slow the
+* phases down.
+*******************************************************************************/
+
+char *synth_name[NSYNTH] = {"noise", "gradient", "dense", "sparse"};
+
+/*******************************************************************************
+* PROCEDURE: bench_run
+* PURPOSE: Collective in MPI_COMM_WORLD. Run the benchmark on the images
+* named after prefix, with the lists of values of sigmas, tlows and thighs,
+* print the time of every case and write them with their phases to
+* metricsname, if given (see bench_report).
+*******************************************************************************/
+void bench_run(char *prefix, char *sigmas, char *tlows, char *thighs)
+{
+   double tini;
+   float sizes[BENCH_LIST], sig[BENCH_LIST], low[BENCH_LIST], high[BENCH_LIST];
+   int kinds[BENCH_LIST], ranks[BENCH_LIST];
+   int nsizes, nsig, nlow, nhigh, nkinds, nranks, n = 0, max;
+   int wrank = rank, wsize = size;   /* rank y procesos de MPI_COMM_WORLD */
+   int k, s, w, g, a, b, c, m, side;
+   int mode = coll;                  /* -coll, COLL_BOTH corre las dos */
+   char fname[BATCH_NAMELEN+64];
+   bench_result *res = NULL, cur;
+   MPI_Comm group;
+
+   nsizes = bench_list(bench_sizes, sizes);
+   nsig = bench_list(sigmas, sig);
+   nlow = bench_list(tlows, low);
+   nhigh = bench_list(thighs, high);
+   nkinds = bench_kinds(bench_kindlist, kinds);
+   for(s=0;s<nsizes;s++) if(sizes[s] < 1.0) nsizes = 0;
+   if((nsizes == 0) || (nsig == 0) || (nlow == 0) || (nhigh == 0) ||
+      (nkinds == 0)){
+      if(rank == 0) fprintf(stderr, "Bad list of benchmark values.\n");
+      MPI_Finalize();
+      exit(1);
+   }
+   /* 1, 2, 4... procesos y todos */
+   for(nranks=0,g=1;g<wsize;g*=2) ranks[nranks++] = g;
+   ranks[nranks++] = wsize;
+
+   max = nkinds * nsizes * 2 * nranks * nsig * nlow * nhigh *
+      ((mode == COLL_BOTH) ? 2 : 1);
+   if((wrank == 0) &&
+      ((res = (bench_result *) calloc(max, sizeof(bench_result))) == NULL)){
+      fprintf(stderr, "Error allocating the benchmark results.\n");
+      exit(1);
+   }
+   if((wrank != 0) && (freopen("/dev/null", "w", stdout) == NULL))
+      fprintf(stderr, "Error discarding the output of the rank %d.\n", wrank);
+
+   tini = MPI_Wtime ();
+   for(k=0;k<nkinds;k++) for(s=0;s<nsizes;s++) for(w=0;w<2;w++)
+   for(g=0;g<nranks;g++){
+      side = w ? (int)(sizes[s] * sqrt(ranks[g]) + 0.5) : (int)sizes[s];
+      if((double)side * side > 2147483647.0){
+         if(wrank == 0) fprintf(stderr, "The benchmark image of side %d is "
+            "too large, skipped.\n", side);
+         continue;
+      }
+      snprintf(fname, sizeof(fname), "%ssynth_%s_%dx%d.pgm", prefix,
+         synth_name[kinds[k]], side, side);
+      /* la imagen fija del escalado fuerte se escribe una sola vez */
+      if((w || (g == 0)) && (synth_image(fname, kinds[k], side, side) == 0)){
+         if(wrank == 0)
+            fprintf(stderr, "Error writing the benchmark image, %s.\n", fname);
+         continue;
+      }
+
+      MPI_Comm_split(MPI_COMM_WORLD, (wrank < ranks[g]) ? 0 : MPI_UNDEFINED,
+         wrank, &group);
+      if(wrank < ranks[g]){
+         canny_comm = group;
+         MPI_Comm_rank(group, &rank);
+         MPI_Comm_size(group, &size);
+         node_setup();
+         for(a=0;a<nsig;a++) for(b=0;b<nlow;b++) for(c=0;c<nhigh;c++)
+         for(m=COLL_FLAT;m<=COLL_NODE;m++){
+            if((mode != COLL_BOTH) && (m != mode)) continue;
+            coll = m;
+            cur.coll = m;
+            cur.kind = kinds[k];
+            cur.weak = w;
+            cur.base = (int)sizes[s];
+            cur.rows = cur.cols = side;
+            cur.ranks = ranks[g];
+            cur.sigma = sig[a];
+            cur.tlow = low[b];
+            cur.thigh = high[c];
+            bench_measure(fname, &cur);
+            if(wrank == 0){
+               res[n++] = cur;
+               if(cur.time < 0.0) printf (">>>%s %dx%d: error\n",
+                  synth_name[cur.kind], side, side);
+               else printf (">>>%s %dx%d %s s:%3.2f l:%3.2f h:%3.2f "
+                  "ranks:%d coll:%s demoro: %f\n", synth_name[cur.kind], side,
+                  side, w ? "weak" : "strong", cur.sigma, cur.tlow, cur.thigh,
+                  cur.ranks, coll_name[cur.coll], cur.time);
+               fflush(stdout);
+            }
+         }
+         node_free();
+         balance_nparts = 0;        /* otro grupo, otras velocidades */
+         canny_comm = MPI_COMM_WORLD;
+         rank = wrank;
+         size = wsize;
+         MPI_Comm_free(&group);
       }
+      if((wrank == 0) && (w || (g == nranks-1))) remove(fname);
+   }
+   coll = mode;
+
+   if(wrank == 0){
+      printf ("-----------------------------\nCorridas: %d\n", n);
+      printf ("Demoro: %f\n", MPI_Wtime () - tini);
+      if(metricsname != NULL) bench_report(metricsname, res, n);
+      free(res);
    }
 }
 
 /*******************************************************************************
-* PROCEDURE: apply_hysteresis
-* PURPOSE: This routine finds edges that are above some high threshhold or
-* are connected to a high pixel by a path of pixels greater than a low
-* threshold.
-* NAME: Mike Heath
-* DATE: 2/15/96
+* FUNCTION: bench_list
+* PURPOSE: Read into values the comma separated numbers of list, at most
+* BENCH_LIST, and return how many there are, or 0 if the list is wrong.
 *******************************************************************************/
-void apply_hysteresis(short int *mag, unsigned char *nms, int rows, int cols,
-	float tlow, float thigh, unsigned char *edge)
+int bench_list(char *list, float *values)
 {
-	double tini3, tfin3;			/* para medir tiempos de funciones */
-	unsigned char *tempbuffer;		/* buffer temporal */
-	int temphist[32768];			/* arreglo temporal de hist */
-   int r, c, pos, numedges, lowcount, highcount, lowthreshold, highthreshold,
-       i, hist[32768], rr, cc;
-   short int maximum_mag, sumpix;
+   char *end;
+   int n = 0;
 
-	if (rank == 0) tini2 = MPI_Wtime ();
-	
-	/* se asigna memoria al buffer temporal */
-	if ((tempbuffer = (unsigned char *) calloc (rows*cols, sizeof (unsigned char))) == NULL) {
-		fprintf (stderr, "Error allocating the tempbuffer.\n");
-		exit (1);
-	}
-   /****************************************************************************
-   * Initialize the edge map to possible edges everywhere the non-maximal
-   * suppression suggested there could be an edge except for the border. At
-   * the border we say there can not be an edge because it makes the
-   * follow_edges algorithm more efficient to not worry about tracking an
-   * edge off the side of the image.
-   ****************************************************************************/
-   /* interesa solo el primer bucle debido al tiempo que consume */
-   pos = rank*rows*cols/size;
-   for(r=rank*rows/size;r<(rank+1)*rows/size;r++){
-      for(c=0;c<cols;c++,pos++){
-	 if(nms[pos] == POSSIBLE_EDGE) tempbuffer[pos] = POSSIBLE_EDGE;
-	 else tempbuffer[pos] = NOEDGE;
-      }
-   }
-	/* lo hacen todos los nodos */
-   for(r=0,pos=0;r<rows;r++,pos+=cols){
-      tempbuffer[pos] = NOEDGE;
-      tempbuffer[pos+cols-1] = NOEDGE;
+   while(n < BENCH_LIST){
+      values[n] = strtod(list, &end);
+      if(end == list) return(0);
+      n++;
+      if(*end == '\0') return(n);
+      if(*end != ',') return(0);
+      list = end+1;
    }
-   pos = (rows-1) * cols;
-   for(c=0;c<cols;c++,pos++){
-      tempbuffer[c] = NOEDGE;
-      tempbuffer[pos] = NOEDGE;
+   return(0);
+}
+
+/*******************************************************************************
+* FUNCTION: bench_kinds
+* PURPOSE: Read into kinds the comma separated names of image classes of
+* list and return how many there are, or 0 if a name is unknown.
+*******************************************************************************/
+int bench_kinds(char *list, int *kinds)
+{
+   int n = 0, k;
+   size_t len;
+
+   while(n < BENCH_LIST){
+      len = strcspn(list, ",");
+      for(k=0;k<NSYNTH;k++)
+         if((strlen(synth_name[k]) == len) &&
+            (strncmp(list, synth_name[k], len) == 0)) break;
+      if(k == NSYNTH) return(0);
+      kinds[n++] = k;
+      if(list[len] == '\0') return(n);
+      list += len+1;
    }
+   return(0);
+}
 
-   /****************************************************************************
-   * Compute the histogram of the magnitude image. Then use the histogram to
-   * compute hysteresis thresholds.
-   ****************************************************************************/
-   /* interesa paralelizar solo el segundo for */
-   for(r=0;r<32768;r++) temphist[r] = 0;
-   pos = rank*rows*cols/size;
-   /* cada nodo dispone de la informacion a la que accede en tempbuffer */
-   for(r=rank*rows/size;r<(rank+1)*rows/size;r++){
-      for(c=0;c<cols;c++,pos++){
-	 if(tempbuffer[pos] == POSSIBLE_EDGE) temphist[mag[pos]]++;
+/*******************************************************************************
+* PROCEDURE: bench_measure
+* PURPOSE: Collective in canny_comm. Detect the edges of the image fname
+* with the parameters of res bench_reps times and leave in res, in rank 0,
+* the time of the slowest process of the fastest run, the time of every
+* phase (the largest over the processes) of that run and the bytes sent by
+* its collectives (see coll.c). The time is negative
+* when the image could not be processed. The edge image is removed.
+*******************************************************************************/
+void bench_measure(char *fname, bench_result *res)
+{
+   double t, mine[NPHASES+1], worst[NPHASES+1];
+   long calls[NPHASES], bytes[2];
+   char outfilename[BATCH_NAMELEN+64];
+   int rep, p, rows, cols, ok, allok;
+
+   res->time = -1.0;
+   for(rep=0;rep<bench_reps;rep++){
+      for(p=0;p<NPHASES;p++){
+         phase_time[p] = 0.0;
+         phase_calls[p] = 0;
+      }
+      coll_bytes[COLL_INTRA] = coll_bytes[COLL_INTER] = 0;
+      MPI_Barrier (canny_comm);
+      t = MPI_Wtime ();
+      ok = canny_file(fname, res->sigma, res->tlow, res->thigh, 0, &rows,
+         &cols);
+      mine[NPHASES] = MPI_Wtime () - t;
+      for(p=0;p<NPHASES;p++) mine[p] = phase_time[p];
+      MPI_Reduce(mine, worst, NPHASES+1, MPI_DOUBLE, MPI_MAX, 0, canny_comm);
+      MPI_Reduce(phase_calls, calls, NPHASES, MPI_LONG, MPI_MAX, 0,
+         canny_comm);
+      MPI_Reduce(coll_bytes, bytes, 2, MPI_LONG, MPI_SUM, 0, canny_comm);
+      MPI_Allreduce(&ok, &allok, 1, MPI_INT, MPI_MIN, canny_comm);
+      if(allok == 0){
+         res->time = -1.0;
+         break;
+      }
+      if((rank == 0) && ((res->time < 0.0) || (worst[NPHASES] < res->time))){
+         res->time = worst[NPHASES];
+         res->bytes[COLL_INTRA] = bytes[COLL_INTRA];
+         res->bytes[COLL_INTER] = bytes[COLL_INTER];
+         for(p=0;p<NPHASES;p++){
+            res->phase[p] = worst[p];
+            res->calls[p] = calls[p];
+         }
       }
    }
-   /* se comparte la informacion de hist */
-   MPI_Allreduce (temphist, hist, 32768, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-
-   /****************************************************************************
-   * Compute the number of pixels that passed the nonmaximal suppression.
-   ****************************************************************************/
-   /* lo realizan todos los nodos */
-   for(r=1,numedges=0;r<32768;r++){
-      if(hist[r] != 0) maximum_mag = r;
-      numedges += hist[r];
+   if(rank == 0){
+      snprintf(outfilename, sizeof(outfilename),
+         "%s_s_%3.2f_l_%3.2f_h_%3.2f.pgm", fname, res->sigma, res->tlow,
+         res->thigh);
+      remove(outfilename);
    }
+}
 
-   highcount = (int)(numedges * thigh + 0.5);
+/*******************************************************************************
+* PROCEDURE: bench_report
+* PURPOSE: Write the n results of the benchmark to fname, as CSV when the name
+* ends in .csv and as JSON otherwise, "-" is the standard output. Every case
+* comes with its speedup and efficiency against the same case with one
+* process: t1/t and t1/(ranks*t) in strong scaling, ranks*t1/t and t1/t in
+* weak scaling (0 if there is no such case), the bytes its collectives sent
+* inside and between nodes and the time of its phases.
+*******************************************************************************/
+void bench_report(char *fname, bench_result *res, int n)
+{
+   bench_result *one;
+   double speedup, efficiency;
+   FILE *fp = stdout;
+   int i, j, p, csv, len, first, nproc;
 
-   /****************************************************************************
-   * Compute the high threshold value as the (100 * thigh) percentage point
-   * in the magnitude of the gradient histogram of all the pixels that passes
-   * non-maximal suppression. Then calculate the low threshold as a fraction
-   * of the computed high threshold value. John Canny said in his paper
-   * "A Computational Approach to Edge Detection" that "The ratio of the
-   * high to low threshold in the implementation is in the range two or three
-   * to one." That means that in terms of this implementation, we should
-   * choose tlow ~= 0.5 or 0.33333.
-   ****************************************************************************/
-   /* lo realizan todos los nodos */
-   r = 1;
-   numedges = hist[1];
-   while((r<(maximum_mag-1)) && (numedges < highcount)){
-      r++;
-      numedges += hist[r];
+   if((strcmp(fname, "-") != 0) && ((fp = fopen(fname, "w")) == NULL)){
+      fprintf(stderr, "Error opening the file %s for writing.\n", fname);
+      return;
    }
-   highthreshold = r;
-   lowthreshold = (int)(highthreshold * tlow + 0.5);
-
-   if(VERBOSE && rank==0){
-      printf("The input low and high fractions of %f and %f computed to\n",
-	 tlow, thigh);
-      printf("magnitude of the gradient threshold values of: %d %d\n",
-	 lowthreshold, highthreshold);
+   len = strlen(fname);
+   csv = (len > 4) && (strcmp(fname+len-4, ".csv") == 0);
+   MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+   if(csv){
+      fprintf(fp, "kind,scaling,base,rows,cols,sigma,tlow,thigh,ranks,coll,"
+         "time,speedup,efficiency,bytes_intra,bytes_inter");
+      for(p=0;p<NPHASES;p++) fprintf(fp, ",%s", phase_name[p]);
+      fprintf(fp, "\n");
    }
-
-   /****************************************************************************
-   * This loop looks for pixels above the highthreshold to locate edges and
-   * then calls follow_edges to continue the edge.
-   ****************************************************************************/
-   /* se paraleliza */
-   pos = rank*rows*cols/size;
-   for(r=rank*rows/size;r<(rank+1)*rows/size;r++){
-      for(c=0;c<cols;c++,pos++){
-	 if((tempbuffer[pos] == POSSIBLE_EDGE) && (mag[pos] >= highthreshold)){
-            tempbuffer[pos] = EDGE;
-            follow_edges((tempbuffer+pos), (mag+pos), lowthreshold, cols);
-	 }
+   else fprintf(fp, "{\n  \"processes\": %d,\n  \"reps\": %d,\n  \"runs\": [",
+      nproc, bench_reps);
+   for(i=0;i<n;i++){
+      /* el mismo caso con un proceso */
+      for(j=0,one=NULL;(j<n)&&(one==NULL);j++)
+         if((res[j].ranks == 1) && (res[j].kind == res[i].kind) &&
+            (res[j].weak == res[i].weak) && (res[j].base == res[i].base) &&
+            (res[j].sigma == res[i].sigma) && (res[j].tlow == res[i].tlow) &&
+            (res[j].thigh == res[i].thigh) && (res[j].coll == res[i].coll) &&
+            (res[j].time > 0.0))
+            one = &res[j];
+      speedup = efficiency = 0.0;
+      if((one != NULL) && (res[i].time > 0.0)){
+         efficiency = one->time / res[i].time;
+         speedup = efficiency;
+         if(res[i].weak) speedup *= res[i].ranks;
+         else efficiency /= res[i].ranks;
+      }
+      if(csv){
+         fprintf(fp, "%s,%s,%d,%d,%d,%f,%f,%f,%d,%s,%f,%f,%f,%ld,%ld",
+            synth_name[res[i].kind], res[i].weak ? "weak" : "strong",
+            res[i].base, res[i].rows, res[i].cols, res[i].sigma, res[i].tlow,
+            res[i].thigh, res[i].ranks, coll_name[res[i].coll], res[i].time,
+            speedup, efficiency, res[i].bytes[COLL_INTRA],
+            res[i].bytes[COLL_INTER]);
+         for(p=0;p<NPHASES;p++) fprintf(fp, ",%f", res[i].phase[p]);
+         fprintf(fp, "\n");
+         continue;
+      }
+      fprintf(fp, "%s\n    {\"kind\": \"%s\", \"scaling\": \"%s\", "
+         "\"base\": %d, \"rows\": %d, \"cols\": %d, \"sigma\": %f, "
+         "\"tlow\": %f, \"thigh\": %f, \"ranks\": %d, \"coll\": \"%s\", "
+         "\"time\": %f, \"speedup\": %f, \"efficiency\": %f,\n     "
+         "\"bytes_intra\": %ld, \"bytes_inter\": %ld,\n     \"phases\": {",
+         (i > 0) ? "," : "", synth_name[res[i].kind],
+         res[i].weak ? "weak" : "strong", res[i].base, res[i].rows,
+         res[i].cols, res[i].sigma, res[i].tlow, res[i].thigh, res[i].ranks,
+         coll_name[res[i].coll], res[i].time, speedup, efficiency,
+         res[i].bytes[COLL_INTRA], res[i].bytes[COLL_INTER]);
+      for(p=0,first=1;p<NPHASES;p++){
+         if(res[i].calls[p] == 0) continue;
+         fprintf(fp, "%s\"%s\": %f", first ? "" : ", ", phase_name[p],
+            res[i].phase[p]);
+         first = 0;
       }
+      fprintf(fp, "}}");
    }
+   if(!csv) fprintf(fp, "\n  ]\n}\n");
+   if(fp != stdout) fclose(fp);
+   else fflush(fp);
+}
 
-   /****************************************************************************
-   * Set all the remaining possible edges to non-edges.
-   ****************************************************************************/
-   /* se paraleliza */
-   pos = rank*rows*cols/size;
-   for(r=rank*rows/size;r<(rank+1)*rows/size;r++){
-      for(c=0;c<cols;c++,pos++) if(tempbuffer[pos] != EDGE) tempbuffer[pos] = NOEDGE;
+/*******************************************************************************
+* FUNCTION: synth_image
+* PURPOSE: Collective in canny_comm. Write the rows x cols synthetic image of
+* class kind to the PGM file fname, every process its strip of rows by bands.
+* Returns 0 in every process upon failure.
+*******************************************************************************/
+int synth_image(char *fname, int kind, int rows, int cols)
+{
+   MPI_File fh;
+   unsigned char *buf;
+   char comment[32];
+   int *rowstart, len, r, c, b0, b1, ok = 1, allok;
+
+   snprintf(comment, sizeof(comment), "synthetic %s", synth_name[kind]);
+   if((len = open_pgm_rows(fname, rows, cols, comment, 255, &fh)) == 0)
+      return(0);
+   if(((rowstart = (int *) calloc(size+1, sizeof(int))) == NULL) ||
+      ((buf = (unsigned char *) malloc((size_t)STREAM_ROWS * cols)) == NULL)){
+      fprintf(stderr, "Error allocating the synthetic image.\n");
+      exit(1);
    }
-   
-   printf (">rank:%d termino hysteresis\n", rank);
-   if (rank == 0) tini3 = MPI_Wtime ();
-   MPI_Reduce (tempbuffer, edge, rows*cols, MPI_UNSIGNED_CHAR, MPI_SUM, 0, MPI_COMM_WORLD);
-   free (tempbuffer);
-   if (rank == 0) {
-	   tfin2 = MPI_Wtime ();
-	   printf (">>>Reduce demoro: %f\n", tfin2 - tini3);
-	   printf ("----------------------> apply_hysteresis demoro: %f\n", tfin2 - tini2);
+   make_partition(rows, size, rowstart);
+   for(b0=rowstart[rank];b0<rowstart[rank+1];b0=b1){
+      b1 = (b0+STREAM_ROWS < rowstart[rank+1]) ? b0+STREAM_ROWS :
+         rowstart[rank+1];
+      for(r=b0;r<b1;r++) for(c=0;c<cols;c++)
+         buf[(long)(r-b0)*cols+c] = synth_pixel(kind, r, c, rows, cols);
+      if(MPI_File_write_at(fh, len + (MPI_Offset)b0 * cols, buf,
+         (b1-b0) * cols, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+         ok = 0;
    }
+   MPI_File_close(&fh);
+   MPI_Allreduce(&ok, &allok, 1, MPI_INT, MPI_MIN, canny_comm);
+   free(buf);
+   free(rowstart);
+   return(allok);
 }
 
 /*******************************************************************************
-* PROCEDURE: non_max_supp
-* PURPOSE: This routine applies non-maximal suppression to the magnitude of
-* the gradient image.
-* NAME: Mike Heath
-* DATE: 2/15/96
+* FUNCTION: synth_hash
+* PURPOSE: Mix two numbers into a pseudo random one, the noise of the
+* synthetic images.
 *******************************************************************************/
-void non_max_supp(short *mag, short *gradx, short *grady, int nrows, int ncols,
-    unsigned char *result) 
-{
-	double tini3, tfin3;				/* para medir tiempos de funciones */
-	short int val1, val2;				/* para inicio y fin de bucle for */
-	unsigned char *tempbuffer;			/* buffer temporal */
-	int index;							/* indice del tempbuffer */
-    int rowcount, colcount,count;
-    short *magrowptr,*magptr;
-    short *gxrowptr,*gxptr;
-    short *gyrowptr,*gyptr,z1,z2;
-    short m00,gx,gy;
-    float mag1,mag2,xperp,yperp;
-    //unsigned char *resultrowptr, *resultptr;	/* no se utilizan */
-    
-	tini2 = MPI_Wtime ();
-   /****************************************************************************
-   * Zero the edges of the result image.
-   ****************************************************************************/
-   /* no es necesario ya que no se usan estos arreglos */
-   /*
-    for(count=0,resultrowptr=result,resultptr=result+ncols*(nrows-1); 
-        count<ncols; resultptr++,resultrowptr++,count++){
-        *resultrowptr = *resultptr = (unsigned char) 0;
-    }
+unsigned int synth_hash(unsigned int a, unsigned int b)
+{
+   unsigned int h = a * 0x9E3779B1u ^ (b + 0x7F4A7C15u) * 0x85EBCA77u;
 
-    for(count=0,resultptr=result,resultrowptr=result+ncols-1;
-        count<nrows; count++,resultptr+=ncols,resultrowptr+=ncols){
-        *resultptr = *resultrowptr = (unsigned char) 0;
-    }
-    */
-    
-    /* se asigna memoria al buffer temporal */
-    if ((tempbuffer = (unsigned char *) calloc (nrows*ncols, sizeof (unsigned char))) == NULL) {
-		fprintf (stderr, "Error allocating the tempbuffer.\n");
-		exit (1);
-	}
+   h ^= h >> 16;
+   h *= 0x7FEB352Du;
+   h ^= h >> 15;
+   h *= 0x846CA68Bu;
+   h ^= h >> 16;
+   return(h);
+}
 
-   /****************************************************************************
-   * Suppress non-maximum points.
-   ****************************************************************************/
-   /* se asignan los valores para inicio y fin de bucle */
-   val1 = 0;
-   val2 = 0;
-   if (rank == 0) {
-	   val1 = 1;
-   }
-   if (rank == size-1) {
-	   val2 = 2;
-   }
-   
-   /* se inicializan las variables dependiendo del rank */
-   if (rank == 0) {
-		magrowptr=mag+ncols+1;
-		gxrowptr=gradx+ncols+1;
-		gyrowptr=grady+ncols+1;
-		index=ncols+1;
-	}
-	else {
-	   magrowptr=mag+ncols*rank*nrows/size+1;
-	   gxrowptr=gradx+ncols*rank*nrows/size+1;
-	   gyrowptr=grady+ncols*rank*nrows/size+1;
-	   index=ncols*rank*nrows/size+1;
-   }
-   
-   for(rowcount=val1+rank*nrows/size;
-      rowcount<(rank+1)*nrows/size-val2;
-      rowcount++){
-      for(colcount=1,magptr=magrowptr,gxptr=gxrowptr,gyptr=gyrowptr;
-         colcount<ncols-2;
-         colcount++,magptr++,gxptr++,gyptr++,index++){
-         m00 = *magptr;
-         if(m00 == 0){
-            tempbuffer[index] = (unsigned char) NOEDGE;
-         }
-         else{
-            xperp = -(gx = *gxptr)/((float)m00);
-            yperp = (gy = *gyptr)/((float)m00);
-         }
+/*******************************************************************************
+* FUNCTION: synth_pixel
+* PURPOSE: Return the pixel (r,c) of the rows x cols synthetic image of class
+* kind. The sparse class places at most one disc in each block of 256 x 256
+* pixels, chosen by the hash of the block.
+*******************************************************************************/
+unsigned char synth_pixel(int kind, int r, int c, int rows, int cols)
+{
+   unsigned int h = synth_hash(r, c), hb;
+   int v, cr, cc, rad;
 
-         if(gx >= 0){
-            if(gy >= 0){
-                    if (gx >= gy)
-                    {  
-                        /* 111 */
-                        /* Left point */
-                        z1 = *(magptr - 1);
-                        z2 = *(magptr - ncols - 1);
-
-                        mag1 = (m00 - z1)*xperp + (z2 - z1)*yperp;
-                        
-                        /* Right point */
-                        z1 = *(magptr + 1);
-                        z2 = *(magptr + ncols + 1);
-
-                        mag2 = (m00 - z1)*xperp + (z2 - z1)*yperp;
-                    }
-                    else
-                    {    
-                        /* 110 */
-                        /* Left point */
-                        z1 = *(magptr - ncols);
-                        z2 = *(magptr - ncols - 1);
-
-                        mag1 = (z1 - z2)*xperp + (z1 - m00)*yperp;
-
-                        /* Right point */
-                        z1 = *(magptr + ncols);
-                        z2 = *(magptr + ncols + 1);
-
-                        mag2 = (z1 - z2)*xperp + (z1 - m00)*yperp; 
-                    }
-                }
-                else
-                {
-                    if (gx >= -gy)
-                    {
-                        /* 101 */
-                        /* Left point */
-                        z1 = *(magptr - 1);
-                        z2 = *(magptr + ncols - 1);
-
-                        mag1 = (m00 - z1)*xperp + (z1 - z2)*yperp;
-            
-                        /* Right point */
-                        z1 = *(magptr + 1);
-                        z2 = *(magptr - ncols + 1);
-
-                        mag2 = (m00 - z1)*xperp + (z1 - z2)*yperp;
-                    }
-                    else
-                    {    
-                        /* 100 */
-                        /* Left point */
-                        z1 = *(magptr + ncols);
-                        z2 = *(magptr + ncols - 1);
-
-                        mag1 = (z1 - z2)*xperp + (m00 - z1)*yperp;
-
-                        /* Right point */
-                        z1 = *(magptr - ncols);
-                        z2 = *(magptr - ncols + 1);
-
-                        mag2 = (z1 - z2)*xperp  + (m00 - z1)*yperp; 
-                    }
-                }
-            }
-            else
-            {
-                if ((gy = *gyptr) >= 0)
-                {
-                    if (-gx >= gy)
-                    {          
-                        /* 011 */
-                        /* Left point */
-                        z1 = *(magptr + 1);
-                        z2 = *(magptr - ncols + 1);
-
-                        mag1 = (z1 - m00)*xperp + (z2 - z1)*yperp;
-
-                        /* Right point */
-                        z1 = *(magptr - 1);
-                        z2 = *(magptr + ncols - 1);
-
-                        mag2 = (z1 - m00)*xperp + (z2 - z1)*yperp;
-                    }
-                    else
-                    {
-                        /* 010 */
-                        /* Left point */
-                        z1 = *(magptr - ncols);
-                        z2 = *(magptr - ncols + 1);
-
-                        mag1 = (z2 - z1)*xperp + (z1 - m00)*yperp;
-
-                        /* Right point */
-                        z1 = *(magptr + ncols);
-                        z2 = *(magptr + ncols - 1);
-
-                        mag2 = (z2 - z1)*xperp + (z1 - m00)*yperp;
-                    }
-                }
-                else
-                {
-                    if (-gx > -gy)
-                    {
-                        /* 001 */
-                        /* Left point */
-                        z1 = *(magptr + 1);
-                        z2 = *(magptr + ncols + 1);
-
-                        mag1 = (z1 - m00)*xperp + (z1 - z2)*yperp;
-
-                        /* Right point */
-                        z1 = *(magptr - 1);
-                        z2 = *(magptr - ncols - 1);
-
-                        mag2 = (z1 - m00)*xperp + (z1 - z2)*yperp;
-                    }
-                    else
-                    {
-                        /* 000 */
-                        /* Left point */
-                        z1 = *(magptr + ncols);
-                        z2 = *(magptr + ncols + 1);
-
-                        mag1 = (z2 - z1)*xperp + (m00 - z1)*yperp;
-
-                        /* Right point */
-                        z1 = *(magptr - ncols);
-                        z2 = *(magptr - ncols - 1);
-
-                        mag2 = (z2 - z1)*xperp + (m00 - z1)*yperp;
-                    }
-                }
-            } 
-
-            /* Now determine if the current point is a maximum point */
-
-            if ((mag1 > 0.0) || (mag2 > 0.0))
-            {
-                tempbuffer[index] = (unsigned char) NOEDGE;
-            }
-            else
-            {    
-                if (mag2 == 0.0)
-                    tempbuffer[index] = (unsigned char) NOEDGE;
-                else
-                    tempbuffer[index] = (unsigned char) POSSIBLE_EDGE;
-            }
-        }
-        /* se incrementan las variables */
-        magrowptr+=ncols;
-        gyrowptr+=ncols;
-        gxrowptr+=ncols;
-        index+=3;
-    }
-    
-    printf (">rank:%d termino supp no max\n", rank);
-    if (rank == 0) tini3 = MPI_Wtime ();
-    MPI_Allreduce (tempbuffer, result, nrows*ncols, MPI_UNSIGNED_CHAR, MPI_SUM, MPI_COMM_WORLD);
-    if (rank == 0) {
-		tfin3 = MPI_Wtime ();
-		printf (">>>Allreduce demoro: %f\n", tfin3 - tini3);
-	}
-	free (tempbuffer);
-	if (rank == 0) {
-		tfin2 = MPI_Wtime ();
-		printf ("----------------------> non_max_supp demoro: %f\n", tfin2 - tini2);
-	}
+   switch(kind){
+   case SYNTH_NOISE:
+      return(h & 255);
+   case SYNTH_GRADIENT:
+      v = (int)((long)(r + c) * 255 / (rows + cols - 1)) + (int)(h % 9) - 4;
+      break;
+   case SYNTH_DENSE:
+      v = ((((r >> 3) + (c >> 3)) & 1) ? 176 : 80) + (int)(h % 17) - 8;
+      break;
+   default:
+      v = 96 + (int)(h % 17) - 8;
+      hb = synth_hash((r >> 8) | 0x80000000u, c >> 8);
+      if(hb & 1){
+         /* el disco queda dentro de su bloque */
+         cr = (r & ~255) + 80 + (int)((hb >> 1) % 96) - r;
+         cc = (c & ~255) + 80 + (int)((hb >> 8) % 96) - c;
+         rad = 16 + (int)((hb >> 16) % 64);
+         if(cr*cr + cc*cc <= rad*rad) v += 64 + (int)((hb >> 24) % 64);
+      }
+      break;
+   }
+   return((v < 0) ? 0 : ((v > 255) ? 255 : v));
 }
-//<------------------------- end hysteresis.c ------------------------->
+//<------------------------- end bench.c ------------------------->
 
 //<------------------------- begin pgm_io.c------------------------->
 /*******************************************************************************
@@ -1131,7 +7734,6 @@ int read_pgm_image(char *infilename, unsigned char **image, int *rows,
     int *cols)
 {
    FILE *fp;
-   char buf[71];
 
    /***************************************************************************
    * Open the input image file for reading if a filename was given. If no
@@ -1146,20 +7748,10 @@ int read_pgm_image(char *infilename, unsigned char **image, int *rows,
       }
    }
 
-   /***************************************************************************
-   * Verify that the image is in PGM format, read in the number of columns
-   * and rows in the image and scan past all of the header information.
-   ***************************************************************************/
-   fgets(buf, 70, fp);
-   if(strncmp(buf,"P5",2) != 0){
-      fprintf(stderr, "The file %s is not in PGM format in ", infilename);
-      fprintf(stderr, "read_pgm_image().\n");
+   if(read_pgm_header(fp, infilename, rows, cols) == 0){
       if(fp != stdin) fclose(fp);
       return(0);
    }
-   do{ fgets(buf, 70, fp); }while(buf[0] == '#');  /* skip all comment lines */
-   sscanf(buf, "%d %d", cols, rows);
-   do{ fgets(buf, 70, fp); }while(buf[0] == '#');  /* skip all comment lines */
 
    /***************************************************************************
    * Allocate memory to store the image then read the image from the file.
@@ -1180,6 +7772,151 @@ int read_pgm_image(char *infilename, unsigned char **image, int *rows,
    return(1);
 }
 
+/******************************************************************************
+* Function: read_pgm_header
+* Purpose: Verify that the image is in PGM format, read in the number of
+* columns and rows in the image and scan past all of the header information.
+* On success the file is left at the first pixel and 1 is returned.
+******************************************************************************/
+int read_pgm_header(FILE *fp, char *infilename, int *rows, int *cols)
+{
+   char buf[71];
+
+   fgets(buf, 70, fp);
+   if(strncmp(buf,"P5",2) != 0){
+      fprintf(stderr, "The file %s is not in PGM format in ", infilename);
+      fprintf(stderr, "read_pgm_image().\n");
+      return(0);
+   }
+   do{ fgets(buf, 70, fp); }while(buf[0] == '#');  /* skip all comment lines */
+   sscanf(buf, "%d %d", cols, rows);
+   do{ fgets(buf, 70, fp); }while(buf[0] == '#');  /* skip all comment lines */
+   return(1);
+}
+
+/******************************************************************************
+* Function: read_pgm_info
+* Purpose: Collective. Rank 0 reads the header of the PGM file infilename and
+* broadcasts the dimensions of the image and the offset of its first pixel.
+* Upon failure, this function returns 0 in every process.
+******************************************************************************/
+int read_pgm_info(char *infilename, int *rows, int *cols, MPI_Offset *offset)
+{
+   FILE *fp;
+   long info[4];
+
+   info[0] = 0;
+   if(rank == 0){
+      if((fp = fopen(infilename, "rb")) == NULL){
+         fprintf(stderr, "Error reading the file %s in read_pgm_info().\n",
+            infilename);
+      }
+      else{
+         if(read_pgm_header(fp, infilename, rows, cols)){
+            info[0] = 1;
+            info[1] = *rows;
+            info[2] = *cols;
+            info[3] = ftell(fp);
+         }
+         fclose(fp);
+      }
+   }
+   MPI_Bcast(info, 4, MPI_LONG, 0, canny_comm);
+   *rows = (int)info[1];
+   *cols = (int)info[2];
+   *offset = (MPI_Offset)info[3];
+   return((int)info[0]);
+}
+
+/******************************************************************************
+* Function: read_pgm_shared
+* Purpose: Collective. Read the image into a full image of frame_alloc shared
+* by the processes of each node (-shared): every process reads its strip of
+* rows with MPI-IO and the strips are then exchanged by the node leaders, so
+* the file is read about once in total and a node keeps a single copy.
+* Upon failure, this function returns 0 in every process.
+******************************************************************************/
+int read_pgm_shared(char *infilename, unsigned char **image, int *rows,
+    int *cols)
+{
+   MPI_Offset offset;
+   MPI_File fh;
+   MPI_Status status;
+   int *rowstart, r0, r1, count, ok, allok;
+   plane img;
+
+   if(read_pgm_info(infilename, rows, cols, &offset) == 0) return(0);
+   ok = (MPI_File_open(canny_comm, infilename, MPI_MODE_RDONLY,
+      MPI_INFO_NULL, &fh) == MPI_SUCCESS);
+   MPI_Allreduce(&ok, &allok, 1, MPI_INT, MPI_MIN, canny_comm);
+   if(allok == 0){
+      fprintf(stderr, "Error reading the file %s in read_pgm_shared().\n",
+         infilename);
+      if(ok) MPI_File_close(&fh);
+      return(0);
+   }
+   if((rowstart = (int *) calloc(size+1, sizeof(int))) == NULL){
+      fprintf(stderr, "Error allocating the partition.\n");
+      exit(1);
+   }
+   make_partition(*rows, size, rowstart);
+   r0 = rowstart[rank];
+   r1 = rowstart[rank+1];
+   *image = (unsigned char *) frame_alloc((size_t)(*rows)*(*cols), "image");
+   MPI_File_read_at_all(fh, offset + (MPI_Offset)r0 * (*cols),
+      *image + (long)r0 * (*cols), (r1-r0)*(*cols), MPI_UNSIGNED_CHAR,
+      &status);
+   MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &count);
+   MPI_File_close(&fh);
+   ok = (count == (r1-r0)*(*cols));
+   MPI_Allreduce(&ok, &allok, 1, MPI_INT, MPI_MIN, canny_comm);
+   if(allok == 0){
+      if(ok == 0)
+         fprintf(stderr, "Error reading the image data in read_pgm_shared().\n");
+      frame_free(*image);
+      free(rowstart);
+      return(0);
+   }
+   full_plane(&img, *image, *rows, *cols);
+   node_allgather(&img, MPI_UNSIGNED_CHAR, rowstart, *cols);
+   free(rowstart);
+   return(1);
+}
+
+/******************************************************************************
+* Function: read_pgm_rows
+* Purpose: Collective. Every process reads the rows [r0,r1) of the image with
+* MPI-IO into a plane allocated here, so the file is read about once in total
+* instead of once per process. offset is the one given by read_pgm_info.
+* Upon failure, this function returns 0.
+******************************************************************************/
+int read_pgm_rows(char *infilename, MPI_Offset offset, int cols, int r0,
+    int r1, plane *img)
+{
+   MPI_File fh;
+   MPI_Status status;
+   int count;
+
+   plane_alloc(img, r0, r1, 0, cols, sizeof(unsigned char), "image");
+   if(MPI_File_open(canny_comm, infilename, MPI_MODE_RDONLY,
+      MPI_INFO_NULL, &fh) != MPI_SUCCESS){
+      fprintf(stderr, "Error reading the file %s in read_pgm_rows().\n",
+         infilename);
+      plane_free(img);
+      return(0);
+   }
+   MPI_File_read_at_all(fh, offset + (MPI_Offset)r0 * cols, img->data,
+      (r1-r0)*cols, MPI_UNSIGNED_CHAR, &status);
+   MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &count);
+   MPI_File_close(&fh);
+   if(count != (r1-r0)*cols){
+      fprintf(stderr, "Error reading the image data in read_pgm_rows().\n");
+      plane_free(img);
+      return(0);
+   }
+   return(1);
+}
+
 /******************************************************************************
 * Function: write_pgm_image
 * Purpose: This function writes an image in PGM format. The file is either
@@ -1225,6 +7962,151 @@ int write_pgm_image(char *outfilename, unsigned char *image, int rows,
    return(1);
 }
 
+/******************************************************************************
+* Function: open_pgm_rows
+* Purpose: Collective. Create the PGM file outfilename for the processes to
+* write their rows, and have rank 0 write the header, with the same layout
+* as write_pgm_image. Returns the length of the header, where the first row
+* starts. Upon failure, this function returns 0.
+******************************************************************************/
+int open_pgm_rows(char *outfilename, int rows, int cols, char *comment,
+    int maxval, MPI_File *fh)
+{
+   char header[128];
+   int len;
+
+   /***************************************************************************
+   * Write the header information to the PGM file.
+   ***************************************************************************/
+   len = sprintf(header, "P5\n%d %d\n", cols, rows);
+   if(comment != NULL)
+      if(strlen(comment) <= 70) len += sprintf(header+len, "# %s\n", comment);
+   len += sprintf(header+len, "%d\n", maxval);
+
+   if(MPI_File_open(canny_comm, outfilename,
+      MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, fh) != MPI_SUCCESS){
+      fprintf(stderr, "Error writing the file %s in open_pgm_rows().\n",
+         outfilename);
+      return(0);
+   }
+   MPI_File_set_size(*fh, 0);
+   if(rank == 0)
+      MPI_File_write_at(*fh, 0, header, len, MPI_CHAR, MPI_STATUS_IGNORE);
+   return(len);
+}
+
+/******************************************************************************
+* Function: write_pgm_rows
+* Purpose: Collective. Rank 0 writes the PGM header, with the same layout as
+* write_pgm_image, and every process writes the rows [img->r0,img->r1) of
+* the image at their place in the file with MPI-IO.
+* Upon failure, this function returns 0.
+******************************************************************************/
+int write_pgm_rows(char *outfilename, plane *img, int rows, int cols,
+    char *comment, int maxval)
+{
+   MPI_File fh;
+   int len;
+
+   if((len = open_pgm_rows(outfilename, rows, cols, comment, maxval, &fh))
+      == 0) return(0);
+
+   /***************************************************************************
+   * Write the image data to the file.
+   ***************************************************************************/
+   MPI_File_write_at_all(fh, len + (MPI_Offset)img->r0 * cols, img->data,
+      (img->r1 - img->r0) * cols, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE);
+   MPI_File_close(&fh);
+   return(1);
+}
+
+/******************************************************************************
+* Function: tile_view
+* Purpose: Collective. Set the view of fh, from disp on, to the region of
+* the plane p in an image of rows x cols pixels of type type, so the pixels
+* of the plane are read or written with one call. An empty plane sees the
+* file as it is. Returns the number of pixels of the plane.
+******************************************************************************/
+int tile_view(MPI_File fh, MPI_Offset disp, plane *p, int rows, int cols,
+    MPI_Datatype type)
+{
+   MPI_Datatype region;
+   int sizes[2], subsizes[2], starts[2], n;
+
+   n = (p->r1 - p->r0) * (p->c1 - p->c0);
+   if(n == 0){
+      MPI_File_set_view(fh, disp, type, type, "native", MPI_INFO_NULL);
+      return(0);
+   }
+   sizes[0] = rows; sizes[1] = cols;
+   subsizes[0] = p->r1 - p->r0; subsizes[1] = p->c1 - p->c0;
+   starts[0] = p->r0; starts[1] = p->c0;
+   MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, type,
+      &region);
+   MPI_Type_commit(&region);
+   MPI_File_set_view(fh, disp, type, region, "native", MPI_INFO_NULL);
+   MPI_Type_free(&region);
+   return(n);
+}
+
+/******************************************************************************
+* Function: read_pgm_tile
+* Purpose: Collective. Every process reads the rows [r0,r1) and the columns
+* [c0,c1) of the image with MPI-IO into a plane allocated here, as
+* read_pgm_rows does for whole rows. offset is the one given by
+* read_pgm_info. Upon failure, this function returns 0.
+******************************************************************************/
+int read_pgm_tile(char *infilename, MPI_Offset offset, int rows, int cols,
+    int r0, int r1, int c0, int c1, plane *img)
+{
+   MPI_File fh;
+   MPI_Status status;
+   int n, count;
+
+   plane_alloc(img, r0, r1, c0, c1, sizeof(unsigned char), "image");
+   if(MPI_File_open(canny_comm, infilename, MPI_MODE_RDONLY,
+      MPI_INFO_NULL, &fh) != MPI_SUCCESS){
+      fprintf(stderr, "Error reading the file %s in read_pgm_tile().\n",
+         infilename);
+      plane_free(img);
+      return(0);
+   }
+   n = tile_view(fh, offset, img, rows, cols, MPI_UNSIGNED_CHAR);
+   MPI_File_read_all(fh, img->data, n, MPI_UNSIGNED_CHAR, &status);
+   MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &count);
+   MPI_File_close(&fh);
+   if(count != n){
+      fprintf(stderr, "Error reading the image data in read_pgm_tile().\n");
+      plane_free(img);
+      return(0);
+   }
+   return(1);
+}
+
+/******************************************************************************
+* Function: write_pgm_tile
+* Purpose: Collective. As write_pgm_rows, but every process writes the region
+* of the image held by img, which needs not be whole rows.
+* Upon failure, this function returns 0.
+******************************************************************************/
+int write_pgm_tile(char *outfilename, plane *img, int rows, int cols,
+    char *comment, int maxval)
+{
+   MPI_File fh;
+   int len, n;
+
+   if((len = open_pgm_rows(outfilename, rows, cols, comment, maxval, &fh))
+      == 0) return(0);
+
+   /***************************************************************************
+   * Write the image data to the file.
+   ***************************************************************************/
+   n = tile_view(fh, len, img, rows, cols, MPI_UNSIGNED_CHAR);
+   MPI_File_write_all(fh, img->data, n, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE);
+   MPI_File_close(&fh);
+   return(1);
+}
+
 /******************************************************************************
 * Function: read_ppm_image
 * Purpose: This function reads in an image in PPM format. The image can be